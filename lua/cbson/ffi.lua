@@ -0,0 +1,191 @@
+-- LuaJIT FFI bindings to cbson C ABI (src/cbson-ffi.h).
+--
+-- Regular cbson functions are lua_CFunction's, and calling them aborts JIT traces.
+-- Functions here call plain C functions through ffi, so hot loops stay compiled.
+--
+-- local cbfi = require("cbson.ffi")
+-- local n = cbfi.int("9007199254740993") -- int64_t cdata
+-- local oid = cbfi.oid("5a1b2c3d4e5f60718293a4b5")
+-- print(oid:timestamp(), tostring(oid))
+-- local value, bson_type = cbfi.get(bson_data, "user.address.city")
+-- for doc in cbfi.documents(mongodump_data) do ... end
+-- local amounts, rows = cbfi.column(cbson.columns(docs, {"amount"}).amount)
+
+local ffi = require("ffi")
+local cbson = require("cbson")
+
+ffi.cdef[[
+typedef struct {
+  uint8_t bytes[12];
+} cbson_ffi_oid_t;
+
+typedef struct {
+  int32_t type;
+  uint32_t len;
+  const uint8_t* data;
+  int64_t integer;
+  double number;
+} cbson_ffi_value_t;
+
+bool cbson_ffi_find(const uint8_t* data, size_t len, const char* path, cbson_ffi_value_t* value);
+int64_t cbson_ffi_next_document(const uint8_t* data, size_t len, size_t offset);
+
+bool cbson_ffi_oid_from_string(const char* str, size_t len, cbson_ffi_oid_t* oid);
+void cbson_ffi_oid_to_string(const cbson_ffi_oid_t* oid, char* str);
+uint32_t cbson_ffi_oid_timestamp(const cbson_ffi_oid_t* oid);
+
+bool cbson_ffi_int64_from_string(const char* str, int64_t* value);
+int cbson_ffi_int64_to_string(int64_t value, char* str);
+
+int memcmp(const void* s1, const void* s2, size_t n);
+]]
+
+-- module is already loaded by require("cbson"), ffi.load just gets its handle
+local C = ffi.load(assert(package.searchpath("cbson", package.cpath), "cbson library not found in package.cpath"))
+
+local _M = {}
+
+local int64_t = ffi.typeof("int64_t")
+local oid_t = ffi.typeof("cbson_ffi_oid_t")
+local value_t = ffi.typeof("cbson_ffi_value_t")
+local const_bytes_t = ffi.typeof("const uint8_t*")
+local double_array_t = ffi.typeof("double[?]")
+local int64_array_t = ffi.typeof("int64_t[?]")
+local strbuf = ffi.new("char[25]")
+local int64 = ffi.new("int64_t[1]")
+local value = value_t()
+
+-- bson types, see bson_type_t
+local DOUBLE, BINARY, UNDEFINED, OID, BOOL = 0x01, 0x05, 0x06, 0x07, 0x08
+local DATE_TIME, NULL, INT32, TIMESTAMP, INT64 = 0x09, 0x0A, 0x10, 0x11, 0x12
+
+ffi.metatype(oid_t, {
+  __tostring = function(oid)
+    C.cbson_ffi_oid_to_string(oid, strbuf)
+    return ffi.string(strbuf, 24)
+  end,
+  __eq = function(a, b)
+    return ffi.istype(oid_t, b) and ffi.C.memcmp(a.bytes, b.bytes, 12) == 0
+  end,
+  __index = {
+    timestamp = function(oid)
+      return tonumber(C.cbson_ffi_oid_timestamp(oid))
+    end,
+  },
+})
+
+-- int64_t cdata from number, numeric string, int64_t cdata or cbson.int. Like cbson.int, decimal
+-- strings keep all 64 bits and anything else ("1e3", "0x10") is converted by lua.
+local function from_string(str)
+  if C.cbson_ffi_int64_from_string(str, int64) then
+    return int64_t(int64[0])
+  end
+  local n = tonumber(str)
+  if not n or n ~= math.floor(n) or n < -2^63 or n >= 2^63 then
+    error("Invalid operand. Expected integer, got '" .. str .. "'")
+  end
+  return int64_t(n)
+end
+
+function _M.int(v)
+  if type(v) == "number" then
+    return int64_t(v)
+  elseif type(v) == "string" then
+    return from_string(v)
+  elseif type(v) == "cdata" then
+    return int64_t(v)
+  end
+  return from_string(tostring(v))
+end
+
+-- cbson_ffi_oid_t cdata from 24-chars hex string or cbson.oid
+function _M.oid(v)
+  local str = tostring(v)
+  local oid = oid_t()
+  if not C.cbson_ffi_oid_from_string(str, #str, oid) then
+    error("Invalid operand. OID should be hex-string 24-chars long")
+  end
+  return oid
+end
+
+-- converts int64_t and oid cdata to cbson userdata, so value can be passed to cbson.encode
+function _M.to_cbson(v)
+  if ffi.istype(oid_t, v) then
+    return cbson.oid(tostring(v))
+  elseif type(v) == "cdata" then
+    local len = C.cbson_ffi_int64_to_string(v, strbuf)
+    return cbson.int(ffi.string(strbuf, len))
+  end
+  return v
+end
+
+-- looks up value by dotted path directly in raw bson, without decoding whole document.
+-- Returns value and its bson type, or nil if path is not found.
+-- int64/date/timestamp are returned as int64_t cdata, documents and arrays as raw bson,
+-- binary as string (subtype is third result), other non-scalar types as raw value bytes.
+function _M.get(bson, path)
+  if not C.cbson_ffi_find(bson, #bson, path, value) then
+    return nil
+  end
+
+  local t = value.type
+  if t == DOUBLE then
+    return value.number, t
+  elseif t == INT32 then
+    return tonumber(value.integer), t
+  elseif t == INT64 or t == DATE_TIME or t == TIMESTAMP then
+    return value.integer, t
+  elseif t == BOOL then
+    return value.integer ~= 0, t
+  elseif t == NULL or t == UNDEFINED then
+    return nil, t
+  elseif t == OID then
+    local oid = oid_t()
+    ffi.copy(oid.bytes, value.data, 12)
+    return oid, t
+  elseif t == BINARY then
+    return ffi.string(value.data, value.len), t, tonumber(value.integer)
+  end
+  -- strings, documents, arrays and the rest
+  return ffi.string(value.data, value.len), t
+end
+
+-- iterates over documents of concatenated bson stream (i.e. mongodump file).
+-- Yields raw document and its offset in data.
+function _M.documents(data)
+  local len = #data
+  local offset = 0
+
+  return function()
+    -- data is passed (not a cached pointer), so closure keeps the string alive
+    local ptr = ffi.cast(const_bytes_t, data)
+    local size = C.cbson_ffi_next_document(ptr, len, offset)
+    if size == 0 then
+      return nil
+    elseif size < 0 then
+      error("Truncated or malformed document at offset " .. offset)
+    end
+    local doc_offset = offset
+    offset = offset + tonumber(size)
+    return ffi.string(ptr + doc_offset, size), doc_offset
+  end
+end
+
+-- copies packed column of cbson.columns() into double[?] or int64_t[?] cdata (indexed from 0).
+-- Returns array and number of rows; row i is missing when bit (i % 8) of nulls byte (i // 8) is set.
+function _M.column(column)
+  local array_t
+  if column.type == "double" then
+    array_t = double_array_t
+  elseif column.type == "int64" then
+    array_t = int64_array_t
+  else
+    error("Column of type " .. tostring(column.type) .. " isn't packed")
+  end
+  local rows = #column.data / 8
+  local array = array_t(rows)
+  ffi.copy(array, column.data, #column.data)
+  return array, rows
+end
+
+return _M
@@ -2,6 +2,11 @@
 
 bson = require("cbson")
 
+-- loaded by cbson.parallel_scan as worker script (worker states have no arg table)
+if not arg then
+  return function(dt) return bson.to_json(dt) .. "\n" end
+end
+
 function readAll(file)
     local f = io.open(file, "rb")
     local current = f:seek()
@@ -12,11 +17,23 @@ function readAll(file)
     return content, size
 end
 
+local threads
+if arg[1] == "-j" then
+  threads = tonumber(arg[2])
+  table.remove(arg, 1)
+  table.remove(arg, 1)
+end
+
 if not arg[1] then
-  print("Usage: mongodump-decode.lua <filename.bson>")
+  print("Usage: mongodump-decode.lua [-j threads] <filename.bson>")
   return -1
 end
 
+if threads then
+  bson.parallel_scan(arg[1], arg[0], {threads = threads}) -- output is written in file order
+  return
+end
+
 local data, size = readAll(arg[1]) -- 
 local pos = 1  -- lua indexes start from 1
 
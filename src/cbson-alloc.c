@@ -0,0 +1,352 @@
+#include <lauxlib.h>
+#include <bson.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cbson-alloc.h"
+#include "cbson-util.h"
+#include "cbson-scan.h"
+
+// Only arena blocks have header. Everything else is plain malloc memory, including blocks libbson
+// allocated before vtable was installed, so pointers outside of arena chunks go to libc.
+typedef struct {
+  size_t size;
+} cbson_block_t;
+
+#define ALIGN16(n) (((n) + 15) & ~(size_t)15)
+#define BLOCK_HEADER ALIGN16(sizeof(cbson_block_t))
+#define BLOCK_DATA(b) ((void*)((char*)(b) + BLOCK_HEADER))
+#define DATA_BLOCK(p) ((cbson_block_t*)((char*)(p) - BLOCK_HEADER))
+
+typedef struct cbson_arena_chunk_s {
+  struct cbson_arena_chunk_s* prev;
+  size_t size;
+  size_t used;
+} cbson_arena_chunk_t;
+
+#define CHUNK_HEADER ALIGN16(sizeof(cbson_arena_chunk_t))
+#define CHUNK_DATA(c) ((char*)(c) + CHUNK_HEADER)
+
+int cbson_alloc_mode = CBSON_ALLOC_SYSTEM;
+
+static int vtable_installed = 0;
+
+static bool arena_active = false;
+static int arena_depth = 0;
+static cbson_arena_chunk_t* arena = NULL;
+static cbson_block_t* arena_last = NULL;
+
+static cbson_block_t* arena_alloc(size_t size)
+{
+  size_t need = BLOCK_HEADER + ALIGN16(size);
+  cbson_block_t* block;
+
+  if (!arena || arena->used + need > arena->size)
+  {
+    size_t chunk_size = arena ? arena->size * 2 : CBSON_ARENA_CHUNK;
+    cbson_arena_chunk_t* chunk;
+
+    if (chunk_size < need)
+    {
+      chunk_size = need;
+    }
+
+    chunk = malloc(CHUNK_HEADER + chunk_size);
+    if (!chunk)
+    {
+      return NULL;
+    }
+
+    chunk->prev = arena;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    arena = chunk;
+  }
+
+  block = (cbson_block_t*)(CHUNK_DATA(arena) + arena->used);
+  block->size = size;
+  arena->used += need;
+  arena_last = block;
+
+  return block;
+}
+
+static bool arena_owns(const void* mem)
+{
+  cbson_arena_chunk_t* chunk;
+
+  for (chunk = arena; chunk; chunk = chunk->prev)
+  {
+    if ((const char*)mem >= CHUNK_DATA(chunk) && (const char*)mem < CHUNK_DATA(chunk) + chunk->size)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// grows or shrinks last allocated block in place
+static bool arena_resize(cbson_block_t* block, size_t size)
+{
+  size_t offset;
+
+  if (block != arena_last)
+  {
+    return false;
+  }
+
+  offset = (char*)block - CHUNK_DATA(arena);
+  if (offset + BLOCK_HEADER + ALIGN16(size) > arena->size)
+  {
+    return false;
+  }
+
+  arena->used = offset + BLOCK_HEADER + ALIGN16(size);
+  block->size = size;
+  return true;
+}
+
+// releases everything, chunks are merged into one for the next call
+static void arena_reset(void)
+{
+  arena_last = NULL;
+
+  if (!arena)
+  {
+    return;
+  }
+
+  if (arena->prev || arena->size > CBSON_ARENA_RETAIN)
+  {
+    size_t total = 0;
+
+    while (arena)
+    {
+      cbson_arena_chunk_t* prev = arena->prev;
+      total += arena->size;
+      free(arena);
+      arena = prev;
+    }
+
+    if (total <= CBSON_ARENA_RETAIN)
+    {
+      arena = malloc(CHUNK_HEADER + total);
+      if (arena)
+      {
+        arena->prev = NULL;
+        arena->size = total;
+      }
+    }
+  }
+
+  if (arena)
+  {
+    arena->used = 0;
+  }
+}
+
+void cbson_arena_enter(cbson_arena_scope_t* scope, bool transient)
+{
+  scope->engaged = cbson_alloc_mode == CBSON_ALLOC_ARENA;
+  if (!scope->engaged)
+  {
+    return;
+  }
+
+  scope->active = arena_active;
+  scope->chunk = arena;
+  scope->used = arena ? arena->used : 0;
+  scope->last = arena_last;
+
+  arena_active = transient;
+  arena_depth++;
+}
+
+void cbson_arena_leave(cbson_arena_scope_t* scope)
+{
+  if (!scope->engaged)
+  {
+    return;
+  }
+
+  arena_active = scope->active;
+  if (--arena_depth == 0)
+  {
+    arena_reset();
+    return;
+  }
+
+  // blocks of enclosing scopes are older than the mark, so they stay
+  while (arena != scope->chunk)
+  {
+    cbson_arena_chunk_t* prev = arena->prev;
+    free(arena);
+    arena = prev;
+  }
+
+  if (arena)
+  {
+    arena->used = scope->used;
+  }
+  arena_last = scope->last;
+}
+
+static int arena_call(lua_State* L, lua_CFunction f, bool transient)
+{
+  cbson_arena_scope_t scope;
+  int status;
+
+  if (cbson_alloc_mode != CBSON_ALLOC_ARENA)
+  {
+    return f(L);
+  }
+
+  cbson_arena_enter(&scope, transient);
+  status = cbson_pcall(L, f, lua_gettop(L), LUA_MULTRET);
+  cbson_arena_leave(&scope);
+
+  if (status != 0)
+  {
+    return lua_error(L);
+  }
+
+  return lua_gettop(L);
+}
+
+int cbson_arena_call(lua_State* L, lua_CFunction f)
+{
+  return arena_call(L, f, true);
+}
+
+int cbson_persistent_call(lua_State* L, lua_CFunction f)
+{
+  return arena_call(L, f, false);
+}
+
+static void* cbson_malloc(size_t size)
+{
+  cbson_block_t* block;
+
+  if (!arena_active)
+  {
+    return malloc(size);
+  }
+
+  block = arena_alloc(size);
+  return block ? BLOCK_DATA(block) : NULL;
+}
+
+static void* cbson_calloc(size_t n, size_t size)
+{
+  void* mem;
+
+  if (!arena_active)
+  {
+    return calloc(n, size);
+  }
+
+  if (size && n > SIZE_MAX / size)
+  {
+    return NULL;
+  }
+
+  mem = cbson_malloc(n * size);
+  if (mem)
+  {
+    memset(mem, 0, n * size);
+  }
+
+  return mem;
+}
+
+static void cbson_free(void* mem)
+{
+  cbson_block_t* block;
+
+  if (!mem)
+  {
+    return;
+  }
+
+  if (!arena_owns(mem))
+  {
+    free(mem);
+    return;
+  }
+
+  // only last block is given back, the rest is released with the scope
+  block = DATA_BLOCK(mem);
+  if (block == arena_last)
+  {
+    arena->used = (char*)block - CHUNK_DATA(arena);
+    arena_last = NULL;
+  }
+}
+
+static void* cbson_realloc(void* mem, size_t size)
+{
+  cbson_block_t* block;
+  void* res;
+
+  if (!mem)
+  {
+    return cbson_malloc(size);
+  }
+
+  // system blocks stay system, even in transient scope
+  if (!arena_owns(mem))
+  {
+    return realloc(mem, size);
+  }
+
+  block = DATA_BLOCK(mem);
+  if (arena_active && arena_resize(block, size))
+  {
+    return mem;
+  }
+
+  res = cbson_malloc(size);
+  if (res)
+  {
+    memcpy(res, mem, block->size < size ? block->size : size);
+  }
+  return res;
+}
+
+static const bson_mem_vtable_t cbson_vtable = {
+  .malloc = cbson_malloc,
+  .calloc = cbson_calloc,
+  .realloc = cbson_realloc,
+  .free = cbson_free
+};
+
+int cbson_set_allocator(lua_State* L)
+{
+  static const char* modes[] = {"system", "arena", NULL};
+  int prev = cbson_alloc_mode;
+  int mode = luaL_checkoption(L, 1, NULL, modes);
+
+  if (cbson_scan_active)
+  {
+    luaL_error(L, "Can't change allocator while parallel_scan is running");
+  }
+
+  if (arena_depth > 0)
+  {
+    luaL_error(L, "Can't change allocator inside of cbson call");
+  }
+
+  // once installed, vtable stays: it passes non-arena memory to libc anyway
+  if (mode != CBSON_ALLOC_SYSTEM && !vtable_installed)
+  {
+    bson_mem_set_vtable(&cbson_vtable);
+    vtable_installed = 1;
+  }
+
+  cbson_alloc_mode = mode;
+
+  lua_pushstring(L, modes[prev]);
+  return 1;
+}
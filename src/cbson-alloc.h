@@ -0,0 +1,43 @@
+#ifndef __CBSON_ALLOC_H__
+#define __CBSON_ALLOC_H__
+
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CBSON_ALLOC_SYSTEM 0
+#define CBSON_ALLOC_ARENA  1
+
+// first arena chunk size, chunks up to CBSON_ARENA_RETAIN are kept between calls
+#ifndef CBSON_ARENA_CHUNK
+#define CBSON_ARENA_CHUNK  (64 * 1024)
+#endif
+
+#ifndef CBSON_ARENA_RETAIN
+#define CBSON_ARENA_RETAIN (4 * 1024 * 1024)
+#endif
+
+extern int cbson_alloc_mode;
+
+// Transient scope takes libbson allocations from arena and gives them back on leave, persistent scope
+// turns arena off for memory which outlives the call. Scopes nest and are left in reverse order, so
+// nothing between enter and leave may raise: the call runs in protected mode.
+typedef struct {
+  bool engaged;       // arena mode was on at enter
+  bool active;        // arena state of enclosing scope
+  void* chunk;        // newest chunk and its use at enter
+  size_t used;
+  void* last;
+} cbson_arena_scope_t;
+
+void cbson_arena_enter(cbson_arena_scope_t* scope, bool transient);
+void cbson_arena_leave(cbson_arena_scope_t* scope);
+
+// Run f in transient or persistent scope. Outside of arena mode f is called directly, otherwise
+// under protected call, error is raised again once the scope is left.
+int cbson_arena_call(lua_State* L, lua_CFunction f);
+int cbson_persistent_call(lua_State* L, lua_CFunction f);
+
+int cbson_set_allocator(lua_State* L);
+
+#endif
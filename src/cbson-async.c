@@ -0,0 +1,263 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+
+#include "cbson.h"
+#include "cbson-async.h"
+#include "cbson-util.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+
+DEFINE_CHECK(DECODE_JOB, decode_job)
+DEFINE_CHECK(ENCODE_JOB, encode_job)
+
+static int check_budget(lua_State* L, int index)
+{
+  int budget = luaL_optint(L, index, CBSON_DEFAULT_JOB_BUDGET);
+
+  if (budget < 1)
+  {
+    luaL_error(L, "Invalid budget, expected positive number");
+  }
+
+  return budget;
+}
+
+int cbson_decode_job_new(lua_State* L)
+{
+  cbson_decode_job_t* job;
+
+  luaL_checkstring(L, 1);
+
+  job = lua_newuserdata(L, sizeof(cbson_decode_job_t));
+  job->ref = LUA_NOREF;
+  job->done = true; // until init succeeds
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_JOB);
+
+  luaL_getmetatable(L, DECODE_JOB_METATABLE);
+  lua_setmetatable(L, -2);
+
+  cbson_decode_job_init(L, job, 1);
+  return 1;
+}
+
+static int encode_job_new_call(lua_State* L)
+{
+  cbson_encode_job_t* job;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  job = lua_newuserdata(L, sizeof(cbson_encode_job_t));
+  memset(job, 0, sizeof(cbson_encode_job_t));
+  job->ref = LUA_NOREF;
+  job->done = true; // until init succeeds
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_JOB);
+
+  luaL_getmetatable(L, ENCODE_JOB_METATABLE);
+  lua_setmetatable(L, -2);
+
+  cbson_encode_job_init(L, job, 1);
+  return 1;
+}
+
+// frames are kept by job between steps, they can't come from arena
+int cbson_encode_job_new(lua_State* L)
+{
+  return cbson_persistent_call(L, encode_job_new_call);
+}
+
+// job:step([budget]) - returns true and result when job is done, false otherwise
+static int step_result(lua_State* L, bool done)
+{
+  if (!done)
+  {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  lua_pushboolean(L, 1);
+  lua_insert(L, -2);
+  return 2;
+}
+
+int cbson_decode_job_step(lua_State* L)
+{
+  cbson_decode_job_t* job = check_cbson_decode_job(L, 1);
+  int budget = check_budget(L, 2);
+  bool done;
+
+  if (job->done)
+  {
+    luaL_error(L, "Job is already done");
+  }
+
+  done = cbson_decode_job_run(L, job, budget);
+  if (done)
+  {
+    luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+    job->ref = LUA_NOREF;
+  }
+
+  return step_result(L, done);
+}
+
+// pushes done flag after result
+static int encode_job_run_call(lua_State* L)
+{
+  cbson_encode_job_t* job = (cbson_encode_job_t*)lua_touserdata(L, 1);
+  int budget = (int)lua_tointeger(L, 2);
+
+  lua_pushboolean(L, cbson_encode_job_run(L, job, budget));
+  return lua_gettop(L) - 2;
+}
+
+static int encode_job_step_call(lua_State* L)
+{
+  cbson_encode_job_t* job = check_cbson_encode_job(L, 1);
+  int budget = check_budget(L, 2);
+  bool done;
+
+  if (job->failed)
+  {
+    luaL_error(L, "Job has failed");
+  }
+
+  if (job->done)
+  {
+    luaL_error(L, "Job is already done");
+  }
+
+  // element may fail to encode with frames left half written
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, budget);
+  if (cbson_pcall(L, encode_job_run_call, 2, LUA_MULTRET) != 0)
+  {
+    luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+    job->ref = LUA_NOREF;
+    job->done = true;
+    job->failed = true;
+    cbson_encode_job_destroy(job);
+    return lua_error(L);
+  }
+
+  done = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (done)
+  {
+    luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+    job->ref = LUA_NOREF;
+  }
+
+  return step_result(L, done);
+}
+
+int cbson_encode_job_step(lua_State* L)
+{
+  return cbson_persistent_call(L, encode_job_step_call);
+}
+
+int cbson_decode_job_done(lua_State* L)
+{
+  lua_pushboolean(L, check_cbson_decode_job(L, 1)->done);
+  return 1;
+}
+
+int cbson_encode_job_done(lua_State* L)
+{
+  lua_pushboolean(L, check_cbson_encode_job(L, 1)->done);
+  return 1;
+}
+
+int cbson_decode_job_gc(lua_State* L)
+{
+  cbson_decode_job_t* job = check_cbson_decode_job(L, 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+  job->ref = LUA_NOREF;
+  job->done = true;
+  return 0;
+}
+
+int cbson_encode_job_gc(lua_State* L)
+{
+  cbson_encode_job_t* job = check_cbson_encode_job(L, 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+  job->ref = LUA_NOREF;
+  job->done = true;
+  cbson_encode_job_destroy(job);
+  return 0;
+}
+
+int cbson_decode_job_tostring(lua_State* L)
+{
+  cbson_decode_job_t* job = check_cbson_decode_job(L, 1);
+
+  lua_pushfstring(L, "decode job (%s)", job->done ? "done" : "pending");
+  return 1;
+}
+
+int cbson_encode_job_tostring(lua_State* L)
+{
+  cbson_encode_job_t* job = check_cbson_encode_job(L, 1);
+
+  lua_pushfstring(L, "encode job (%s)", job->failed ? "failed" : job->done ? "done" : "pending");
+  return 1;
+}
+
+const struct luaL_Reg cbson_decode_job_meta[] = {
+  {"__tostring", cbson_decode_job_tostring},
+  {"__gc",       cbson_decode_job_gc},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_decode_job_methods[] = {
+  {"step", cbson_decode_job_step},
+  {"done", cbson_decode_job_done},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_encode_job_meta[] = {
+  {"__tostring", cbson_encode_job_tostring},
+  {"__gc",       cbson_encode_job_gc},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_encode_job_methods[] = {
+  {"step", cbson_encode_job_step},
+  {"done", cbson_encode_job_done},
+  {NULL, NULL}
+};
+
+// Lua 5.1 and LuaJIT can't resume C function after lua_yield, so decode_async/encode_async
+// drive jobs from lua. Without yield option they never yield, so they are safe in coroutine.wrap iterators.
+static const char async_chunk[] =
+  "local decode_job, encode_job = ...\n"
+  "local function run(job, options)\n"
+  "  local budget = options and options.budget\n"
+  "  local yield = options and options.yield\n"
+  "  if yield == true then yield = coroutine.yield end\n"
+  "  while true do\n"
+  "    local done, result = job:step(budget)\n"
+  "    if done then return result end\n"
+  "    if yield then yield() end\n"
+  "  end\n"
+  "end\n"
+  "return function(bson, options) return run(decode_job(bson), options) end,\n"
+  "       function(data, options) return run(encode_job(data), options) end\n";
+
+// sets decode_async and encode_async of module table on top of the stack
+void cbson_async_register(lua_State* L)
+{
+  if (luaL_loadbuffer(L, async_chunk, sizeof(async_chunk) - 1, "=cbson.async") != 0)
+  {
+    lua_error(L);
+  }
+
+  lua_pushcfunction(L, cbson_decode_job_new);
+  lua_pushcfunction(L, cbson_encode_job_new);
+  lua_call(L, 2, 2);
+
+  lua_setfield(L, -3, "encode_async");
+  lua_setfield(L, -2, "decode_async");
+}
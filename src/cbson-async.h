@@ -0,0 +1,75 @@
+#ifndef __CBSON_ASYNC_H__
+#define __CBSON_ASYNC_H__
+
+#include <lua.h>
+#include <bson.h>
+#include <stdbool.h>
+
+#include "cbson.h"
+
+#define DECODE_JOB_METATABLE "bson-decode-job metatable"
+#define ENCODE_JOB_METATABLE "bson-encode-job metatable"
+
+// elements processed by one step, if not given
+#define CBSON_DEFAULT_JOB_BUDGET 1000
+
+// Jobs keep their state between steps instead of C stack, so work can be split into budgets
+// and lua code can yield in between. Tables and strings used by job are anchored in registry
+// table (ref), frames point into them.
+
+typedef struct {
+  const uint8_t* p;      // next element
+  const uint8_t* limit;  // trailing NUL of document
+  const uint8_t* key;    // key of child document being decoded
+  size_t key_len;
+  int count;             // elements set so far (array index)
+  bool keys;             // document or array
+} cbson_decode_frame_t;
+
+typedef struct {
+  int ref;   // anchor: [1] = bson string, [level + 2] = table of frame
+  int level;
+  bool done;
+  cbson_decode_frame_t frames[BSON_MAX_RECURSION + 1];
+} cbson_decode_job_t;
+
+#define CBSON_ENCODE_MAP     0
+#define CBSON_ENCODE_ARRAY   1
+#define CBSON_ENCODE_ORDERED 2
+#define CBSON_ENCODE_FLAT    3  // cbson.ordered, count is number of pairs done
+
+typedef struct {
+  void* mem;     // allocated on first use, bson_t must not move while it has open child
+  bson_t* bson;  // aligned in mem, as bson_t requires
+  int kind;
+  int count;     // array index
+} cbson_encode_frame_t;
+
+typedef struct {
+  int ref;   // anchor: [2 * level + 1] = table of frame, [2 * level + 2] = last key passed to lua_next
+  int level;
+  bool done;
+  bool failed;  // step raised, frames are destroyed and job can't continue
+  cbson_encode_frame_t frames[BSON_MAX_RECURSION + 1];
+} cbson_encode_job_t;
+
+// implemented in cbson-decode.c and cbson-encode.c, run returns true and pushes result when job is done
+void cbson_decode_job_init(lua_State* L, cbson_decode_job_t* job, int index);
+bool cbson_decode_job_run(lua_State* L, cbson_decode_job_t* job, int budget);
+void cbson_encode_job_init(lua_State* L, cbson_encode_job_t* job, int index);
+bool cbson_encode_job_run(lua_State* L, cbson_encode_job_t* job, int budget);
+void cbson_encode_job_destroy(cbson_encode_job_t* job);
+
+int cbson_decode_job_new(lua_State* L);
+int cbson_encode_job_new(lua_State* L);
+void cbson_async_register(lua_State* L);
+
+cbson_decode_job_t* check_cbson_decode_job(lua_State *L, int index);
+cbson_encode_job_t* check_cbson_encode_job(lua_State *L, int index);
+
+extern const struct luaL_Reg cbson_decode_job_meta[];
+extern const struct luaL_Reg cbson_decode_job_methods[];
+extern const struct luaL_Reg cbson_encode_job_meta[];
+extern const struct luaL_Reg cbson_encode_job_methods[];
+
+#endif
@@ -5,7 +5,9 @@
 #include <stdlib.h>
 
 #include "cbson.h"
+#include "cbson-util.h"
 #include "cbson-binary.h"
+#include "cbson-stats.h"
 #include "compat/base64.h"
 
 DEFINE_CHECK(BINARY, binary)
@@ -68,6 +70,7 @@ void cbson_binary_from_raw(cbson_binary_t* a, const char* binary, unsigned int s
 cbson_binary_t* cbson_binary_create(lua_State* L, uint8_t type, const char* binary, unsigned int size)
 {
   cbson_binary_t* ud = lua_newuserdata(L, sizeof(cbson_binary_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_BINARY);
 
   ud->type = type;
   ud->data = NULL;
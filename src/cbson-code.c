@@ -5,12 +5,14 @@
 
 #include "cbson.h"
 #include "cbson-code.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(CODE, code)
 
 int cbson_code_create(lua_State* L, const char* code)
 {
   cbson_code_t* ud = lua_newuserdata(L, sizeof(cbson_code_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_CODE);
 
   ud->code = malloc(strlen(code)+1);
   strcpy(ud->code, code);
@@ -61,6 +63,7 @@ DEFINE_CHECK(CODEWSCOPE, codewscope)
 int cbson_codewscope_create(lua_State* L, const char* code)
 {
   cbson_codewscope_t* ud = lua_newuserdata(L, sizeof(cbson_codewscope_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_CODEWSCOPE);
 
   ud->code = malloc(strlen(code)+1);
   strcpy(ud->code, code);
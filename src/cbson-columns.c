@@ -0,0 +1,536 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cbson.h"
+#include "cbson-util.h"
+#include "cbson-columns.h"
+#include "cbson-decode.h"
+#include "cbson-int.h"
+#include "cbson-stats.h"
+
+#define FIRST_CAPACITY 64
+
+static void set_present(cbson_column_t* col, size_t row)
+{
+  col->nulls[row >> 3] &= (uint8_t)~(1u << (row & 7));
+}
+
+static bool is_present(const cbson_column_t* col, size_t row)
+{
+  return !(col->nulls[row >> 3] & (1u << (row & 7)));
+}
+
+// replaces buffer at slot with bigger one, first used bytes are kept and the rest is filled
+static uint8_t* grow_buffer(lua_State* L, int slot, size_t size, size_t used, uint8_t fill)
+{
+  const uint8_t* old = (const uint8_t*)lua_touserdata(L, slot);
+  uint8_t* buf = (uint8_t*)lua_newuserdata(L, size);
+
+  if (old && used)
+  {
+    memcpy(buf, old, used);
+  }
+  memset(buf + used, fill, size - used);
+  lua_replace(L, slot);
+  return buf;
+}
+
+static void grow_columns(lua_State* L, cbson_columns_t* c)
+{
+  size_t capacity = c->capacity ? c->capacity * 2 : FIRST_CAPACITY;
+  int i;
+
+  for (i = 0; i < c->count; i++)
+  {
+    cbson_column_t* col = &c->columns[i];
+
+    col->nulls = grow_buffer(L, col->slot + 1, capacity / 8, c->capacity / 8, 0xFF);
+    if (col->data)
+    {
+      col->data = grow_buffer(L, col->slot, capacity * 8, c->capacity * 8, 0);
+    }
+  }
+  c->capacity = capacity;
+}
+
+static void push_int64(lua_State* L, int64_t value)
+{
+#ifdef CBSON_NATIVE_INTEGERS
+  lua_pushinteger(L, value);
+#else
+  cbson_int64_create(L, value);
+#endif
+}
+
+static void packed_column(lua_State* L, cbson_columns_t* c, cbson_column_t* col, int kind)
+{
+  col->data = grow_buffer(L, col->slot, c->capacity * 8, 0, 0);
+  col->kind = kind;
+}
+
+void cbson_column_double(lua_State* L, cbson_columns_t* c, cbson_column_t* col, double value)
+{
+  size_t i;
+
+  switch (col->kind)
+  {
+    case CBSON_COLUMN_VALUE:
+      lua_pushnumber(L, value);
+      cbson_column_value(L, c, col);
+      return;
+
+    case CBSON_COLUMN_INT64:
+      // converted in place, both are 8 bytes
+      for (i = 0; i < c->rows; i++)
+      {
+        ((double*)col->data)[i] = (double)((int64_t*)col->data)[i];
+      }
+      col->kind = CBSON_COLUMN_DOUBLE;
+      break;
+
+    case CBSON_COLUMN_NONE:
+      packed_column(L, c, col, CBSON_COLUMN_DOUBLE);
+      break;
+  }
+
+  ((double*)col->data)[c->rows] = value;
+  set_present(col, c->rows);
+}
+
+void cbson_column_int64(lua_State* L, cbson_columns_t* c, cbson_column_t* col, int64_t value)
+{
+  switch (col->kind)
+  {
+    case CBSON_COLUMN_VALUE:
+      push_int64(L, value);
+      cbson_column_value(L, c, col);
+      return;
+
+    case CBSON_COLUMN_DOUBLE:
+      ((double*)col->data)[c->rows] = (double)value;
+      set_present(col, c->rows);
+      return;
+
+    case CBSON_COLUMN_NONE:
+      packed_column(L, c, col, CBSON_COLUMN_INT64);
+      break;
+  }
+
+  ((int64_t*)col->data)[c->rows] = value;
+  set_present(col, c->rows);
+}
+
+void cbson_column_value(lua_State* L, cbson_columns_t* c, cbson_column_t* col)
+{
+  if (col->kind != CBSON_COLUMN_VALUE)
+  {
+    size_t i;
+
+    // numbers collected so far are moved to lua array, value to store stays on top
+    lua_createtable(L, (int)c->rows, 0);
+    for (i = 0; col->data && i < c->rows; i++)
+    {
+      if (is_present(col, i))
+      {
+        if (col->kind == CBSON_COLUMN_DOUBLE)
+        {
+          lua_pushnumber(L, ((double*)col->data)[i]);
+        }
+        else
+        {
+          push_int64(L, ((int64_t*)col->data)[i]);
+        }
+        lua_rawseti(L, -2, (int)i + 1);
+      }
+    }
+    lua_replace(L, col->slot);
+    col->data = NULL;
+    col->kind = CBSON_COLUMN_VALUE;
+  }
+
+  lua_rawseti(L, col->slot, (int)c->rows + 1);
+  set_present(col, c->rows);
+}
+
+// adds path to tree of nodes, returns false if path is empty, has empty key or is duplicate
+static bool add_path(cbson_columns_t* c, const char* path, size_t len, int column)
+{
+  int node = 0;
+  const char* end = path + len;
+
+  for (;;)
+  {
+    const char* dot = memchr(path, '.', end - path);
+    size_t key_len = (dot ? dot : end) - path;
+    int child;
+
+    if (key_len == 0)
+    {
+      return false;
+    }
+
+    for (child = c->nodes[node].child; child >= 0; child = c->nodes[child].next)
+    {
+      if (c->nodes[child].key_len == key_len && memcmp(c->nodes[child].key, path, key_len) == 0)
+      {
+        break;
+      }
+    }
+
+    if (child < 0)
+    {
+      child = c->node_count++;
+      c->nodes[child].key = path;
+      c->nodes[child].key_len = key_len;
+      c->nodes[child].column = -1;
+      c->nodes[child].child = -1;
+      c->nodes[child].next = c->nodes[node].child;
+      c->nodes[node].child = child;
+    }
+    node = child;
+
+    if (!dot)
+    {
+      break;
+    }
+    path = dot + 1;
+  }
+
+  if (c->nodes[node].column >= 0)
+  {
+    return false;
+  }
+  c->nodes[node].column = column;
+  return true;
+}
+
+// pushes {type = ..., data = ... or values = ..., nulls = ..., null_count = ...}
+static void push_column(lua_State* L, cbson_columns_t* c, cbson_column_t* col)
+{
+  size_t null_count = 0;
+  size_t i;
+
+  lua_createtable(L, 0, 4);
+
+  switch (col->kind)
+  {
+    case CBSON_COLUMN_DOUBLE:
+    case CBSON_COLUMN_INT64:
+      lua_pushstring(L, col->kind == CBSON_COLUMN_DOUBLE ? "double" : "int64");
+      lua_setfield(L, -2, "type");
+      lua_pushlstring(L, (const char*)col->data, c->rows * 8);
+      lua_setfield(L, -2, "data");
+      break;
+
+    default:
+      lua_pushstring(L, "value");
+      lua_setfield(L, -2, "type");
+      if (col->kind == CBSON_COLUMN_VALUE)
+      {
+        lua_pushvalue(L, col->slot);
+      }
+      else
+      {
+        lua_newtable(L);
+      }
+      lua_setfield(L, -2, "values");
+      break;
+  }
+
+  // bits past the last row are cleared
+  if (c->rows & 7)
+  {
+    col->nulls[c->rows >> 3] &= (uint8_t)((1u << (c->rows & 7)) - 1);
+  }
+  for (i = 0; i < c->rows; i++)
+  {
+    null_count += !is_present(col, i);
+  }
+
+  lua_pushlstring(L, c->rows ? (const char*)col->nulls : "", (c->rows + 7) / 8);
+  lua_setfield(L, -2, "nulls");
+  lua_pushinteger(L, (lua_Integer)null_count);
+  lua_setfield(L, -2, "null_count");
+}
+
+// Skips element of column walk, unlike cbson_skip_value strings aren't checked for utf8 and documents are
+// skipped by their size.
+static const uint8_t* skip_element(uint8_t type, const uint8_t* p, const uint8_t* limit)
+{
+  uint32_t len;
+
+  switch (type)
+  {
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL:
+      return cbson_check_string(p, limit, &len) ? p + 4 + len : NULL;
+
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+      return cbson_check_subdocument(p, limit, &len) ? p + len : NULL;
+
+    default:
+      return cbson_skip_value(type, p, limit);
+  }
+}
+
+// numbers go to packed columns, null and undefined leave value missing, the rest is decoded as by decode
+static const uint8_t* column_element(lua_State* L, cbson_columns_t* c, cbson_column_t* col, uint8_t type,
+                                     const uint8_t* p, const uint8_t* limit, uint32_t depth)
+{
+  const uint8_t* next;
+
+  switch (type)
+  {
+    case BSON_TYPE_DOUBLE:
+      if (limit - p < 8) return NULL;
+      cbson_column_double(L, c, col, cbson_read_double(p));
+      return p + 8;
+
+    case BSON_TYPE_INT32:
+      if (limit - p < 4) return NULL;
+      cbson_column_int64(L, c, col, (int32_t)cbson_read_uint32(p));
+      return p + 4;
+
+    case BSON_TYPE_INT64:
+      if (limit - p < 8) return NULL;
+      cbson_column_int64(L, c, col, (int64_t)cbson_read_uint64(p));
+      return p + 8;
+
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_UNDEFINED:
+      return p;
+
+    default:
+      next = cbson_decode_value(L, type, p, limit, depth, NULL, false);
+      if (next)
+      {
+        cbson_column_value(L, c, col);
+      }
+      return next;
+  }
+}
+
+// Visits only elements on requested paths, corrupt element stops walk of this document like in decode_document
+static void columns_document(lua_State* L, cbson_columns_t* c, int node, const uint8_t* data, uint32_t len, uint32_t depth)
+{
+  const uint8_t* limit = data + len - 1;
+  const uint8_t* p = data + 4;
+
+  while (p < limit)
+  {
+    uint8_t type = *p++;
+    const uint8_t* key = p;
+    const uint8_t* key_end = memchr(key, 0, limit - key);
+    const uint8_t* next = NULL;
+    int child;
+
+    if (!key_end)
+    {
+      break;
+    }
+
+    for (child = c->nodes[node].child; child >= 0; child = c->nodes[child].next)
+    {
+      if (c->nodes[child].key_len == (size_t)(key_end - key) && memcmp(c->nodes[child].key, key, key_end - key) == 0)
+      {
+        break;
+      }
+    }
+    p = key_end + 1;
+
+    if (child >= 0 && c->nodes[child].column >= 0)
+    {
+      next = column_element(L, c, &c->columns[c->nodes[child].column], type, p, limit, depth + 1);
+      if (!next)
+      {
+        break;
+      }
+    }
+
+    if (child >= 0 && c->nodes[child].child >= 0 && (type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY))
+    {
+      uint32_t doc_len;
+
+      if (!cbson_check_subdocument(p, limit, &doc_len))
+      {
+        break;
+      }
+      columns_document(L, c, child, p, doc_len, depth + 1);
+      next = p + doc_len;
+    }
+
+    if (!next && !(next = skip_element(type, p, limit)))
+    {
+      break;
+    }
+    p = next;
+  }
+}
+
+// walks document once and stores values of current row
+static void add_row(lua_State* L, cbson_columns_t* c, const uint8_t* data, size_t len)
+{
+  cbson_check_data(L, data, len);
+  if (c->rows == c->capacity)
+  {
+    grow_columns(L, c);
+  }
+  columns_document(L, c, 0, data, (uint32_t)len, 0);
+  c->rows++;
+}
+
+// cbson.columns(documents, paths) - documents are array or iterator of bson strings, or concatenated bson
+// (mongodump) string. Returns table of columns by path and number of rows.
+int cbson_columns(lua_State* L)
+{
+  cbson_columns_t c;
+  size_t bytes = 0;
+  int source = lua_type(L, 1);
+  int count, nodes, base, i;
+  CBSON_STATS_BEGIN();
+
+  if (source != LUA_TTABLE && source != LUA_TFUNCTION && source != LUA_TSTRING)
+  {
+    luaL_argerror(L, 1, "expected table, function or string");
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+
+  count = (int)cbson_objlen(L, 2);
+  if (count < 1)
+  {
+    luaL_error(L, "Expected at least one path");
+  }
+
+  // every key of every path may become a node, plus root
+  nodes = 1;
+  for (i = 1; i <= count; i++)
+  {
+    size_t len;
+    const char* path;
+
+    lua_rawgeti(L, 2, i);
+    path = lua_tolstring(L, -1, &len);
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+      luaL_error(L, "Invalid path %d, expected string", i);
+    }
+    for (; len > 0; len--)
+    {
+      nodes += path[len - 1] == '.';
+    }
+    nodes++;
+    lua_pop(L, 1);
+  }
+
+  memset(&c, 0, sizeof(c));
+  c.count = count;
+  c.columns = (cbson_column_t*)lua_newuserdata(L, count * sizeof(cbson_column_t));
+  c.nodes = (cbson_column_node_t*)lua_newuserdata(L, nodes * sizeof(cbson_column_node_t));
+  c.nodes[0].column = -1;
+  c.nodes[0].child = -1;
+  c.nodes[0].next = -1;
+  c.node_count = 1;
+
+  // path strings are anchored by paths table
+  for (i = 1; i <= count; i++)
+  {
+    size_t len;
+    const char* path;
+
+    lua_rawgeti(L, 2, i);
+    path = lua_tolstring(L, -1, &len);
+    lua_pop(L, 1);
+
+    if (!add_path(&c, path, len, i - 1))
+    {
+      luaL_error(L, "Invalid or duplicate path '%s'", path);
+    }
+  }
+
+  luaL_checkstack(L, 2 * count + LUA_MINSTACK, "too many columns");
+  base = lua_gettop(L) + 1;
+  for (i = 0; i < count; i++)
+  {
+    c.columns[i].kind = CBSON_COLUMN_NONE;
+    c.columns[i].slot = base + 2 * i;
+    c.columns[i].data = NULL;
+    c.columns[i].nulls = NULL;
+    lua_pushnil(L);
+    lua_pushnil(L);
+  }
+
+  if (source == LUA_TSTRING)
+  {
+    size_t len, offset = 0;
+    const uint8_t* data = (const uint8_t*)lua_tolstring(L, 1, &len);
+
+    while (offset < len)
+    {
+      size_t left = len - offset;
+      uint32_t size = left < 5 ? 0 :
+        (uint32_t)data[offset] | (uint32_t)data[offset + 1] << 8 | (uint32_t)data[offset + 2] << 16 |
+        (uint32_t)data[offset + 3] << 24;
+
+      if (size < 5 || size > left)
+      {
+        luaL_error(L, "Truncated or malformed document at offset %d", (int)offset);
+      }
+      add_row(L, &c, data + offset, size);
+      offset += size;
+    }
+    bytes = len;
+  }
+  else
+  {
+    int n = source == LUA_TTABLE ? (int)cbson_objlen(L, 1) : 0;
+
+    for (i = 1; source == LUA_TFUNCTION || i <= n; i++)
+    {
+      size_t len;
+      const uint8_t* data;
+
+      if (source == LUA_TTABLE)
+      {
+        lua_rawgeti(L, 1, i);
+      }
+      else
+      {
+        lua_pushvalue(L, 1);
+        lua_call(L, 0, 1);
+        if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          break;
+        }
+      }
+
+      if (lua_type(L, -1) != LUA_TSTRING)
+      {
+        luaL_error(L, "Invalid document %d, expected string", i);
+      }
+      data = (const uint8_t*)lua_tolstring(L, -1, &len);
+      add_row(L, &c, data, len);
+      bytes += len;
+      lua_pop(L, 1);
+    }
+  }
+
+  lua_createtable(L, 0, count);
+  for (i = 0; i < count; i++)
+  {
+    lua_rawgeti(L, 2, i + 1);
+    push_column(L, &c, &c.columns[i]);
+    lua_rawset(L, -3);
+  }
+  lua_pushinteger(L, (lua_Integer)c.rows);
+
+  CBSON_STATS_DOCUMENTS(c.rows);
+  CBSON_STATS_END(CBSON_STAT_COLUMNS, bytes, 0);
+  return 2;
+}
@@ -0,0 +1,47 @@
+#ifndef __CBSON_COLUMNS_H__
+#define __CBSON_COLUMNS_H__
+
+#include <lua.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CBSON_COLUMN_NONE   0  // no values yet
+#define CBSON_COLUMN_DOUBLE 1  // packed doubles
+#define CBSON_COLUMN_INT64  2  // packed int64, int32 values included
+#define CBSON_COLUMN_VALUE  3  // lua array
+
+// Column buffers are userdata kept on the stack (slot and slot + 1), so nothing leaks on error.
+typedef struct {
+  int kind;
+  int slot;          // stack index of data userdata or values table, nulls userdata is next to it
+  uint8_t* data;     // packed values, capacity rows
+  uint8_t* nulls;    // bit per row, set when value is missing or null
+} cbson_column_t;
+
+// Requested paths form a tree of keys, node is column leaf, has children or both
+typedef struct {
+  const char* key;
+  size_t key_len;
+  int column;        // -1 if path only passes through this node
+  int child;         // first child, -1 if none
+  int next;          // next sibling, -1 if none
+} cbson_column_node_t;
+
+typedef struct {
+  cbson_column_t* columns;
+  int count;
+  cbson_column_node_t* nodes; // nodes[0] is root
+  int node_count;
+  size_t rows;       // index of current row
+  size_t capacity;
+} cbson_columns_t;
+
+// called by walker for element of column
+void cbson_column_double(lua_State* L, cbson_columns_t* c, cbson_column_t* col, double value);
+void cbson_column_int64(lua_State* L, cbson_columns_t* c, cbson_column_t* col, int64_t value);
+// turns column into value column, value on top of stack is stored for current row
+void cbson_column_value(lua_State* L, cbson_columns_t* c, cbson_column_t* col);
+
+int cbson_columns(lua_State* L);
+
+#endif
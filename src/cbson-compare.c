@@ -0,0 +1,759 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "cbson.h"
+#include "cbson-compare.h"
+#include "cbson-encode.h"
+#include "cbson-util.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+
+#define SIGN(x) (((x) > 0) - ((x) < 0))
+
+// MongoDB canonical type order, types with equal rank are compared by value
+int cbson_canonical_type(bson_type_t type)
+{
+  switch (type)
+  {
+    case BSON_TYPE_MINKEY:     return -1;
+    case BSON_TYPE_EOD:
+    case BSON_TYPE_UNDEFINED:  return 0;
+    case BSON_TYPE_NULL:       return 5;
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DECIMAL128: return 10;
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_SYMBOL:     return 15;
+    case BSON_TYPE_DOCUMENT:   return 20;
+    case BSON_TYPE_ARRAY:      return 25;
+    case BSON_TYPE_BINARY:     return 30;
+    case BSON_TYPE_OID:        return 35;
+    case BSON_TYPE_BOOL:       return 40;
+    case BSON_TYPE_DATE_TIME:  return 45;
+    case BSON_TYPE_TIMESTAMP:  return 47;
+    case BSON_TYPE_REGEX:      return 50;
+    case BSON_TYPE_DBPOINTER:  return 55;
+    case BSON_TYPE_CODE:       return 60;
+    case BSON_TYPE_CODEWSCOPE: return 65;
+    case BSON_TYPE_MAXKEY:     return 127;
+    default:                   return 0;
+  }
+}
+
+static int compare_bytes(const char *a, uint32_t a_len, const char *b, uint32_t b_len)
+{
+  int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+  if (res)
+  {
+    return SIGN(res);
+  }
+
+  return SIGN((int64_t)a_len - (int64_t)b_len);
+}
+
+static double number_as_double(const bson_iter_t *iter)
+{
+  switch (bson_iter_type(iter))
+  {
+    case BSON_TYPE_DOUBLE:
+      return bson_iter_double(iter);
+    case BSON_TYPE_DECIMAL128:
+    {
+      bson_decimal128_t dec;
+      char str[BSON_DECIMAL128_STRING];
+
+      bson_iter_decimal128(iter, &dec);
+      bson_decimal128_to_string(&dec, str);
+      return strtod(str, NULL);
+    }
+    default:
+      return (double)bson_iter_as_int64(iter);
+  }
+}
+
+// exact comparison of an integer against a double, without rounding the integer
+static int compare_int64_double(int64_t a, double b)
+{
+  int64_t b_int;
+  double b_frac;
+
+  if (isnan(b))
+  {
+    return 1;
+  }
+
+  if (b >= 9223372036854775808.0)
+  {
+    return -1;
+  }
+
+  if (b < -9223372036854775808.0)
+  {
+    return 1;
+  }
+
+  b_int = (int64_t)b;
+  if (a != b_int)
+  {
+    return a < b_int ? -1 : 1;
+  }
+
+  b_frac = b - (double)b_int;
+  return b_frac > 0 ? -1 : (b_frac < 0 ? 1 : 0);
+}
+
+static int compare_numbers(const bson_iter_t *a, const bson_iter_t *b)
+{
+  bson_type_t a_type = bson_iter_type(a);
+  bson_type_t b_type = bson_iter_type(b);
+  bool a_int = a_type == BSON_TYPE_INT32 || a_type == BSON_TYPE_INT64;
+  bool b_int = b_type == BSON_TYPE_INT32 || b_type == BSON_TYPE_INT64;
+
+  if (a_int && b_int)
+  {
+    int64_t x = bson_iter_as_int64(a);
+    int64_t y = bson_iter_as_int64(b);
+    return (x > y) - (x < y);
+  }
+
+  if (a_int && b_type == BSON_TYPE_DOUBLE)
+  {
+    return compare_int64_double(bson_iter_as_int64(a), bson_iter_double(b));
+  }
+
+  if (b_int && a_type == BSON_TYPE_DOUBLE)
+  {
+    return -compare_int64_double(bson_iter_as_int64(b), bson_iter_double(a));
+  }
+
+  double x = number_as_double(a);
+  double y = number_as_double(b);
+
+  // NaN sorts before every other number and equals itself
+  if (isnan(x) || isnan(y))
+  {
+    return isnan(y) - isnan(x);
+  }
+
+  return (x > y) - (x < y);
+}
+
+static const char* string_value(const bson_iter_t *iter, uint32_t *len)
+{
+  if (bson_iter_type(iter) == BSON_TYPE_SYMBOL)
+  {
+    return bson_iter_symbol(iter, len);
+  }
+
+  return bson_iter_utf8(iter, len);
+}
+
+static int compare_documents(bson_iter_t *a, bson_iter_t *b, int depth);
+
+static int compare_scopes(const uint8_t *a, uint32_t a_len, const uint8_t *b, uint32_t b_len, int depth)
+{
+  bson_t a_doc, b_doc;
+  bson_iter_t a_iter, b_iter;
+
+  if (!bson_init_static(&a_doc, a, a_len) || !bson_init_static(&b_doc, b, b_len) ||
+      !bson_iter_init(&a_iter, &a_doc) || !bson_iter_init(&b_iter, &b_doc))
+  {
+    return compare_bytes((const char*)a, a_len, (const char*)b, b_len);
+  }
+
+  return compare_documents(&a_iter, &b_iter, depth);
+}
+
+// nested documents past BSON_MAX_RECURSION levels are not descended into, their raw bytes are compared
+static int compare_nested(const bson_iter_t *a, const bson_iter_t *b, int depth)
+{
+  bson_iter_t a_child, b_child;
+
+  if (depth >= BSON_MAX_RECURSION)
+  {
+    uint32_t a_len, b_len;
+    const uint8_t *a_data, *b_data;
+
+    if (BSON_ITER_HOLDS_ARRAY(a))
+    {
+      bson_iter_array(a, &a_len, &a_data);
+      bson_iter_array(b, &b_len, &b_data);
+    }
+    else
+    {
+      bson_iter_document(a, &a_len, &a_data);
+      bson_iter_document(b, &b_len, &b_data);
+    }
+
+    return compare_bytes((const char*)a_data, a_len, (const char*)b_data, b_len);
+  }
+
+  if (!bson_iter_recurse(a, &a_child) || !bson_iter_recurse(b, &b_child))
+  {
+    return 0;
+  }
+
+  return compare_documents(&a_child, &b_child, depth + 1);
+}
+
+static int compare_values(const bson_iter_t *a, const bson_iter_t *b, int depth)
+{
+  bson_type_t a_type = bson_iter_type(a);
+  bson_type_t b_type = bson_iter_type(b);
+  int res = cbson_canonical_type(a_type) - cbson_canonical_type(b_type);
+
+  if (res)
+  {
+    return SIGN(res);
+  }
+
+  switch (a_type)
+  {
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DECIMAL128:
+      return compare_numbers(a, b);
+
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_SYMBOL:
+    {
+      uint32_t a_len, b_len;
+      const char *a_str = string_value(a, &a_len);
+      const char *b_str = string_value(b, &b_len);
+
+      return compare_bytes(a_str, a_len, b_str, b_len);
+    }
+
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+      return compare_nested(a, b, depth);
+
+    case BSON_TYPE_BINARY:
+    {
+      bson_subtype_t a_sub, b_sub;
+      uint32_t a_len, b_len;
+      const uint8_t *a_bin, *b_bin;
+
+      bson_iter_binary(a, &a_sub, &a_len, &a_bin);
+      bson_iter_binary(b, &b_sub, &b_len, &b_bin);
+
+      if (a_len != b_len)
+      {
+        return a_len < b_len ? -1 : 1;
+      }
+
+      if (a_sub != b_sub)
+      {
+        return a_sub < b_sub ? -1 : 1;
+      }
+
+      return a_len ? SIGN(memcmp(a_bin, b_bin, a_len)) : 0;
+    }
+
+    case BSON_TYPE_OID:
+      return SIGN(memcmp(bson_iter_oid(a), bson_iter_oid(b), 12));
+
+    case BSON_TYPE_BOOL:
+      return bson_iter_bool(a) - bson_iter_bool(b);
+
+    case BSON_TYPE_DATE_TIME:
+    {
+      int64_t x = bson_iter_date_time(a);
+      int64_t y = bson_iter_date_time(b);
+      return (x > y) - (x < y);
+    }
+
+    case BSON_TYPE_TIMESTAMP:
+    {
+      uint32_t a_ts, a_inc, b_ts, b_inc;
+
+      bson_iter_timestamp(a, &a_ts, &a_inc);
+      bson_iter_timestamp(b, &b_ts, &b_inc);
+
+      if (a_ts != b_ts)
+      {
+        return a_ts < b_ts ? -1 : 1;
+      }
+
+      return (a_inc > b_inc) - (a_inc < b_inc);
+    }
+
+    case BSON_TYPE_REGEX:
+    {
+      const char *a_opts, *b_opts;
+      const char *a_re = bson_iter_regex(a, &a_opts);
+      const char *b_re = bson_iter_regex(b, &b_opts);
+
+      res = strcmp(a_re, b_re);
+      return res ? SIGN(res) : SIGN(strcmp(a_opts, b_opts));
+    }
+
+    case BSON_TYPE_DBPOINTER:
+    {
+      uint32_t a_len, b_len;
+      const char *a_coll, *b_coll;
+      const bson_oid_t *a_oid, *b_oid;
+
+      bson_iter_dbpointer(a, &a_len, &a_coll, &a_oid);
+      bson_iter_dbpointer(b, &b_len, &b_coll, &b_oid);
+
+      res = compare_bytes(a_coll, a_len, b_coll, b_len);
+      return res ? res : SIGN(memcmp(a_oid, b_oid, 12));
+    }
+
+    case BSON_TYPE_CODE:
+    {
+      uint32_t a_len, b_len;
+      const char *a_code = bson_iter_code(a, &a_len);
+      const char *b_code = bson_iter_code(b, &b_len);
+
+      return compare_bytes(a_code, a_len, b_code, b_len);
+    }
+
+    case BSON_TYPE_CODEWSCOPE:
+    {
+      uint32_t a_len, b_len, a_scope_len, b_scope_len;
+      const uint8_t *a_scope, *b_scope;
+      const char *a_code = bson_iter_codewscope(a, &a_len, &a_scope_len, &a_scope);
+      const char *b_code = bson_iter_codewscope(b, &b_len, &b_scope_len, &b_scope);
+
+      res = compare_bytes(a_code, a_len, b_code, b_len);
+      if (res)
+      {
+        return res;
+      }
+
+      if (depth >= BSON_MAX_RECURSION)
+      {
+        return compare_bytes((const char*)a_scope, a_scope_len, (const char*)b_scope, b_scope_len);
+      }
+
+      return compare_scopes(a_scope, a_scope_len, b_scope, b_scope_len, depth + 1);
+    }
+
+    default: // null, undefined, minkey, maxkey
+      return 0;
+  }
+}
+
+static int compare_documents(bson_iter_t *a, bson_iter_t *b, int depth)
+{
+  while (true)
+  {
+    bool a_next = bson_iter_next(a);
+    bool b_next = bson_iter_next(b);
+    int res;
+
+    if (!a_next || !b_next)
+    {
+      return a_next - b_next;
+    }
+
+    res = cbson_canonical_type(bson_iter_type(a)) - cbson_canonical_type(bson_iter_type(b));
+    if (res)
+    {
+      return SIGN(res);
+    }
+
+    res = strcmp(bson_iter_key(a), bson_iter_key(b));
+    if (res)
+    {
+      return SIGN(res);
+    }
+
+    res = compare_values(a, b, depth);
+    if (res)
+    {
+      return res;
+    }
+  }
+}
+
+// compares two values with MongoDB semantics, types are ordered canonically
+int cbson_compare_values(const bson_iter_t *a, const bson_iter_t *b)
+{
+  return compare_values(a, b, 0);
+}
+
+// compares documents element by element: type, then field name, then value
+int cbson_compare_documents(bson_iter_t *a, bson_iter_t *b)
+{
+  return compare_documents(a, b, 0);
+}
+
+// sort key kinds, missing fields sort as null and empty arrays before null
+#define SORT_KEY_VALUE   0
+#define SORT_KEY_MISSING 1
+#define SORT_KEY_EMPTY   2
+
+typedef struct {
+  bson_iter_t iter;
+  int kind;
+} cbson_sort_key_t;
+
+typedef struct {
+  const char* path;
+  int direction;
+} cbson_sort_field_t;
+
+typedef struct {
+  cbson_sort_field_t* fields;
+  int count;
+} cbson_sort_spec_t;
+
+typedef struct {
+  const cbson_sort_spec_t* spec;
+  cbson_sort_key_t* keys;
+  int index;
+} cbson_sort_entry_t;
+
+static int sort_key_rank(const cbson_sort_key_t* key)
+{
+  switch (key->kind)
+  {
+    case SORT_KEY_MISSING: return cbson_canonical_type(BSON_TYPE_NULL);
+    case SORT_KEY_EMPTY:   return cbson_canonical_type(BSON_TYPE_UNDEFINED);
+    default:               return cbson_canonical_type(bson_iter_type(&key->iter));
+  }
+}
+
+static int compare_sort_keys(const cbson_sort_key_t* a, const cbson_sort_key_t* b)
+{
+  int res = sort_key_rank(a) - sort_key_rank(b);
+
+  if (res)
+  {
+    return SIGN(res);
+  }
+
+  if (a->kind != SORT_KEY_VALUE || b->kind != SORT_KEY_VALUE)
+  {
+    return 0;
+  }
+
+  return cbson_compare_values(&a->iter, &b->iter);
+}
+
+// keeps candidate when it's the first one or sorts before key (after it, when descending)
+static void offer_sort_key(const cbson_sort_key_t* cand, int direction, cbson_sort_key_t* key, bool* found)
+{
+  if (!*found || compare_sort_keys(cand, key) * direction < 0)
+  {
+    *key = *cand;
+    *found = true;
+  }
+}
+
+static void offer_missing(int direction, cbson_sort_key_t* key, bool* found)
+{
+  cbson_sort_key_t cand;
+
+  cand.kind = SORT_KEY_MISSING;
+  offer_sort_key(&cand, direction, key, found);
+}
+
+// value reached by whole path, array stands for its elements
+static void offer_leaf(const bson_iter_t* value, int direction, cbson_sort_key_t* key, bool* found)
+{
+  cbson_sort_key_t cand;
+  bson_iter_t child;
+
+  cand.kind = SORT_KEY_VALUE;
+  cand.iter = *value;
+
+  if (!BSON_ITER_HOLDS_ARRAY(value) || !bson_iter_recurse(value, &child))
+  {
+    offer_sort_key(&cand, direction, key, found);
+    return;
+  }
+
+  if (!bson_iter_next(&child))
+  {
+    cand.kind = SORT_KEY_EMPTY;
+    offer_sort_key(&cand, direction, key, found);
+    return;
+  }
+
+  do
+  {
+    cand.iter = child;
+    offer_sort_key(&cand, direction, key, found);
+  }
+  while (bson_iter_next(&child));
+}
+
+static void offer_path(const bson_iter_t* doc, const char* path, int direction, int depth, cbson_sort_key_t* key,
+  bool* found);
+
+// Continues path below value. Numeric component picks array element by position, otherwise path goes
+// into every subdocument of array and other elements count as missing, as server does.
+static void offer_below(const bson_iter_t* value, const char* path, int direction, int depth, cbson_sort_key_t* key,
+  bool* found)
+{
+  bson_iter_t child;
+  size_t digits = strspn(path, "0123456789");
+
+  if (depth >= BSON_MAX_RECURSION || !(BSON_ITER_HOLDS_DOCUMENT(value) || BSON_ITER_HOLDS_ARRAY(value)) ||
+      !bson_iter_recurse(value, &child))
+  {
+    offer_missing(direction, key, found);
+    return;
+  }
+
+  if (BSON_ITER_HOLDS_DOCUMENT(value) || (digits && (path[digits] == '.' || path[digits] == '\0')))
+  {
+    offer_path(&child, path, direction, depth + 1, key, found);
+    return;
+  }
+
+  while (bson_iter_next(&child))
+  {
+    bson_iter_t element;
+
+    if (BSON_ITER_HOLDS_DOCUMENT(&child) && bson_iter_recurse(&child, &element))
+    {
+      offer_path(&element, path, direction, depth + 1, key, found);
+    }
+    else
+    {
+      offer_missing(direction, key, found);
+    }
+  }
+}
+
+// looks up first component of path among fields of doc
+static void offer_path(const bson_iter_t* doc, const char* path, int direction, int depth, cbson_sort_key_t* key,
+  bool* found)
+{
+  const char* dot = strchr(path, '.');
+  size_t len = dot ? (size_t)(dot - path) : strlen(path);
+  bson_iter_t iter = *doc;
+
+  while (bson_iter_next(&iter))
+  {
+    const char* name = bson_iter_key(&iter);
+
+    if (strncmp(name, path, len) == 0 && name[len] == '\0')
+    {
+      if (dot)
+      {
+        offer_below(&iter, dot + 1, direction, depth, key, found);
+      }
+      else
+      {
+        offer_leaf(&iter, direction, key, found);
+      }
+      return;
+    }
+  }
+
+  offer_missing(direction, key, found);
+}
+
+// Extracts sort key of document. Values reached by dotted path through arrays (and elements of array at
+// the end of path) are candidates, the key is their min, or max when descending.
+static void extract_sort_key(const bson_t* doc, const cbson_sort_field_t* field, cbson_sort_key_t* key)
+{
+  bson_iter_t iter;
+  bool found = false;
+
+  key->kind = SORT_KEY_MISSING;
+
+  if (bson_iter_init(&iter, doc))
+  {
+    offer_path(&iter, field->path, field->direction, 0, key, &found);
+  }
+}
+
+static int compare_with_spec(const cbson_sort_spec_t* spec, const cbson_sort_key_t* a, const cbson_sort_key_t* b)
+{
+  int i;
+
+  for (i = 0; i < spec->count; i++)
+  {
+    int res = compare_sort_keys(&a[i], &b[i]);
+
+    if (res)
+    {
+      return res * spec->fields[i].direction;
+    }
+  }
+
+  return 0;
+}
+
+static int sort_entry_compare(const void* a, const void* b)
+{
+  const cbson_sort_entry_t* x = a;
+  const cbson_sort_entry_t* y = b;
+  int res = compare_with_spec(x->spec, x->keys, y->keys);
+
+  // original position as tiebreak keeps sort stable
+  return res ? res : (x->index > y->index) - (x->index < y->index);
+}
+
+// parses sort spec at index, leaves userdata holding spec on stack
+static void check_sort_spec(lua_State* L, int index, cbson_sort_spec_t* spec)
+{
+  bson_t bson;
+  bson_iter_t iter;
+  uint8_t* data;
+  uint32_t count, len;
+
+  cbson_check_document(L, index, &bson);
+  count = bson_count_keys(&bson);
+
+  // spec data is copied to lua-owned memory, so errors below won't leak it
+  spec->fields = lua_newuserdata(L, count * sizeof(cbson_sort_field_t) + bson.len);
+  spec->count = 0;
+  data = (uint8_t*)(spec->fields + count);
+  memcpy(data, bson_get_data(&bson), bson.len);
+  len = bson.len;
+  bson_destroy(&bson);
+
+  if (!bson_init_static(&bson, data, len) || !bson_iter_init(&iter, &bson))
+  {
+    luaL_error(L, "Can't init bson iterator.");
+  }
+
+  while (bson_iter_next(&iter))
+  {
+    double direction = 0;
+
+    if (BSON_ITER_HOLDS_DOUBLE(&iter))
+    {
+      direction = bson_iter_double(&iter);
+    }
+    else if (BSON_ITER_HOLDS_INT32(&iter) || BSON_ITER_HOLDS_INT64(&iter))
+    {
+      direction = (double)bson_iter_as_int64(&iter);
+    }
+
+    if (direction == 0 || direction != direction)
+    {
+      luaL_error(L, "Invalid sort direction for '%s'. Expected 1 or -1", bson_iter_key(&iter));
+    }
+
+    spec->fields[spec->count].path = bson_iter_key(&iter);
+    spec->fields[spec->count].direction = direction > 0 ? 1 : -1;
+    spec->count++;
+  }
+}
+
+static int compare_call(lua_State* L)
+{
+  bson_t a, b;
+  int res;
+  CBSON_STATS_BEGIN();
+
+  cbson_check_bson(L, 1, &a);
+  cbson_check_bson(L, 2, &b);
+
+  if (lua_isnoneornil(L, 3))
+  {
+    bson_iter_t a_iter, b_iter;
+
+    if (!bson_iter_init(&a_iter, &a) || !bson_iter_init(&b_iter, &b))
+    {
+      return luaL_error(L, "Can't init bson iterator.");
+    }
+
+    res = cbson_compare_documents(&a_iter, &b_iter);
+  }
+  else
+  {
+    cbson_sort_spec_t spec;
+    cbson_sort_key_t* keys;
+    int i;
+
+    check_sort_spec(L, 3, &spec);
+    keys = lua_newuserdata(L, 2 * spec.count * sizeof(cbson_sort_key_t) + 1);
+
+    for (i = 0; i < spec.count; i++)
+    {
+      extract_sort_key(&a, &spec.fields[i], &keys[i]);
+      extract_sort_key(&b, &spec.fields[i], &keys[spec.count + i]);
+    }
+
+    res = compare_with_spec(&spec, keys, keys + spec.count);
+  }
+
+  lua_pushinteger(L, res);
+  CBSON_STATS_DOCUMENTS(2);
+  CBSON_STATS_END(CBSON_STAT_COMPARE, a.len + b.len, 0);
+  return 1;
+}
+
+int cbson_compare(lua_State* L)
+{
+  return cbson_arena_call(L, compare_call);
+}
+
+static int sort_call(lua_State* L)
+{
+  cbson_sort_spec_t spec;
+  cbson_sort_entry_t* entries;
+  cbson_sort_key_t* keys;
+  int n, i, j;
+  size_t bytes_in = 0;
+  CBSON_STATS_BEGIN();
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = cbson_objlen(L, 1);
+
+  check_sort_spec(L, 2, &spec);
+
+  entries = lua_newuserdata(L, n * sizeof(cbson_sort_entry_t) + 1);
+  keys = lua_newuserdata(L, (size_t)n * spec.count * sizeof(cbson_sort_key_t) + 1);
+
+  for (i = 0; i < n; i++)
+  {
+    bson_t doc;
+
+    lua_rawgeti(L, 1, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+      return luaL_error(L, "Expected binary bson at index %d", i + 1);
+    }
+
+    // strings stay referenced by the list, so the pointers remain valid after pop
+    cbson_check_bson(L, -1, &doc);
+    lua_pop(L, 1);
+    bytes_in += doc.len;
+
+    entries[i].spec = &spec;
+    entries[i].keys = keys + (size_t)i * spec.count;
+    entries[i].index = i;
+
+    for (j = 0; j < spec.count; j++)
+    {
+      extract_sort_key(&doc, &spec.fields[j], &entries[i].keys[j]);
+    }
+  }
+
+  qsort(entries, n, sizeof(cbson_sort_entry_t), sort_entry_compare);
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++)
+  {
+    lua_rawgeti(L, 1, entries[i].index + 1);
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  CBSON_STATS_DOCUMENTS(n);
+  CBSON_STATS_END(CBSON_STAT_SORT, bytes_in, 0);
+  return 1;
+}
+
+int cbson_sort(lua_State* L)
+{
+  return cbson_arena_call(L, sort_call);
+}
@@ -0,0 +1,14 @@
+#ifndef __CBSON_COMPARE_H__
+#define __CBSON_COMPARE_H__
+
+#include <lua.h>
+#include <bson.h>
+
+int cbson_canonical_type(bson_type_t type);
+int cbson_compare_values(const bson_iter_t *a, const bson_iter_t *b);
+int cbson_compare_documents(bson_iter_t *a, bson_iter_t *b);
+
+int cbson_compare(lua_State* L);
+int cbson_sort(lua_State* L);
+
+#endif
@@ -7,6 +7,7 @@
 #include "cbson-int.h"
 #include "cbson-uint.h"
 #include "cbson-util.h"
+#include "cbson-stats.h"
 #include "intpow.h"
 
 int64_t cbson_date_check(lua_State *L, int index)
@@ -15,13 +16,16 @@ int64_t cbson_date_check(lua_State *L, int index)
   {
     return *(int64_t*)lua_touserdata(L, index);
   }
-  else if (lua_isnumber(L, index))
+  else if (lua_type(L, index) == LUA_TNUMBER)
   {
-    return lua_tonumber(L, index);
+    return cbson_toint64(L, index);
   }
   else if (lua_isstring(L, index))
   {
-    return strtoll(lua_tostring(L, index), NULL, 10);
+    // decimal strings are parsed as is to keep all 64 bits, anything else ("1e3", "0x10") is converted by lua
+    char* end;
+    int64_t value = strtoll(lua_tostring(L, index), &end, 10);
+    return *end == '\0' ? value : cbson_toint64(L, index);
   }
   else
   {
@@ -34,6 +38,7 @@ int64_t cbson_date_check(lua_State *L, int index)
 int cbson_date_create(lua_State* L, int64_t val)
 {
   cbson_date_t* ud = lua_newuserdata(L, sizeof(cbson_date_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_DATE);
 
   *ud = val;
 
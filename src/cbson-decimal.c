@@ -4,12 +4,14 @@
 
 #include "cbson.h"
 #include "cbson-decimal.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(DECIMAL, decimal)
 
 int cbson_decimal_create(lua_State* L, const bson_decimal128_t* decimal)
 {
   cbson_decimal_t* ud = lua_newuserdata(L, sizeof(cbson_decimal_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_DECIMAL);
   if (decimal) {
     ud->dec.high = decimal->high;
     ud->dec.low = decimal->low;
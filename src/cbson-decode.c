@@ -2,12 +2,18 @@
 #include <lauxlib.h>
 #include <bson.h>
 #include <string.h>
+#include <stdlib.h>
 #include <resolv.h>
 #include <stdint.h>
 #include <inttypes.h>
 
 #include "cbson.h"
 #include "cbson-decode.h"
+#include "cbson-async.h"
+#include "cbson-util.h"
+#include "cbson-decoder.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
 #include "cbson-oid.h"
 #include "cbson-regex.h"
 #include "cbson-binary.h"
@@ -20,351 +26,779 @@
 #include "cbson-date.h"
 #include "cbson-decimal.h"
 
-typedef struct {
-  uint32_t count;
-  bool keys;
-  uint32_t depth;
-  lua_State *L;
-} cbson_state_t;
-
-bool cbson_visit_document(const bson_iter_t *iter, const char *key, const bson_t *v_document, void *data);
-bool cbson_visit_array(const bson_iter_t *iter, const char *key, const bson_t *v_array, void *data);
-
-bool cbson_visit_before(const bson_iter_t *iter, const char *key, void *data)
+// same check as bson_utf8_validate, ascii is accepted 8 bytes at a time
+bool cbson_valid_utf8(const uint8_t* str, size_t len)
 {
-  cbson_state_t *s = data;
+  size_t i = 0;
 
-  s->count++;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t v;
+    memcpy(&v, str + i, sizeof(v));
+    if (v & 0x8080808080808080ULL)
+    {
+      return bson_utf8_validate((const char*)str + i, len - i, true);
+    }
+  }
 
-  if (s->keys)
+  for (; i < len; i++)
   {
-    lua_pushstring(s->L, key);
+    if (str[i] & 0x80)
+    {
+      return bson_utf8_validate((const char*)str + i, len - i, true);
+    }
   }
 
-  return false;
+  return true;
 }
 
-bool cbson_visit_after(const bson_iter_t *iter, const char *key, void *data)
+// length-prefixed string at p (utf8, code, symbol), must end with NUL inside limit
+bool cbson_check_string(const uint8_t* p, const uint8_t* limit, uint32_t* len)
 {
-  cbson_state_t *s = data;
-
-  if (s->keys)
+  if (limit - p < 4)
   {
-    lua_rawset(s->L, -3);
-  }
-  else
-  {
-    lua_rawseti(s->L, -2, s->count);
+    return false;
   }
 
-  return false;
+  *len = cbson_read_uint32(p);
+
+  return *len > 0 && *len <= (size_t)(limit - p - 4) && p[4 + *len - 1] == '\0';
 }
 
-bool cbson_visit_utf8(const bson_iter_t *iter, const char *key, size_t v_utf8_len, const char *v_utf8, void *data)
+// subdocument at p must fit in limit, have sane length and trailing NUL
+bool cbson_check_subdocument(const uint8_t* p, const uint8_t* limit, uint32_t* len)
 {
-  cbson_state_t *s = data;
+  if (limit - p < 5)
+  {
+    return false;
+  }
 
-  lua_pushlstring(s->L, v_utf8, v_utf8_len);
+  *len = cbson_read_uint32(p);
 
-  return false;
+  return *len >= 5 && *len <= (size_t)(limit - p) && p[*len - 1] == '\0';
 }
 
-bool cbson_visit_int32(const bson_iter_t *iter, const char *key, int32_t v_int32, void *data)
+static void decode_document(lua_State* L, const uint8_t* data, uint32_t len, uint32_t depth, bool keys, cbson_decoder_t* dec, bool ordered);
+
+// Checks element value at p without pushing anything, so it's safe to call from worker threads.
+// Documents and arrays are handled by caller. Returns pointer past the element or NULL if element is corrupt.
+const uint8_t* cbson_skip_value(uint8_t type, const uint8_t* p, const uint8_t* limit)
 {
-  cbson_state_t *s = data;
+  uint32_t len;
 
-  cbson_int64_create(s->L, v_int32);
+  switch (type)
+  {
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DATE_TIME:
+    case BSON_TYPE_TIMESTAMP:
+    case BSON_TYPE_INT64:
+      return limit - p < 8 ? NULL : p + 8;
+
+    case BSON_TYPE_INT32:
+      return limit - p < 4 ? NULL : p + 4;
+
+    case BSON_TYPE_DECIMAL128:
+      return limit - p < 16 ? NULL : p + 16;
+
+    case BSON_TYPE_OID:
+      return limit - p < 12 ? NULL : p + 12;
+
+    case BSON_TYPE_BOOL:
+      return limit - p < 1 || p[0] > 1 ? NULL : p + 1;
+
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_MAXKEY:
+    case BSON_TYPE_MINKEY:
+      return p;
+
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL:
+      if (!cbson_check_string(p, limit, &len) || !cbson_valid_utf8(p + 4, len - 1)) return NULL;
+      return p + 4 + len;
+
+    case BSON_TYPE_BINARY:
+      if (limit - p < 5) return NULL;
+      len = cbson_read_uint32(p);
+      if (len > (size_t)(limit - p - 5)) return NULL;
+      if (p[4] == BSON_SUBTYPE_BINARY_DEPRECATED && (len < 4 || cbson_read_uint32(p + 5) + 4 != len)) return NULL;
+      return p + 5 + len;
+
+    case BSON_TYPE_REGEX:
+    {
+      const uint8_t* options = memchr(p, 0, limit - p);
+      const uint8_t* end;
 
-  return false;
-}
+      if (!options || !(end = memchr(options + 1, 0, limit - options - 1))) return NULL;
+      options++;
+      if (!cbson_valid_utf8(p, options - p - 1) || !cbson_valid_utf8(options, end - options)) return NULL;
+      return end + 1;
+    }
 
-bool cbson_visit_int64(const bson_iter_t *iter, const char *key, int64_t v_int64, void *data)
-{
-  cbson_state_t *s = data;
-  
-  cbson_int64_create(s->L, v_int64);
+    case BSON_TYPE_DBPOINTER:
+      if (!cbson_check_string(p, limit, &len) || (size_t)(limit - p - 4 - len) < 12 || !cbson_valid_utf8(p + 4, len - 1)) return NULL;
+      return p + 4 + len + 12;
 
-  return false;
+    case BSON_TYPE_CODEWSCOPE:
+    {
+      uint32_t code_len, scope_len;
+
+      if (limit - p < 14) return NULL;
+      len = cbson_read_uint32(p);
+      if (len < 14 || len > (size_t)(limit - p)) return NULL;
+      if (!cbson_check_string(p + 4, p + len, &code_len) || !cbson_valid_utf8(p + 8, code_len - 1)) return NULL;
+      if (!cbson_check_subdocument(p + 8 + code_len, p + len, &scope_len) || 8 + code_len + scope_len != len) return NULL;
+      return p + len;
+    }
+
+    default:
+      return NULL;
+  }
 }
 
-bool cbson_visit_double(const bson_iter_t *iter, const char *key, double v_double, void *data)
+// Pushes value checked by cbson_skip_value, documents and arrays excluded
+void cbson_push_value(lua_State* L, uint8_t type, const uint8_t* p)
 {
-  cbson_state_t *s = data;
-
-  lua_pushnumber(s->L, v_double);
+  uint32_t len;
+  char str[25];
 
-  return false;
+  switch (type)
+  {
+    case BSON_TYPE_DOUBLE:
+      lua_pushnumber(L, cbson_read_double(p));
+      break;
+    case BSON_TYPE_UTF8:
+      lua_pushlstring(L, (const char*)p + 4, cbson_read_uint32(p) - 1);
+      break;
+    case BSON_TYPE_BINARY:
+      len = cbson_read_uint32(p);
+      if (p[4] == BSON_SUBTYPE_BINARY_DEPRECATED)
+      {
+        cbson_binary_create(L, p[4], (const char*)p + 9, len - 4);
+      }
+      else
+      {
+        cbson_binary_create(L, p[4], (const char*)p + 5, len);
+      }
+      break;
+    case BSON_TYPE_UNDEFINED:
+      cbson_undefined_create(L);
+      break;
+    case BSON_TYPE_OID:
+      bson_oid_to_string((const bson_oid_t*)p, str);
+      cbson_oid_create(L, str);
+      break;
+    case BSON_TYPE_BOOL:
+      lua_pushboolean(L, p[0]);
+      break;
+    case BSON_TYPE_DATE_TIME:
+      cbson_date_create(L, (int64_t)cbson_read_uint64(p));
+      break;
+    case BSON_TYPE_NULL:
+      cbson_null_create(L);
+      break;
+    case BSON_TYPE_REGEX:
+      cbson_regex_create(L, (const char*)p, (const char*)p + strlen((const char*)p) + 1);
+      break;
+    case BSON_TYPE_DBPOINTER:
+      len = cbson_read_uint32(p);
+      bson_oid_to_string((const bson_oid_t*)(p + 4 + len), str);
+      cbson_ref_create(L, (const char*)p + 4, str);
+      break;
+    case BSON_TYPE_CODE:
+      cbson_code_create(L, (const char*)p + 4);
+      break;
+    case BSON_TYPE_SYMBOL:
+      cbson_symbol_create(L, (const char*)p + 4);
+      break;
+    case BSON_TYPE_CODEWSCOPE:
+      cbson_codewscope_create(L, (const char*)p + 8);
+      break;
+    case BSON_TYPE_INT32:
+#ifdef CBSON_NATIVE_INTEGERS
+      lua_pushinteger(L, (int32_t)cbson_read_uint32(p));
+#else
+      cbson_int64_create(L, (int32_t)cbson_read_uint32(p));
+#endif
+      break;
+    case BSON_TYPE_TIMESTAMP:
+      cbson_timestamp_create(L, cbson_read_uint32(p + 4), cbson_read_uint32(p));
+      break;
+    case BSON_TYPE_INT64:
+#ifdef CBSON_NATIVE_INTEGERS
+      lua_pushinteger(L, (int64_t)cbson_read_uint64(p));
+#else
+      cbson_int64_create(L, (int64_t)cbson_read_uint64(p));
+#endif
+      break;
+    case BSON_TYPE_DECIMAL128:
+    {
+      bson_decimal128_t dec;
+      dec.low = cbson_read_uint64(p);
+      dec.high = cbson_read_uint64(p + 8);
+      cbson_decimal_create(L, &dec);
+      break;
+    }
+    case BSON_TYPE_MAXKEY:
+      cbson_maxkey_create(L);
+      break;
+    case BSON_TYPE_MINKEY:
+      cbson_minkey_create(L);
+      break;
+  }
 }
 
-bool cbson_visit_undefined(const bson_iter_t *iter, const char *key, void *data)
+// pushes value of element at p, returns pointer past the element or NULL if element is corrupt
+const uint8_t* cbson_decode_value(lua_State* L, uint8_t type, const uint8_t* p, const uint8_t* limit, uint32_t depth, cbson_decoder_t* dec,
+  bool ordered)
 {
-  cbson_state_t *s = data;
+  const uint8_t* next;
+  uint32_t len;
 
-  cbson_undefined_create(s->L);
+  switch (type)
+  {
+    case BSON_TYPE_UTF8:
+      if (!(dec && dec->values.slots))
+      {
+        break;
+      }
+      if (!cbson_check_string(p, limit, &len)) return NULL;
+      if (len - 1 <= dec->max_value_len)
+      {
+        // cached bytes were validated when they were stored
+        uint32_t hash;
+        int slot = cbson_intern_lookup(&dec->values, (const char*)p + 4, len - 1, &hash);
+        if (slot >= 0)
+        {
+          cbson_intern_push_slot(L, &dec->values, slot);
+          return p + 4 + len;
+        }
+        if (!cbson_valid_utf8(p + 4, len - 1)) return NULL;
+        cbson_intern_store(L, &dec->values, (const char*)p + 4, len - 1, hash);
+        return p + 4 + len;
+      }
+      break;
+
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+      if (!cbson_check_subdocument(p, limit, &len)) return NULL;
+      if (depth >= BSON_MAX_RECURSION)
+      {
+        lua_pushlstring(L, "...", 3);
+      }
+      else
+      {
+        decode_document(L, p, len, depth + 1, type == BSON_TYPE_DOCUMENT, dec, ordered);
+      }
+      return p + len;
+  }
 
-  return false;
+  next = cbson_skip_value(type, p, limit);
+  if (next)
+  {
+    cbson_push_value(L, type, p);
+  }
+  return next;
 }
 
-bool cbson_visit_null(const bson_iter_t *iter, const char *key, void *data)
+// Pushes table with document (keys) or array elements, data is checked by caller to be len bytes long
+// and end with NUL. Like bson_iter_visit_all, corrupt element stops decoding of this document,
+// elements decoded so far are kept. Ordered documents are flat cbson.ordered tables.
+static void decode_document(lua_State* L, const uint8_t* data, uint32_t len, uint32_t depth, bool keys, cbson_decoder_t* dec,
+  bool ordered)
 {
-  cbson_state_t *s = data;
-
-//  lua_pushnil(s->L);
-  cbson_null_create(s->L);
+  // values must end before trailing NUL of document
+  const uint8_t* limit = data + len - 1;
+  const uint8_t* p = data + 4;
+  int count = 0;
 
-  return false;
-}
+  luaL_checkstack(L, LUA_MINSTACK, "document is too deep");
+  CBSON_STATS_DEPTH(depth);
 
-bool cbson_visit_bool(const bson_iter_t *iter, const char *key, bool v_bool, void *data)
-{
-  cbson_state_t *s = data;
+  lua_newtable(L);
+  if (!keys)
+  {
+    // use metatable for arrays
+    luaL_getmetatable(L, CBSON_ARRAY_MT);
+    lua_setmetatable(L, -2);
+  }
+  else if (ordered)
+  {
+    luaL_getmetatable(L, CBSON_ORDERED_MT);
+    lua_setmetatable(L, -2);
+  }
 
-  lua_pushboolean(s->L, v_bool);
+  while (p < limit)
+  {
+    uint8_t type = *p++;
+    const uint8_t* key = p;
+    const uint8_t* key_end = memchr(key, 0, limit - key);
+    const uint8_t* next;
 
-  return false;
-}
+    if (!key_end || !cbson_valid_utf8(key, key_end - key))
+    {
+      break;
+    }
 
-bool cbson_visit_oid(const bson_iter_t *iter, const char *key, const bson_oid_t *oid, void *data)
-{
-  cbson_state_t *s = data;
-  char str[25];
+    if (keys)
+    {
+      if (dec && dec->keys.slots)
+      {
+        cbson_intern_push(L, &dec->keys, (const char*)key, key_end - key);
+      }
+      else
+      {
+        lua_pushlstring(L, (const char*)key, key_end - key);
+      }
+    }
 
-  bson_oid_to_string (oid, str);
+    next = cbson_decode_value(L, type, key_end + 1, limit, depth, dec, ordered);
+    if (!next)
+    {
+      if (keys)
+      {
+        lua_pop(L, 1);
+      }
+      break;
+    }
 
-  cbson_oid_create(s->L, str);
+    if (keys && ordered)
+    {
+      lua_rawseti(L, -3, 2 * count + 2);
+      lua_rawseti(L, -2, 2 * count + 1);
+      count++;
+    }
+    else if (keys)
+    {
+      lua_rawset(L, -3);
+    }
+    else
+    {
+      lua_rawseti(L, -2, ++count);
+    }
 
-  return false;
+    p = next;
+  }
 }
 
-bool cbson_visit_regex(const bson_iter_t *iter, const char *key, const  char *v_reg, const char *v_options, void *data)
+// True if value on top of stack is table, which can be reused for decoded document (keys) or array.
+// Arrays are told by array metatable, if it's not set any table will do.
+static bool reusable_table(lua_State* L, bool keys)
 {
-  cbson_state_t *s = data;
+  int top = lua_gettop(L);
+  bool array;
 
-  cbson_regex_create(s->L, v_reg, v_options);
-
-  return false;
-}
+  if (!lua_istable(L, top))
+  {
+    return false;
+  }
 
-bool cbson_visit_date_time(const bson_iter_t *iter, const char *key, int64_t msec_since_epoch, void *data)
-{
-  cbson_state_t *s = data;
+  luaL_getmetatable(L, CBSON_ARRAY_MT);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    return true;
+  }
 
-  cbson_date_create(s->L, msec_since_epoch);
+  if (!lua_getmetatable(L, top))
+  {
+    lua_pop(L, 1);
+    return keys;
+  }
 
-  return false;
+  array = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return array != keys;
 }
 
-bool cbson_visit_minkey(const bson_iter_t *iter, const char *key, void *data)
+// Removes keys of table which were not set by decoding of count elements. Same-shaped documents take
+// the fast path: number of entries is equal to number of elements, so there is nothing to remove.
+// Duplicate keys in document are counted twice and may hide as many stale keys.
+static void remove_stale_keys(lua_State* L, int table, const uint8_t* data, uint32_t len, bool keys, int count)
 {
-  cbson_state_t *s = data;
+  bson_t bson;
+  bson_iter_t iter;
+  int total = 0;
+  int present = 0;
 
-  cbson_minkey_create(s->L);
+  lua_pushnil(L);
+  while (lua_next(L, table))
+  {
+    lua_pop(L, 1);
+    total++;
+  }
 
-  return false;
-}
+  if (total == count)
+  {
+    return;
+  }
 
-bool cbson_visit_maxkey(const bson_iter_t *iter, const char *key, void *data)
-{
-  cbson_state_t *s = data;
+  if (keys)
+  {
+    // set of keys present in document, iteration stops at corrupt element like decoding does
+    lua_createtable(L, 0, count);
+    present = lua_gettop(L);
+    if (bson_init_static(&bson, data, len) && bson_iter_init(&iter, &bson))
+    {
+      while (bson_iter_next(&iter))
+      {
+        lua_pushstring(L, bson_iter_key(&iter));
+        lua_pushboolean(L, 1);
+        lua_rawset(L, present);
+      }
+    }
+  }
 
-  cbson_maxkey_create(s->L);
+  lua_pushnil(L);
+  while (lua_next(L, table))
+  {
+    bool stale;
 
-  return false;
+    lua_pop(L, 1);
+    if (keys)
+    {
+      lua_pushvalue(L, -1);
+      lua_rawget(L, present);
+      stale = lua_isnil(L, -1);
+      lua_pop(L, 1);
+    }
+    else
+    {
+      lua_Number n = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : 0;
+      stale = !(n >= 1 && n <= count && n == (lua_Number)(int)n);
+    }
+
+    // assigning nil to existing field doesn't break lua_next
+    if (stale)
+    {
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, table);
+    }
+  }
+
+  if (present)
+  {
+    lua_pop(L, 1);
+  }
 }
 
-bool cbson_visit_code(const bson_iter_t *iter, const char *key, size_t v_code_len, const char *v_code, void *data)
+// Same as decode_document, but decodes into table on top of the stack: nested documents and arrays
+// are decoded into existing subtables under the same key, stale keys are removed if clear is set.
+static void decode_document_into(lua_State* L, const uint8_t* data, uint32_t len, uint32_t depth, bool keys, bool clear)
 {
-  cbson_state_t *s = data;
+  const uint8_t* limit = data + len - 1;
+  const uint8_t* p = data + 4;
+  int count = 0;
+  int table = lua_gettop(L);
 
-  cbson_code_create(s->L, v_code);
+  luaL_checkstack(L, LUA_MINSTACK, "document is too deep");
+  CBSON_STATS_DEPTH(depth);
 
-  return false;
-}
+  while (p < limit)
+  {
+    uint8_t type = *p++;
+    const uint8_t* key = p;
+    const uint8_t* key_end = memchr(key, 0, limit - key);
+    const uint8_t* next;
+    uint32_t sublen;
 
-bool cbson_visit_symbol(const bson_iter_t *iter, const char *key, size_t v_symbol_len, const char *v_symbol, void *data)
-{
-  cbson_state_t *s = data;
+    if (!key_end || !cbson_valid_utf8(key, key_end - key))
+    {
+      break;
+    }
 
-  cbson_symbol_create(s->L, v_symbol);
+    if (keys)
+    {
+      lua_pushlstring(L, (const char*)key, key_end - key);
+    }
 
-  return false;
-}
+    if ((type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY) && depth < BSON_MAX_RECURSION &&
+        cbson_check_subdocument(key_end + 1, limit, &sublen))
+    {
+      bool subkeys = type == BSON_TYPE_DOCUMENT;
+
+      if (keys)
+      {
+        lua_pushvalue(L, -1);
+        lua_rawget(L, table);
+      }
+      else
+      {
+        lua_rawgeti(L, table, count + 1);
+      }
+
+      if (reusable_table(L, subkeys))
+      {
+        decode_document_into(L, key_end + 1, sublen, depth + 1, subkeys, clear);
+      }
+      else
+      {
+        lua_pop(L, 1);
+        decode_document(L, key_end + 1, sublen, depth + 1, subkeys, NULL, false);
+      }
+      next = key_end + 1 + sublen;
+    }
+    else
+    {
+      next = cbson_decode_value(L, type, key_end + 1, limit, depth, NULL, false);
+    }
 
-bool cbson_visit_codewscope(const bson_iter_t *iter, const char *key, size_t v_code_len, const char *v_code, const bson_t *v_scope, void *data)
-{
-  cbson_state_t *s = data;
+    if (!next)
+    {
+      if (keys)
+      {
+        lua_pop(L, 1);
+      }
+      break;
+    }
 
-  cbson_codewscope_create(s->L, v_code);
+    if (keys)
+    {
+      lua_rawset(L, table);
+    }
+    else
+    {
+      lua_rawseti(L, table, count + 1);
+    }
 
-  return false;
+    count++;
+    p = next;
+  }
+
+  if (clear)
+  {
+    remove_stale_keys(L, table, data, len, keys, count);
+  }
 }
 
-bool cbson_visit_dbpointer(const bson_iter_t *iter, const char *key, size_t v_collection_len, const char *v_collection, const bson_oid_t *v_oid, void *data)
+// same checks as bson_new_from_data, data is decoded in place
+void cbson_check_data(lua_State *L, const uint8_t* data, size_t len)
 {
-  cbson_state_t *s = data;
-  char str[25]="";
-
-  if (v_oid)
+  if (len < 5 || len > INT32_MAX || cbson_read_uint32(data) != len || data[len - 1] != '\0')
   {
-    bson_oid_to_string (v_oid, str);
+    luaL_error(L, "Can't init bson from data.");
   }
-
-  cbson_ref_create(s->L, v_collection, str);
-
-  return false;
 }
 
-bool cbson_visit_binary(const bson_iter_t *iter, const char *key, bson_subtype_t v_subtype, size_t v_binary_len, const uint8_t *v_binary, void *data)
+// pushes decoded table, dec is optional
+void cbson_decode_bson(lua_State *L, const uint8_t* data, size_t len, cbson_decoder_t* dec, bool ordered)
 {
-  cbson_state_t *s = data;
-  cbson_binary_create(s->L, v_subtype, (const char *)v_binary, (unsigned int)v_binary_len);
-
-  return false;
+  cbson_check_data(L, data, len);
+  decode_document(L, data, (uint32_t)len, 0, true, dec, ordered);
 }
 
-bool cbson_visit_decimal128(const bson_iter_t *iter, const char *key, const bson_decimal128_t *v_decimal128, void *data)
+// Decoding with explicit stack of frames, see cbson-async.h. Elements are decoded the same way as by
+// decode_document, nested documents and arrays push frame instead of recursion.
+void cbson_decode_job_init(lua_State* L, cbson_decode_job_t* job, int index)
 {
-  cbson_state_t *s = data;
-  cbson_decimal_create(s->L, v_decimal128);
-
-  return false;
+  size_t len;
+  const uint8_t* data = (const uint8_t*)lua_tolstring(L, index, &len);
+
+  cbson_check_data(L, data, len);
+
+  lua_createtable(L, 2, 0);
+  lua_pushvalue(L, index);
+  lua_rawseti(L, -2, 1);
+  lua_newtable(L);
+  lua_rawseti(L, -2, 2);
+  job->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  job->level = 0;
+  job->frames[0].p = data + 4;
+  job->frames[0].limit = data + len - 1;
+  job->frames[0].count = 0;
+  job->frames[0].keys = true;
+  job->done = false;
 }
 
-bool cbson_visit_timestamp(const bson_iter_t *iter, const char *key, uint32_t v_timestamp, uint32_t v_increment, void *data)
+bool cbson_decode_job_run(lua_State* L, cbson_decode_job_t* job, int budget)
 {
-  cbson_state_t *s = data;
+  int anchor;
 
-  cbson_timestamp_create(s->L, v_timestamp, v_increment);
+  luaL_checkstack(L, LUA_MINSTACK, "no stack for decode job");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, job->ref);
+  anchor = lua_gettop(L);
 
-  return false;
-}
+  while (budget > 0)
+  {
+    cbson_decode_frame_t* frame = &job->frames[job->level];
+    uint8_t type;
+    const uint8_t* key;
+    const uint8_t* key_end;
+    const uint8_t* next;
+    uint32_t sublen;
+
+    if (frame->p >= frame->limit)
+    {
+      cbson_decode_frame_t* parent;
+
+      if (job->level == 0)
+      {
+        lua_rawgeti(L, anchor, 2);
+        lua_remove(L, anchor);
+        job->done = true;
+        CBSON_STATS_DOCUMENTS(1);
+        return true;
+      }
+
+      // set finished table in parent
+      parent = &job->frames[job->level - 1];
+      lua_rawgeti(L, anchor, job->level + 1);
+      if (parent->keys)
+      {
+        lua_pushlstring(L, (const char*)parent->key, parent->key_len);
+        lua_rawgeti(L, anchor, job->level + 2);
+        lua_rawset(L, -3);
+      }
+      else
+      {
+        lua_rawgeti(L, anchor, job->level + 2);
+        lua_rawseti(L, -2, ++parent->count);
+      }
+      lua_pop(L, 1);
+
+      lua_pushnil(L);
+      lua_rawseti(L, anchor, job->level + 2);
+      job->level--;
+      continue;
+    }
 
-const bson_visitor_t cbson_visitors = {
-  cbson_visit_before,
-  cbson_visit_after,
-  NULL, /* visit_corrupt */
-  cbson_visit_double,
-  cbson_visit_utf8,
-  cbson_visit_document,
-  cbson_visit_array,
-  cbson_visit_binary,
-  cbson_visit_undefined,
-  cbson_visit_oid,
-  cbson_visit_bool,
-  cbson_visit_date_time,
-  cbson_visit_null,
-  cbson_visit_regex,
-  cbson_visit_dbpointer,
-  cbson_visit_code,
-  cbson_visit_symbol,
-  cbson_visit_codewscope,
-  cbson_visit_int32,
-  cbson_visit_timestamp,
-  cbson_visit_int64,
-  cbson_visit_maxkey,
-  cbson_visit_minkey,
-  NULL, /* visit_unsupported */
-  cbson_visit_decimal128
-};
-
-bool cbson_visit_document(const bson_iter_t *iter, const char *key, const bson_t *v_document, void *data)
-{
-  bson_iter_t iter_new;
-  cbson_state_t *s = data;
-  cbson_state_t cs = {0, true};
+    budget--;
+    type = *frame->p++;
+    key = frame->p;
+    key_end = memchr(key, 0, frame->limit - key);
 
-  if (s->depth >= BSON_MAX_RECURSION)
-  {
-    lua_pushlstring(s->L, "...", 3);
-    return false;
-  }
+    // corrupt element stops decoding of document, like in decode_document
+    if (!key_end || !cbson_valid_utf8(key, key_end - key))
+    {
+      frame->p = frame->limit;
+      continue;
+    }
 
-  if (bson_iter_init(&iter_new, v_document))
-  {
-    lua_newtable(s->L);
-    cs.depth = s->depth + 1;
-    cs.L = s->L;
-    bson_iter_visit_all(&iter_new, &cbson_visitors, &cs);
-  }
-  else
-  {
-    luaL_error(s->L, "Can't init bson iterator.");
+    if ((type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY) && job->level < BSON_MAX_RECURSION &&
+        cbson_check_subdocument(key_end + 1, frame->limit, &sublen))
+    {
+      cbson_decode_frame_t* child = &job->frames[job->level + 1];
+
+      frame->key = key;
+      frame->key_len = key_end - key;
+      frame->p = key_end + 1 + sublen;
+
+      child->p = key_end + 1 + 4;
+      child->limit = key_end + sublen;
+      child->count = 0;
+      child->keys = type == BSON_TYPE_DOCUMENT;
+
+      lua_newtable(L);
+      if (!child->keys)
+      {
+        luaL_getmetatable(L, CBSON_ARRAY_MT);
+        lua_setmetatable(L, -2);
+      }
+      lua_rawseti(L, anchor, job->level + 3);
+
+      job->level++;
+      CBSON_STATS_DEPTH(job->level);
+      continue;
+    }
+
+    lua_rawgeti(L, anchor, job->level + 2);
+    if (frame->keys)
+    {
+      lua_pushlstring(L, (const char*)key, key_end - key);
+    }
+
+    next = cbson_decode_value(L, type, key_end + 1, frame->limit, job->level, NULL, false);
+    if (!next)
+    {
+      lua_pop(L, frame->keys ? 2 : 1);
+      frame->p = frame->limit;
+      continue;
+    }
+
+    if (frame->keys)
+    {
+      lua_rawset(L, -3);
+    }
+    else
+    {
+      lua_rawseti(L, -2, ++frame->count);
+    }
+    lua_pop(L, 1);
+
+    frame->p = next;
   }
 
+  lua_pop(L, 1);
   return false;
 }
 
-bool cbson_visit_array(const bson_iter_t *iter, const char *key, const bson_t *v_array, void *data)
+static int decode_call(lua_State *L)
 {
-  bson_iter_t iter_new;
-  cbson_state_t *s = data;
-  cbson_state_t cs = {0, false};
-
-  if (s->depth >= BSON_MAX_RECURSION)
-  {
-    lua_pushlstring(s->L, "...", 3);
-    return false;
-  }
+  size_t len;
+  bool ordered = false;
+  CBSON_STATS_BEGIN();
 
-  if (bson_iter_init(&iter_new, v_array))
-  {
-    { // use metatable for arrays
-      lua_newtable(s->L);
-      luaL_getmetatable(s->L, CBSON_ARRAY_MT);
-      lua_setmetatable(s->L, -2);
-    }
+  const uint8_t* data = (uint8_t*)luaL_checklstring(L, 1, &len);
 
-    cs.depth = s->depth + 1;
-    cs.L = s->L;
-    bson_iter_visit_all(&iter_new, &cbson_visitors, &cs);
-  }
-  else
+  if (!lua_isnoneornil(L, 2))
   {
-    luaL_error(s->L, "Can't init bson iterator.");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "ordered");
+    ordered = lua_toboolean(L, -1);
+    lua_pop(L, 1);
   }
 
-  return false;
-}
+  cbson_decode_bson(L, data, len, NULL, ordered);
+  CBSON_STATS_DOCUMENTS(1);
 
+  CBSON_STATS_END(CBSON_STAT_DECODE, len, 0);
+  return 1;
+}
 
 int cbson_decode(lua_State *L)
 {
-  bson_t *bson;
-  cbson_state_t s = {0, true, 0};
-  bson_iter_t iter;
+  return cbson_arena_call(L, decode_call);
+}
+
+static int decode_into_call(lua_State *L)
+{
   size_t len;
+  bool clear = true;
+  CBSON_STATS_BEGIN();
 
   const uint8_t* data = (uint8_t*)luaL_checklstring(L, 1, &len);
+  luaL_checktype(L, 2, LUA_TTABLE);
 
-  bson = bson_new_from_data(data, len);
-
-  if (bson)
-  {
-    lua_pushnil(L);
-    if (bson_iter_init(&iter, bson))
-    {
-      lua_newtable(L);
-      s.L = L;
-      bson_iter_visit_all(&iter, &cbson_visitors, &s);
-    }
-    else
-    {
-      luaL_error(L, "Can't init bson iterator.");
-    }
-  }
-  else
+  if (!lua_isnoneornil(L, 3))
   {
-    luaL_error(L, "Can't init bson from data.");
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "clear");
+    clear = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
   }
 
-  bson_destroy(bson);
+  cbson_check_data(L, data, len);
+  lua_pushvalue(L, 2);
+  decode_document_into(L, data, (uint32_t)len, 0, true, clear);
+  CBSON_STATS_DOCUMENTS(1);
+
+  CBSON_STATS_END(CBSON_STAT_DECODE_INTO, len, 0);
   return 1;
 }
 
-int cbson_to_json(lua_State *L)
+int cbson_decode_into(lua_State *L)
+{
+  return cbson_arena_call(L, decode_into_call);
+}
+
+static int to_json_call(lua_State *L)
 {
   bson_t *bson;
   size_t len;
+  CBSON_STATS_BEGIN();
 
   const uint8_t* data = (uint8_t*)luaL_checklstring(L, 1, &len);
 
@@ -372,8 +806,11 @@ int cbson_to_json(lua_State *L)
 
   if (bson)
   {
-    const char* str = bson_as_json(bson, &len);
-    lua_pushlstring(L, str, len);
+    size_t json_len;
+    const char* str = bson_as_json(bson, &json_len);
+    lua_pushlstring(L, str, json_len);
+    CBSON_STATS_DOCUMENTS(1);
+    CBSON_STATS_END(CBSON_STAT_TO_JSON, len, json_len);
     bson_free((void *)str);
     bson_destroy(bson);
   }
@@ -384,10 +821,16 @@ int cbson_to_json(lua_State *L)
   return 1;
 }
 
-int cbson_to_relaxed_json(lua_State *L)
+int cbson_to_json(lua_State *L)
+{
+  return cbson_arena_call(L, to_json_call);
+}
+
+static int to_relaxed_json_call(lua_State *L)
 {
   bson_t *bson;
   size_t len;
+  CBSON_STATS_BEGIN();
 
   const uint8_t* data = (uint8_t*)luaL_checklstring(L, 1, &len);
 
@@ -395,8 +838,11 @@ int cbson_to_relaxed_json(lua_State *L)
 
   if (bson)
   {
-    const char* str = bson_as_relaxed_extended_json(bson, &len);
-    lua_pushlstring(L, str, len);
+    size_t json_len;
+    const char* str = bson_as_relaxed_extended_json(bson, &json_len);
+    lua_pushlstring(L, str, json_len);
+    CBSON_STATS_DOCUMENTS(1);
+    CBSON_STATS_END(CBSON_STAT_TO_RELAXED_JSON, len, json_len);
     bson_free((void *)str);
     bson_destroy(bson);
   }
@@ -406,3 +852,8 @@ int cbson_to_relaxed_json(lua_State *L)
   }
   return 1;
 }
+
+int cbson_to_relaxed_json(lua_State *L)
+{
+  return cbson_arena_call(L, to_relaxed_json_call);
+}
@@ -2,8 +2,54 @@
 #define __CBSON_DECODE_H__
 
 #include <lua.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <bson.h>
+
+#include "cbson-decoder.h"
+
+static inline uint32_t cbson_read_uint32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return BSON_UINT32_FROM_LE(v);
+}
+
+static inline uint64_t cbson_read_uint64(const uint8_t* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return BSON_UINT64_FROM_LE(v);
+}
+
+static inline double cbson_read_double(const uint8_t* p)
+{
+  double v;
+  memcpy(&v, p, sizeof(v));
+  return BSON_DOUBLE_FROM_LE(v);
+}
+
+// Element parsing shared by decode, tape and columns. Values are checked against limit (end of enclosing
+// document without trailing NUL), functions returning pointer return one past the element or NULL if it's corrupt.
+bool cbson_valid_utf8(const uint8_t* str, size_t len);
+bool cbson_check_string(const uint8_t* p, const uint8_t* limit, uint32_t* len);
+bool cbson_check_subdocument(const uint8_t* p, const uint8_t* limit, uint32_t* len);
+// raises error unless data is whole BSON document
+void cbson_check_data(lua_State *L, const uint8_t* data, size_t len);
+
+// skip doesn't touch lua state, push takes value checked by skip. Documents and arrays are left to caller.
+const uint8_t* cbson_skip_value(uint8_t type, const uint8_t* p, const uint8_t* limit);
+void cbson_push_value(lua_State* L, uint8_t type, const uint8_t* p);
+// pushes any value, documents and arrays included, dec is optional
+const uint8_t* cbson_decode_value(lua_State* L, uint8_t type, const uint8_t* p, const uint8_t* limit, uint32_t depth,
+  cbson_decoder_t* dec, bool ordered);
+
+void cbson_decode_bson(lua_State *L, const uint8_t* data, size_t len, cbson_decoder_t* dec, bool ordered);
 
 int cbson_decode(lua_State *L);
+int cbson_decode_into(lua_State *L);
 int cbson_to_json(lua_State *L);
 int cbson_to_relaxed_json(lua_State *L);
 
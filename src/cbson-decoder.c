@@ -0,0 +1,213 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+
+#include "cbson.h"
+#include "cbson-decoder.h"
+#include "cbson-decode.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+
+DEFINE_CHECK(DECODER, decoder)
+
+// slots of both caches are stored right after the struct, keys first
+#define DECODER_SLOTS(d) ((cbson_intern_slot_t*)((d) + 1))
+
+static uint32_t check_option(lua_State* L, int index, const char* name, uint32_t def, uint32_t max)
+{
+  uint32_t value = def;
+
+  lua_getfield(L, index, name);
+  if (!lua_isnil(L, -1))
+  {
+    // 5.1 luaL_checkinteger truncates fractions, compare with the number itself
+    lua_Integer n = luaL_checkinteger(L, -1);
+    if (n < 0 || n > (lua_Integer)max || (lua_Number)n != lua_tonumber(L, -1))
+    {
+      luaL_error(L, "Invalid %s, expected integer 0..%d", name, (int)max);
+    }
+    value = (uint32_t)n;
+  }
+  lua_pop(L, 1);
+
+  return value;
+}
+
+static uint32_t check_cache_size(lua_State* L, int index, const char* name, uint32_t def)
+{
+  uint32_t size = check_option(L, index, name, def, 65536);
+  uint32_t rounded = 1;
+
+  if (size == 0)
+  {
+    return 0;
+  }
+
+  // at least one pair of slots
+  while (rounded < size || rounded < 2)
+  {
+    rounded <<= 1;
+  }
+
+  return rounded;
+}
+
+static void intern_init(lua_State* L, cbson_intern_t* t, cbson_intern_slot_t* slots, uint32_t size)
+{
+  memset(slots, 0, size * sizeof(cbson_intern_slot_t));
+  t->slots = size ? slots : NULL;
+  t->mask = size ? size - 1 : 0;
+  t->index = 0;
+  t->hits = 0;
+  t->misses = 0;
+
+  if (size)
+  {
+    lua_createtable(L, size, 0);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  else
+  {
+    t->ref = LUA_NOREF;
+  }
+}
+
+static void intern_clear(lua_State* L, cbson_intern_t* t)
+{
+  if (t->slots)
+  {
+    memset(t->slots, 0, (t->mask + 1) * sizeof(cbson_intern_slot_t));
+    luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+    lua_createtable(L, t->mask + 1, 0);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  t->hits = 0;
+  t->misses = 0;
+}
+
+static void intern_destroy(lua_State* L, cbson_intern_t* t)
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+  t->ref = LUA_NOREF;
+  t->slots = NULL;
+}
+
+static void intern_stats(lua_State* L, cbson_intern_t* t, const char* name)
+{
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, (lua_Integer)t->hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, (lua_Integer)t->misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, t->slots ? t->mask + 1 : 0);
+  lua_setfield(L, -2, "size");
+  lua_setfield(L, -2, name);
+}
+
+// pushes anchor table, remembers its stack index for cbson_intern_push
+static void intern_begin(lua_State* L, cbson_intern_t* t)
+{
+  if (t->slots)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+    t->index = lua_gettop(L);
+  }
+}
+
+int cbson_decoder_new(lua_State* L)
+{
+  uint32_t key_cache = CBSON_DEFAULT_KEY_CACHE;
+  uint32_t value_cache = 0;
+  uint32_t max_value_len = CBSON_DEFAULT_MAX_VALUE_LEN;
+  cbson_decoder_t* d;
+
+  if (!lua_isnoneornil(L, 1))
+  {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    key_cache = check_cache_size(L, 1, "key_cache", key_cache);
+    value_cache = check_cache_size(L, 1, "value_cache", value_cache);
+    max_value_len = check_option(L, 1, "max_value_len", max_value_len, 1024);
+  }
+
+  d = lua_newuserdata(L, sizeof(cbson_decoder_t) + (key_cache + value_cache) * sizeof(cbson_intern_slot_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_DECODER);
+  intern_init(L, &d->keys, DECODER_SLOTS(d), key_cache);
+  intern_init(L, &d->values, DECODER_SLOTS(d) + key_cache, value_cache);
+  d->max_value_len = max_value_len;
+
+  luaL_getmetatable(L, DECODER_METATABLE);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int decoder_decode_call(lua_State* L)
+{
+  cbson_decoder_t* d = check_cbson_decoder(L, 1);
+  size_t len;
+  CBSON_STATS_BEGIN();
+
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 2, &len);
+
+  intern_begin(L, &d->keys);
+  intern_begin(L, &d->values);
+  cbson_decode_bson(L, data, len, d, false);
+
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_DECODER_DECODE, len, 0);
+  return 1;
+}
+
+int cbson_decoder_decode(lua_State* L)
+{
+  return cbson_arena_call(L, decoder_decode_call);
+}
+
+int cbson_decoder_clear(lua_State* L)
+{
+  cbson_decoder_t* d = check_cbson_decoder(L, 1);
+
+  intern_clear(L, &d->keys);
+  intern_clear(L, &d->values);
+  return 0;
+}
+
+int cbson_decoder_stats(lua_State* L)
+{
+  cbson_decoder_t* d = check_cbson_decoder(L, 1);
+
+  lua_createtable(L, 0, 2);
+  intern_stats(L, &d->keys, "keys");
+  intern_stats(L, &d->values, "values");
+  return 1;
+}
+
+int cbson_decoder_destroy(lua_State* L)
+{
+  cbson_decoder_t* d = check_cbson_decoder(L, 1);
+
+  intern_destroy(L, &d->keys);
+  intern_destroy(L, &d->values);
+  return 0;
+}
+
+int cbson_decoder_tostring(lua_State* L)
+{
+  cbson_decoder_t* d = check_cbson_decoder(L, 1);
+
+  lua_pushfstring(L, "decoder (key cache %d, value cache %d)",
+                  d->keys.slots ? (int)d->keys.mask + 1 : 0, d->values.slots ? (int)d->values.mask + 1 : 0);
+  return 1;
+}
+
+const struct luaL_Reg cbson_decoder_meta[] = {
+  {"__tostring", cbson_decoder_tostring},
+  {"__gc",       cbson_decoder_destroy},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_decoder_methods[] = {
+  {"decode", cbson_decoder_decode},
+  {"clear",  cbson_decoder_clear},
+  {"stats",  cbson_decoder_stats},
+  {NULL, NULL}
+};
@@ -0,0 +1,138 @@
+#ifndef __CBSON_DECODER_H__
+#define __CBSON_DECODER_H__
+
+#include <lua.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DECODER_METATABLE "bson-decoder metatable"
+
+#define CBSON_DEFAULT_KEY_CACHE 1024
+#define CBSON_DEFAULT_MAX_VALUE_LEN 32
+
+// Two-way set associative cache of lua strings: string may live in slot (hash & mask) or its pair slot,
+// when both are taken the first one is replaced. Strings are anchored in a registry table
+// (slot i at index i + 1), str points to their bytes.
+typedef struct {
+  uint32_t hash;
+  uint32_t len;
+  const char* str;
+} cbson_intern_slot_t;
+
+typedef struct {
+  cbson_intern_slot_t* slots;
+  uint32_t mask;
+  int ref;
+  int index; // stack index of anchor table while decoding
+  uint64_t hits;
+  uint64_t misses;
+} cbson_intern_t;
+
+typedef struct {
+  cbson_intern_t keys;
+  cbson_intern_t values;   // short utf8 values, off by default
+  uint32_t max_value_len;
+} cbson_decoder_t;
+
+int cbson_decoder_new(lua_State* L);
+cbson_decoder_t* check_cbson_decoder(lua_State *L, int index);
+
+extern const struct luaL_Reg cbson_decoder_meta[];
+extern const struct luaL_Reg cbson_decoder_methods[];
+
+// hashes length, both ends and the middle of string, collisions are resolved by memcmp
+static inline uint32_t cbson_intern_hash(const char* s, size_t len)
+{
+  uint32_t a = 0, b = 0, c = 0, h;
+
+  if (len >= 4)
+  {
+    memcpy(&a, s, 4);
+    memcpy(&b, s + len - 4, 4);
+    memcpy(&c, s + (len >> 1) - 2, 4);
+  }
+  else if (len > 0)
+  {
+    a = (uint8_t)s[0] | ((uint32_t)(uint8_t)s[len >> 1] << 8) | ((uint32_t)(uint8_t)s[len - 1] << 16);
+  }
+
+  h = (uint32_t)len ^ a ^ (b * 0x9E3779B1u) ^ (c * 0x85EBCA77u);
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 13;
+  return h;
+}
+
+static inline int cbson_intern_match(const cbson_intern_slot_t* slot, uint32_t h, const char* s, size_t len)
+{
+  return slot->hash == h && slot->len == len && slot->str && memcmp(slot->str, s, len) == 0;
+}
+
+// returns slot index of cached string or -1, hash is stored for cbson_intern_store
+static inline int cbson_intern_lookup(cbson_intern_t* t, const char* s, size_t len, uint32_t* hash)
+{
+  uint32_t h = cbson_intern_hash(s, len);
+  uint32_t i = h & t->mask;
+
+  *hash = h;
+
+  if (cbson_intern_match(&t->slots[i], h, s, len))
+  {
+    t->hits++;
+    return (int)i;
+  }
+
+  if (cbson_intern_match(&t->slots[i ^ 1], h, s, len))
+  {
+    t->hits++;
+    return (int)(i ^ 1);
+  }
+
+  t->misses++;
+  return -1;
+}
+
+static inline void cbson_intern_push_slot(lua_State* L, cbson_intern_t* t, int i)
+{
+  lua_rawgeti(L, t->index, i + 1);
+}
+
+// pushes new string and caches it, after cbson_intern_lookup miss
+static inline void cbson_intern_store(lua_State* L, cbson_intern_t* t, const char* s, size_t len, uint32_t h)
+{
+  uint32_t i = h & t->mask;
+  cbson_intern_slot_t* slot = &t->slots[i];
+  cbson_intern_slot_t* pair = &t->slots[i ^ 1];
+
+  if (slot->str && !pair->str)
+  {
+    slot = pair;
+    i ^= 1;
+  }
+
+  lua_pushlstring(L, s, len);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, t->index, i + 1);
+
+  slot->hash = h;
+  slot->len = (uint32_t)len;
+  slot->str = lua_tostring(L, -1);
+}
+
+// pushes string, reusing cached lua string if the same bytes were pushed before
+static inline void cbson_intern_push(lua_State* L, cbson_intern_t* t, const char* s, size_t len)
+{
+  uint32_t h;
+  int i = cbson_intern_lookup(t, s, len, &h);
+
+  if (i >= 0)
+  {
+    cbson_intern_push_slot(L, t, i);
+  }
+  else
+  {
+    cbson_intern_store(L, t, s, len, h);
+  }
+}
+
+#endif
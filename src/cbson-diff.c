@@ -0,0 +1,291 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <string.h>
+
+#include "cbson.h"
+#include "cbson-diff.h"
+#include "cbson-encode.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+
+// elements with equal keys are identical when their raw byte ranges match
+static bool same_element(const bson_iter_t* a, const bson_iter_t* b)
+{
+  uint32_t a_len = a->next_off - a->off;
+  uint32_t b_len = b->next_off - b->off;
+
+  return a_len == b_len && memcmp(a->raw + a->off, b->raw + b->off, a_len) == 0;
+}
+
+// looks up key at the next position of pos first (documents usually keep order), scans whole doc otherwise
+static bool find_field(const bson_iter_t* doc, bson_iter_t* pos, const char* key, bson_iter_t* found)
+{
+  if (bson_iter_next(pos) && strcmp(bson_iter_key(pos), key) == 0)
+  {
+    *found = *pos;
+    return true;
+  }
+
+  *found = *doc;
+  return bson_iter_find(found, key);
+}
+
+// keys with '.' or leading '$' (and empty one) can't be part of dotted path, their parent is set as a whole
+static bool path_keys(const bson_iter_t* doc)
+{
+  bson_iter_t iter = *doc;
+
+  while (bson_iter_next(&iter))
+  {
+    const char* key = bson_iter_key(&iter);
+
+    if (key[0] == '\0' || key[0] == '$' || strchr(key, '.'))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static char* diff_path(const char* prefix, const char* key)
+{
+  return prefix ? bson_strdup_printf("%s.%s", prefix, key) : bson_strdup(key);
+}
+
+static void diff_documents(const bson_iter_t* old_doc, const bson_iter_t* new_doc, const char* prefix, int depth,
+  bson_t* set, bson_t* unset)
+{
+  bson_iter_t old_iter, new_iter, old_pos, new_pos;
+
+  new_iter = *new_doc;
+  old_pos = *old_doc;
+
+  while (bson_iter_next(&new_iter))
+  {
+    const char* key = bson_iter_key(&new_iter);
+    char* path;
+
+    if (find_field(old_doc, &old_pos, key, &old_iter))
+    {
+      bson_iter_t old_child, new_child;
+
+      if (same_element(&old_iter, &new_iter))
+      {
+        continue;
+      }
+
+      path = diff_path(prefix, key);
+
+      // arrays are replaced as a whole, documents are diffed field by field up to BSON_MAX_RECURSION levels,
+      // unless their keys can't be written as path
+      if (depth < BSON_MAX_RECURSION && BSON_ITER_HOLDS_DOCUMENT(&old_iter) && BSON_ITER_HOLDS_DOCUMENT(&new_iter) &&
+          bson_iter_recurse(&old_iter, &old_child) && bson_iter_recurse(&new_iter, &new_child) &&
+          path_keys(&old_child) && path_keys(&new_child))
+      {
+        diff_documents(&old_child, &new_child, path, depth + 1, set, unset);
+      }
+      else
+      {
+        bson_append_iter(set, path, -1, &new_iter);
+      }
+    }
+    else
+    {
+      path = diff_path(prefix, key);
+      bson_append_iter(set, path, -1, &new_iter);
+    }
+
+    bson_free(path);
+  }
+
+  old_iter = *old_doc;
+  new_pos = *new_doc;
+
+  while (bson_iter_next(&old_iter))
+  {
+    const char* key = bson_iter_key(&old_iter);
+
+    if (!find_field(new_doc, &new_pos, key, &new_iter))
+    {
+      char* path = diff_path(prefix, key);
+      BSON_APPEND_UTF8(unset, path, "");
+      bson_free(path);
+    }
+  }
+}
+
+static int diff_call(lua_State* L)
+{
+  bson_t old_bson, new_bson;
+  bson_iter_t old_iter, new_iter;
+  bson_t update = BSON_INITIALIZER;
+  bson_t set = BSON_INITIALIZER;
+  bson_t unset = BSON_INITIALIZER;
+  CBSON_STATS_BEGIN();
+
+  cbson_check_bson(L, 1, &old_bson);
+  cbson_check_bson(L, 2, &new_bson);
+
+  if (!bson_iter_init(&old_iter, &old_bson) || !bson_iter_init(&new_iter, &new_bson))
+  {
+    return luaL_error(L, "Can't init bson iterator.");
+  }
+
+  // top level documents have no parent to set
+  if (!path_keys(&old_iter) || !path_keys(&new_iter))
+  {
+    return luaL_error(L, "Top level key with '.' or leading '$' can't be used in update");
+  }
+
+  if (old_bson.len != new_bson.len || memcmp(bson_get_data(&old_bson), bson_get_data(&new_bson), old_bson.len) != 0)
+  {
+    diff_documents(&old_iter, &new_iter, NULL, 0, &set, &unset);
+  }
+
+  if (!bson_empty(&set))
+  {
+    BSON_APPEND_DOCUMENT(&update, "$set", &set);
+  }
+
+  if (!bson_empty(&unset))
+  {
+    BSON_APPEND_DOCUMENT(&update, "$unset", &unset);
+  }
+
+  lua_pushlstring(L, (const char*)bson_get_data(&update), update.len);
+  CBSON_STATS_DOCUMENTS(2);
+  CBSON_STATS_END(CBSON_STAT_DIFF, old_bson.len + new_bson.len, update.len);
+
+  bson_destroy(&unset);
+  bson_destroy(&set);
+  bson_destroy(&update);
+
+  return 1;
+}
+
+int cbson_diff(lua_State* L)
+{
+  return cbson_arena_call(L, diff_call);
+}
+
+// fields of a keep their position, overridden by b, new fields of b are appended. Deep merge stops at
+// BSON_MAX_RECURSION levels, below that b subdocuments override as a whole.
+static void merge_documents(const bson_iter_t* a_doc, const bson_iter_t* b_doc, int deep, bson_t* out)
+{
+  bson_iter_t a_iter, b_iter, a_pos, b_pos;
+
+  a_iter = *a_doc;
+  b_pos = *b_doc;
+
+  while (bson_iter_next(&a_iter))
+  {
+    const char* key = bson_iter_key(&a_iter);
+
+    if (!find_field(b_doc, &b_pos, key, &b_iter))
+    {
+      bson_append_iter(out, NULL, 0, &a_iter);
+    }
+    else if (deep > 0 && BSON_ITER_HOLDS_DOCUMENT(&a_iter) && BSON_ITER_HOLDS_DOCUMENT(&b_iter) && !same_element(&a_iter, &b_iter))
+    {
+      bson_iter_t a_child, b_child;
+      bson_t child;
+
+      bson_iter_recurse(&a_iter, &a_child);
+      bson_iter_recurse(&b_iter, &b_child);
+
+      bson_append_document_begin(out, key, -1, &child);
+      merge_documents(&a_child, &b_child, deep - 1, &child);
+      bson_append_document_end(out, &child);
+    }
+    else
+    {
+      bson_append_iter(out, NULL, 0, &b_iter);
+    }
+  }
+
+  b_iter = *b_doc;
+  a_pos = *a_doc;
+
+  while (bson_iter_next(&b_iter))
+  {
+    if (!find_field(a_doc, &a_pos, bson_iter_key(&b_iter), &a_iter))
+    {
+      bson_append_iter(out, NULL, 0, &b_iter);
+    }
+  }
+}
+
+static int merge_call(lua_State* L)
+{
+  bson_t a, b;
+  bson_iter_t a_iter, b_iter;
+  bson_t* out;
+  bool deep = false;
+  CBSON_STATS_BEGIN();
+
+  cbson_check_bson(L, 1, &a);
+  cbson_check_bson(L, 2, &b);
+
+  if (!lua_isnoneornil(L, 3))
+  {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "deep");
+    deep = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  // nothing to merge, one of inputs is the result
+  if (bson_empty(&a) || bson_empty(&b))
+  {
+    lua_pushvalue(L, bson_empty(&a) ? 2 : 1);
+    return 1;
+  }
+
+  if (!bson_iter_init(&a_iter, &a) || !bson_iter_init(&b_iter, &b))
+  {
+    return luaL_error(L, "Can't init bson iterator.");
+  }
+
+  out = bson_sized_new(a.len + b.len);
+  merge_documents(&a_iter, &b_iter, deep ? BSON_MAX_RECURSION : 0, out);
+
+  lua_pushlstring(L, (const char*)bson_get_data(out), out->len);
+  CBSON_STATS_DOCUMENTS(2);
+  CBSON_STATS_END(CBSON_STAT_MERGE, a.len + b.len, out->len);
+  bson_destroy(out);
+
+  return 1;
+}
+
+int cbson_merge(lua_State* L)
+{
+  return cbson_arena_call(L, merge_call);
+}
+
+static int concat_call(lua_State* L)
+{
+  bson_t a, b;
+  bson_t* out;
+  CBSON_STATS_BEGIN();
+
+  cbson_check_bson(L, 1, &a);
+  cbson_check_bson(L, 2, &b);
+
+  out = bson_sized_new(a.len + b.len - 5);
+  bson_concat(out, &a);
+  bson_concat(out, &b);
+
+  lua_pushlstring(L, (const char*)bson_get_data(out), out->len);
+  CBSON_STATS_DOCUMENTS(2);
+  CBSON_STATS_END(CBSON_STAT_CONCAT, a.len + b.len, out->len);
+  bson_destroy(out);
+
+  return 1;
+}
+
+int cbson_concat(lua_State* L)
+{
+  return cbson_arena_call(L, concat_call);
+}
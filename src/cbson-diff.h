@@ -0,0 +1,10 @@
+#ifndef __CBSON_DIFF_H__
+#define __CBSON_DIFF_H__
+
+#include <lua.h>
+
+int cbson_diff(lua_State* L);
+int cbson_merge(lua_State* L);
+int cbson_concat(lua_State* L);
+
+#endif
@@ -9,6 +9,9 @@
 #include "cbson.h"
 #include "cbson-util.h"
 #include "cbson-encode.h"
+#include "cbson-async.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
 #include "cbson-oid.h"
 #include "cbson-regex.h"
 #include "cbson-binary.h"
@@ -21,6 +24,8 @@
 #include "cbson-uint.h"
 #include "cbson-date.h"
 #include "cbson-decimal.h"
+#include "cbson-template.h"
+#include "cbson-decoder.h"
 
 
 // encoding
@@ -33,7 +38,7 @@ static int is_array(lua_State *L, int index)
   if (lua_getmetatable(L, index) != 0)
   {
     luaL_getmetatable(L, CBSON_ARRAY_MT);
-    bool is_array_mt = lua_equal(L, -1, -2);
+    bool is_array_mt = lua_rawequal(L, -1, -2);
     lua_pop(L, 2);
 
     if (is_array_mt)
@@ -78,7 +83,7 @@ static int is_ordered_map(lua_State *L, int index)
   if (lua_getmetatable(L, index) != 0)
   {
     luaL_getmetatable(L, CBSON_ORDERED_MAP_MT);
-    bool is_ordered_map_mt = lua_equal(L, -1, -2);
+    bool is_ordered_map_mt = lua_rawequal(L, -1, -2);
     lua_pop(L, 2);
 
     if (is_ordered_map_mt)
@@ -90,46 +95,185 @@ static int is_ordered_map(lua_State *L, int index)
   return 0;
 }
 
-static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, int level, const char* firstkey);
-static void iterate_ordered_table(lua_State *L, int index, bson_t* bson, int level);
+// flat {k1, v1, k2, v2, ...} table tagged by cbson.ordered
+static int is_flat_ordered(lua_State *L, int index)
+{
+  if (lua_getmetatable(L, index) != 0)
+  {
+    luaL_getmetatable(L, CBSON_ORDERED_MT);
+    bool is_ordered_mt = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return is_ordered_mt;
+  }
+
+  return 0;
+}
+
+// pushes key of pair starting at i, returns false at the end of flat table
+static bool flat_key(lua_State *L, int index, int i, const char** key)
+{
+  lua_rawgeti(L, index, i);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    return false;
+  }
+
+  if (!lua_isstring(L, -1))
+  {
+    luaL_error(L, "Invalid key at position %d of ordered table", i);
+  }
+
+  *key = lua_tostring(L, -1);
+  return true;
+}
+
+// Tables nested deeper than CBSON_CYCLE_DEPTH are kept in open addressing set of table pointers while
+// they are encoded, so reference cycle is reported instead of running into depth limit. Shallow tables
+// are never tracked, the set is created by the first table crossing the threshold.
+#define CBSON_VISITED_SIZE (2 * BSON_MAX_RECURSION + 1)
+
+typedef struct {
+  const void* slots[CBSON_VISITED_SIZE];
+} cbson_visited_t;
+
+// adds table to the set, returns its slot or -1 if table is already being encoded
+static int visited_enter(cbson_visited_t* visited, const void* table)
+{
+  size_t i = ((uintptr_t)table >> 4) % CBSON_VISITED_SIZE;
+
+  while (visited->slots[i])
+  {
+    if (visited->slots[i] == table)
+    {
+      return -1;
+    }
+    i = (i + 1) % CBSON_VISITED_SIZE;
+  }
+
+  visited->slots[i] = table;
+  return (int)i;
+}
+
+// tables leave in reverse order, so no later insert has probed past the slot and it can be just cleared
+static void visited_leave(cbson_visited_t* visited, int slot)
+{
+  visited->slots[slot] = NULL;
+}
+
+typedef struct {
+  bool placeholders;          // placeholders are written, only while building template
+  cbson_visited_t* visited;   // NULL until tracking starts
+} cbson_encode_state_t;
+
+static const cbson_encode_state_t default_state = {false, NULL};
+
+static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, int level, const char* firstkey,
+  const cbson_encode_state_t* state);
+static void iterate_ordered_table(lua_State *L, int index, bson_t* bson, int level, const cbson_encode_state_t* state);
+static void iterate_flat_table(lua_State *L, int index, bson_t* bson, int level, const cbson_encode_state_t* state);
+static void encode_value(lua_State *L, int index, bson_t* bson, int level, const char* key,
+  const cbson_encode_state_t* state);
+
+// set is on C stack of this call only, it must not be inlined into recursive encode_value
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void encode_tracked_value(lua_State *L, int index, bson_t* bson, int level, const char* key,
+  const cbson_encode_state_t* state)
+{
+  cbson_visited_t visited;
+  cbson_encode_state_t tracked = *state;
 
+  memset(&visited, 0, sizeof(cbson_visited_t));
+  tracked.visited = &visited;
+  encode_value(L, index, bson, level, key, &tracked);
+}
 
 void switch_value(lua_State *L, int index, bson_t* bson, int level, const char* key)
+{
+  encode_value(L, index, bson, level, key, &default_state);
+}
+
+static void encode_value(lua_State *L, int index, bson_t* bson, int level, const char* key,
+  const cbson_encode_state_t* state)
 {
     switch(lua_type(L, index))
     {
       case LUA_TTABLE:
       {
-        int is_a=is_array(L, index);
-        int is_order_map = false;
-        if (is_a)
+        int slot = -1;
+
+        if (level >= BSON_MAX_RECURSION)
         {
-          is_order_map = is_ordered_map(L, index);
+          luaL_error(L, "table is too deep");
         }
 
-        if (is_a && is_order_map == false)
+        if (level >= CBSON_CYCLE_DEPTH)
         {
-          bson_t child;
-          //start array
-          BSON_APPEND_ARRAY_BEGIN(bson, key, &child);
-          iterate_table(L, index, &child, 0, level+1, NULL);
-          bson_append_array_end(bson, &child);
+          if (!state->visited)
+          {
+            encode_tracked_value(L, index, bson, level, key, state);
+            break;
+          }
+
+          slot = visited_enter(state->visited, lua_topointer(L, index));
+          if (slot < 0)
+          {
+            luaL_error(L, "table contains reference cycle");
+          }
         }
-        else if (is_a && is_order_map == true)
+
+        if (is_flat_ordered(L, index))
         {
           bson_t child;
-          //start ordered map
+
+          CBSON_STATS_DEPTH(level + 1);
           BSON_APPEND_DOCUMENT_BEGIN(bson, key, &child);
-          iterate_ordered_table(L, index, &child, level+1);
+          iterate_flat_table(L, index < 0 ? lua_gettop(L) + index + 1 : index, &child, level+1, state);
           bson_append_document_end(bson, &child);
         }
         else
         {
-          bson_t child;
-          //start map
-          BSON_APPEND_DOCUMENT_BEGIN(bson, key, &child);
-          iterate_table(L, index, &child, 1, level+1, NULL);
-          bson_append_document_end(bson, &child);
+          int is_a=is_array(L, index);
+          int is_order_map = false;
+          if (is_a)
+          {
+            is_order_map = is_ordered_map(L, index);
+          }
+
+          CBSON_STATS_DEPTH(level + 1);
+
+          if (is_a && is_order_map == false)
+          {
+            bson_t child;
+            //start array
+            BSON_APPEND_ARRAY_BEGIN(bson, key, &child);
+            iterate_table(L, index, &child, 0, level+1, NULL, state);
+            bson_append_array_end(bson, &child);
+          }
+          else if (is_a && is_order_map == true)
+          {
+            bson_t child;
+            //start ordered map
+            BSON_APPEND_DOCUMENT_BEGIN(bson, key, &child);
+            iterate_ordered_table(L, index, &child, level+1, state);
+            bson_append_document_end(bson, &child);
+          }
+          else
+          {
+            bson_t child;
+            //start map
+            BSON_APPEND_DOCUMENT_BEGIN(bson, key, &child);
+            iterate_table(L, index, &child, 1, level+1, NULL, state);
+            bson_append_document_end(bson, &child);
+          }
+        }
+
+        if (slot >= 0)
+        {
+          visited_leave(state->visited, slot);
         }
         break;
       }
@@ -142,6 +286,21 @@ void switch_value(lua_State *L, int index, bson_t* bson, int level, const char*
 
       case LUA_TNUMBER:
       {
+#ifdef CBSON_NATIVE_INTEGERS
+        if (lua_isinteger(L, index))
+        {
+          lua_Integer i = lua_tointeger(L, index);
+          if (i < INT32_MIN || i > INT32_MAX)
+          {
+            BSON_APPEND_INT64(bson, key, i);
+          }
+          else
+          {
+            BSON_APPEND_INT32(bson, key, (int32_t)i);
+          }
+          break;
+        }
+#endif
         BSON_APPEND_DOUBLE(bson, key, lua_tonumber(L, index));
         break;
       }
@@ -277,6 +436,16 @@ void switch_value(lua_State *L, int index, bson_t* bson, int level, const char*
           cbson_decimal_t * dec = check_cbson_decimal(L, index);
           BSON_APPEND_DECIMAL128(bson, key, &dec->dec);
         }
+        else if (luaL_checkudata_ex(L, index, PLACEHOLDER_METATABLE))
+        {
+          cbson_placeholder_t* ph = check_cbson_placeholder(L, index);
+
+          if (!state->placeholders)
+          {
+            luaL_error(L, "Placeholder can only be used in cbson.template");
+          }
+          cbson_placeholder_append(bson, key, ph->index);
+        }
         break;
       }
       case LUA_TFUNCTION:
@@ -288,13 +457,15 @@ void switch_value(lua_State *L, int index, bson_t* bson, int level, const char*
 
 }
 
-static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, int level, const char* firstkey)
+static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, int level, const char* firstkey,
+  const cbson_encode_state_t* state)
 {
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
 
   if (firstkey!=NULL)
   {
     lua_getfield(L, index, firstkey);
-    switch_value(L, -1, bson, level, firstkey);
+    encode_value(L, -1, bson, level, firstkey, state);
     lua_pop(L,1);
   }
 
@@ -314,10 +485,10 @@ static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, i
     // stack: -1 => key; -2 => value; -3 => key; -4 => table
 
     const char *key;
+    char ckey[512];
 
     if (!use_keys)
     {
-      char ckey[512];
       snprintf(ckey, 512, "%d", k);
       key = ckey;
     }
@@ -332,7 +503,7 @@ static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, i
       continue;
     }
 
-    switch_value(L, -2, bson, level, key);
+    encode_value(L, -2, bson, level, key, state);
 
     lua_pop(L, 2);
     // stack: -1 => key; -2 => table
@@ -342,8 +513,9 @@ static void iterate_table(lua_State *L, int index, bson_t* bson, int use_keys, i
   lua_pop(L, 1);
 }
 
-static void iterate_ordered_table(lua_State *L, int index, bson_t* bson, int level)
+static void iterate_ordered_table(lua_State *L, int index, bson_t* bson, int level, const cbson_encode_state_t* state)
 {
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
 
   lua_pushvalue(L, index);
   // stack: -1 => table
@@ -359,13 +531,15 @@ static void iterate_ordered_table(lua_State *L, int index, bson_t* bson, int lev
     lua_pushnil(L);
     if (lua_next(L, -2) == 0)
     {
+      // empty entry
+      lua_pop(L, 1);
       continue;
     }
 
     lua_pushvalue(L, -2);
     const char *key = lua_tostring(L, -1);
 
-    switch_value(L, -2, bson, level, key);
+    encode_value(L, -2, bson, level, key, state);
 
     lua_pop(L, 4);
     // stack: -1 => key; -2 => table
@@ -375,55 +549,933 @@ static void iterate_ordered_table(lua_State *L, int index, bson_t* bson, int lev
   lua_pop(L, 1);
 }
 
-int cbson_encode(lua_State *L)
+static void iterate_flat_table(lua_State *L, int index, bson_t* bson, int level, const cbson_encode_state_t* state)
 {
-  bson_t bson = BSON_INITIALIZER;
+  const char* key;
+  int i;
 
-  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
 
-  bool is_arr = is_array(L, 1);
+  for (i = 1; flat_key(L, index, i, &key); i += 2)
+  {
+    lua_rawgeti(L, index, i + 1);
+    encode_value(L, -1, bson, level, key, state);
+    lua_pop(L, 2);
+  }
+}
+
+static void encode_table(lua_State *L, int index, bson_t* bson, const cbson_encode_state_t* state)
+{
+  if (is_flat_ordered(L, index))
+  {
+    iterate_flat_table(L, index, bson, 0, state);
+    return;
+  }
+
+  bool is_arr = is_array(L, index);
   bool is_order_map = false;
   if (is_arr)
   {
-    is_order_map = is_ordered_map(L, 1);
+    is_order_map = is_ordered_map(L, index);
   }
 
   if (is_arr && is_order_map == true)
   {
-    iterate_ordered_table(L, 1, &bson, 1);
+    iterate_ordered_table(L, index, bson, 1, state);
   }
   else
   {
-    iterate_table(L, 1, &bson, 1, 0, NULL);
+    iterate_table(L, index, bson, 1, 0, NULL, state);
+  }
+}
+
+// Size of encoded data, computed with the same rules as switch_value without producing output.
+// Rare types with variable layout (regex, dbpointer, code with scope) are measured by encoding them.
+static int64_t table_size(lua_State *L, int index, int use_keys, int level);
+static int64_t ordered_table_size(lua_State *L, int index, int level);
+static int64_t flat_table_size(lua_State *L, int index, int level);
+
+static int64_t string_size(const char* str)
+{
+  return 4 + (int64_t)strlen(str) + 1;
+}
+
+// element size with type byte and key, 0 if value is skipped by switch_value
+static int64_t value_size(lua_State *L, int index, int level, const char* key)
+{
+  int64_t header = 1 + (int64_t)strlen(key) + 1;
+
+  switch(lua_type(L, index))
+  {
+    case LUA_TTABLE:
+    {
+      int is_a;
+
+      // cycles end up here too, tables aren't tracked when only measured
+      if (level >= BSON_MAX_RECURSION)
+      {
+        luaL_error(L, "table is too deep");
+      }
+
+      if (is_flat_ordered(L, index))
+      {
+        return header + flat_table_size(L, index, level + 1);
+      }
+
+      is_a = is_array(L, index);
+
+      if (is_a && is_ordered_map(L, index))
+      {
+        return header + ordered_table_size(L, index, level + 1);
+      }
+      return header + table_size(L, index, !is_a, level + 1);
+    }
+
+    case LUA_TNIL:
+      return header;
+
+    case LUA_TNUMBER:
+#ifdef CBSON_NATIVE_INTEGERS
+      if (lua_isinteger(L, index))
+      {
+        lua_Integer i = lua_tointeger(L, index);
+        return header + ((i < INT32_MIN || i > INT32_MAX) ? 8 : 4);
+      }
+#endif
+      return header + 8;
+
+    case LUA_TBOOLEAN:
+      return header + 1;
+
+    case LUA_TSTRING:
+    {
+      size_t len;
+      const char* data = lua_tolstring(L, index, &len);
+      bson_t child;
+
+      if (bson_init_static(&child, (const uint8_t*)data, len) &&
+        bson_validate(&child, BSON_VALIDATE_UTF8 | BSON_VALIDATE_EMPTY_KEYS, NULL))
+      {
+        return header + (int64_t)len;
+      }
+      return header + string_size(data);
+    }
+
+    case LUA_TUSERDATA:
+      if (luaL_checkudata_ex(L, index, OID_METATABLE))
+      {
+        return header + 12;
+      }
+      else if (luaL_checkudata_ex(L, index, BINARY_METATABLE))
+      {
+        cbson_binary_t* bin = check_cbson_binary(L, index);
+        return header + 5 + bin->size + (bin->type == BSON_SUBTYPE_BINARY_DEPRECATED ? 4 : 0);
+      }
+      else if (luaL_checkudata_ex(L, index, SYMBOL_METATABLE))
+      {
+        return header + string_size(check_cbson_symbol(L, index)->symbol);
+      }
+      else if (luaL_checkudata_ex(L, index, CODE_METATABLE))
+      {
+        return header + string_size(check_cbson_code(L, index)->code);
+      }
+      else if (luaL_checkudata_ex(L, index, MINKEY_METATABLE) || luaL_checkudata_ex(L, index, MAXKEY_METATABLE) ||
+        luaL_checkudata_ex(L, index, UNDEFINED_METATABLE) || luaL_checkudata_ex(L, index, CBNULL_METATABLE))
+      {
+        return header;
+      }
+      else if (luaL_checkudata_ex(L, index, TIMESTAMP_METATABLE) || luaL_checkudata_ex(L, index, DATE_METATABLE))
+      {
+        return header + 8;
+      }
+      else if (luaL_checkudata_ex(L, index, INT64_METATABLE) || luaL_checkudata_ex(L, index, UINT64_METATABLE))
+      {
+        cbson_int64_t i = cbson_int64_check(L, index);
+        return header + ((i < INT32_MIN || i > INT32_MAX) ? 8 : 4);
+      }
+      else if (luaL_checkudata_ex(L, index, ARRAY_METATABLE))
+      {
+        return header + 5;
+      }
+      else if (luaL_checkudata_ex(L, index, DECIMAL_METATABLE))
+      {
+        return header + 16;
+      }
+      else if (luaL_checkudata_ex(L, index, PLACEHOLDER_METATABLE))
+      {
+        return luaL_error(L, "Placeholder can only be used in cbson.template");
+      }
+      else
+      {
+        bson_t tmp = BSON_INITIALIZER;
+        int64_t size;
+
+        switch_value(L, index, &tmp, level, key);
+        size = tmp.len - 5;
+        bson_destroy(&tmp);
+        return size;
+      }
+
+    default:
+      return 0;
+  }
+}
+
+static int64_t table_size(lua_State *L, int index, int use_keys, int level)
+{
+  int64_t size = 5;
+  int k = 0;
+
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
+
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    const char *key;
+    char ckey[16];
+
+    lua_pushvalue(L, -2);
+    if (!use_keys)
+    {
+      bson_uint32_to_string((uint32_t)k, &key, ckey, sizeof(ckey));
+    }
+    else if ((key = lua_tostring(L, -1)) == NULL)
+    {
+      luaL_error(L, "Invalid key type '%s'", luaL_typename(L, -3));
+    }
+
+    size += value_size(L, lua_gettop(L) - 1, level, key);
+    lua_pop(L, 2);
+    k++;
+  }
+
+  return size;
+}
+
+static int64_t ordered_table_size(lua_State *L, int index, int level)
+{
+  int64_t size = 5;
+
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
+
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    lua_pushnil(L);
+    if (lua_next(L, -2))
+    {
+      const char *key;
+
+      lua_pushvalue(L, -2);
+      key = lua_tostring(L, -1);
+      size += value_size(L, lua_gettop(L) - 1, level, key);
+      lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+  }
+
+  return size;
+}
+
+static int64_t flat_table_size(lua_State *L, int index, int level)
+{
+  int64_t size = 5;
+  const char* key;
+  int i;
+
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
+
+  for (i = 1; flat_key(L, index, i, &key); i += 2)
+  {
+    lua_rawgeti(L, index, i + 1);
+    size += value_size(L, lua_gettop(L), level, key);
+    lua_pop(L, 2);
+  }
+
+  return size;
+}
+
+// size of document encode() produces from table at index
+static int64_t document_size(lua_State *L, int index)
+{
+  if (is_flat_ordered(L, index))
+  {
+    return flat_table_size(L, index, 0);
   }
 
-  const uint8_t* data=bson_get_data(&bson);
-  lua_pushlstring(L, (const char*)data, bson.len);
-  bson_destroy(&bson);
+  if (is_array(L, index) && is_ordered_map(L, index))
+  {
+    return ordered_table_size(L, index, 1);
+  }
+
+  return table_size(L, index, 1, 0);
+}
+
+int cbson_size(lua_State *L)
+{
+  CBSON_STATS_BEGIN();
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+
+  lua_pushinteger(L, (lua_Integer)document_size(L, 1));
+  CBSON_STATS_END(CBSON_STAT_SIZE, 0, 0);
   return 1;
 }
 
-int cbson_encode_first(lua_State *L)
+// Encoding with explicit stack of frames, see cbson-async.h. Tables are iterated with lua_next
+// from key saved in anchor table, so they must not be changed while job is running.
+static int table_kind(lua_State *L, int index)
+{
+  if (is_flat_ordered(L, index))
+  {
+    return CBSON_ENCODE_FLAT;
+  }
+
+  if (is_array(L, index))
+  {
+    return is_ordered_map(L, index) ? CBSON_ENCODE_ORDERED : CBSON_ENCODE_ARRAY;
+  }
+
+  return CBSON_ENCODE_MAP;
+}
+
+// bson_t is declared with BSON_ALIGNED_BEGIN(128), malloc doesn't guarantee that
+#define BSON_T_ALIGN 128
+
+static bson_t* job_frame_bson(cbson_encode_job_t* job, int level)
+{
+  if (!job->frames[level].mem)
+  {
+    uintptr_t mem = (uintptr_t)bson_malloc(sizeof(bson_t) + BSON_T_ALIGN - 1);
+
+    job->frames[level].mem = (void*)mem;
+    job->frames[level].bson = (bson_t*)((mem + BSON_T_ALIGN - 1) & ~(uintptr_t)(BSON_T_ALIGN - 1));
+  }
+
+  return job->frames[level].bson;
+}
+
+void cbson_encode_job_init(lua_State* L, cbson_encode_job_t* job, int index)
+{
+  // top level arrays are encoded with keys, like encode_table does
+  job->frames[0].kind = table_kind(L, index);
+  if (job->frames[0].kind == CBSON_ENCODE_ARRAY)
+  {
+    job->frames[0].kind = CBSON_ENCODE_MAP;
+  }
+  job->frames[0].count = 0;
+  bson_init(job_frame_bson(job, 0));
+
+  lua_createtable(L, 2, 0);
+  lua_pushvalue(L, index);
+  lua_rawseti(L, -2, 1);
+  job->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  job->level = 0;
+  job->done = false;
+}
+
+void cbson_encode_job_destroy(cbson_encode_job_t* job)
+{
+  int i;
+
+  // open children share buffer of top level bson, only it needs bson_destroy
+  if (job->frames[0].mem && job->level >= 0)
+  {
+    bson_destroy(job->frames[0].bson);
+    job->level = -1;
+  }
+
+  for (i = 0; i <= BSON_MAX_RECURSION; i++)
+  {
+    bson_free(job->frames[i].mem);
+    job->frames[i].mem = NULL;
+    job->frames[i].bson = NULL;
+  }
+}
+
+bool cbson_encode_job_run(lua_State* L, cbson_encode_job_t* job, int budget)
+{
+  int anchor;
+
+  luaL_checkstack(L, LUA_MINSTACK, "no stack for encode job");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, job->ref);
+  anchor = lua_gettop(L);
+
+  while (budget > 0)
+  {
+    cbson_encode_frame_t* frame = &job->frames[job->level];
+    const char *key;
+    char ckey[512];
+
+    bool has_next;
+
+    lua_rawgeti(L, anchor, 2 * job->level + 1);
+
+    if (frame->kind == CBSON_ENCODE_FLAT)
+    {
+      // pairs are taken by position, nothing has to be saved
+      has_next = flat_key(L, lua_gettop(L), 2 * frame->count + 1, &key);
+      if (has_next)
+      {
+        lua_rawgeti(L, -2, 2 * frame->count + 2);
+      }
+    }
+    else
+    {
+      lua_rawgeti(L, anchor, 2 * job->level + 2);
+      has_next = lua_next(L, -2);
+    }
+
+    if (!has_next)
+    {
+      lua_pop(L, 1);
+
+      if (job->level == 0)
+      {
+        bson_t* bson = frame->bson;
+
+        lua_pushlstring(L, (const char*)bson_get_data(bson), bson->len);
+        lua_remove(L, anchor);
+        bson_destroy(bson);
+        job->level = -1;
+        job->done = true;
+        CBSON_STATS_DOCUMENTS(1);
+        return true;
+      }
+
+      if (frame->kind == CBSON_ENCODE_ARRAY)
+      {
+        bson_append_array_end(job->frames[job->level - 1].bson, frame->bson);
+      }
+      else
+      {
+        bson_append_document_end(job->frames[job->level - 1].bson, frame->bson);
+      }
+
+      lua_pushnil(L);
+      lua_rawseti(L, anchor, 2 * job->level + 1);
+      lua_pushnil(L);
+      lua_rawseti(L, anchor, 2 * job->level + 2);
+      job->level--;
+      continue;
+    }
+
+    // stack: -1 => value; -2 => key; -3 => table
+    budget--;
+    if (frame->kind != CBSON_ENCODE_FLAT)
+    {
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, anchor, 2 * job->level + 2);
+    }
+
+    if (frame->kind == CBSON_ENCODE_ORDERED)
+    {
+      // value is {key = value} pair
+      lua_pushnil(L);
+      if (!lua_next(L, -2))
+      {
+        lua_pop(L, 3);
+        continue;
+      }
+      lua_remove(L, -3);
+      lua_remove(L, -3);
+    }
+
+    // stack: -1 => value; -2 => key
+    if (frame->kind == CBSON_ENCODE_ARRAY)
+    {
+      snprintf(ckey, 512, "%d", frame->count);
+      key = ckey;
+    }
+    else
+    {
+      // lua_next key is already saved, so it can be converted in place
+      key = lua_tostring(L, -2);
+    }
+    frame->count++;
+
+    if (lua_type(L, -1) == LUA_TTABLE)
+    {
+      int kind = table_kind(L, -1);
+      bson_t* child;
+
+      if (job->level >= BSON_MAX_RECURSION)
+      {
+        luaL_error(L, "table is too deep");
+      }
+
+      child = job_frame_bson(job, job->level + 1);
+      if (kind == CBSON_ENCODE_ARRAY)
+      {
+        BSON_APPEND_ARRAY_BEGIN(frame->bson, key, child);
+      }
+      else
+      {
+        BSON_APPEND_DOCUMENT_BEGIN(frame->bson, key, child);
+      }
+
+      job->level++;
+      job->frames[job->level].kind = kind;
+      job->frames[job->level].count = 0;
+      CBSON_STATS_DEPTH(job->level);
+
+      lua_rawseti(L, anchor, 2 * job->level + 1);
+      lua_pop(L, 2);
+      continue;
+    }
+
+    switch_value(L, -1, frame->bson, job->level, key);
+    lua_pop(L, 3);
+  }
+
+  lua_pop(L, 1);
+  return false;
+}
+
+// context passed by encode_run on top of the stack, it stays there until f returns
+cbson_encode_ctx_t* cbson_encode_ctx(lua_State *L)
+{
+  return (cbson_encode_ctx_t*)lua_touserdata(L, -1);
+}
+
+// largest buffer kept by spare context between calls
+#ifndef CBSON_ENCODE_RETAIN
+#define CBSON_ENCODE_RETAIN (64 * 1024)
+#endif
+
+// Context of direct call with its buffer, spare one is kept in registry between calls
+typedef struct {
+  cbson_encode_ctx_t ctx;
+  bool busy;          // taken by a call, which either runs or raised
+} cbson_encode_buffer_t;
+
+// registry key of spare buffer
+static char encode_buffer_key;
+
+static int encode_buffer_gc(lua_State *L)
+{
+  cbson_encode_buffer_t* buf = (cbson_encode_buffer_t*)lua_touserdata(L, 1);
+
+  if (buf->ctx.out != buf->ctx.bson)
+  {
+    bson_destroy(buf->ctx.out);
+  }
+  bson_destroy(buf->ctx.bson);
+  return 0;
+}
+
+// Pushes userdata of spare buffer and takes it. Busy one belongs to running call (nested one comes from
+// __gc or metamethod) or to call which raised, so new spare replaces it and it's left to __gc. Lua doesn't
+// see memory of left buffer, so collector is advanced by its size.
+static cbson_encode_buffer_t* encode_buffer(lua_State *L)
+{
+  cbson_encode_buffer_t* buf;
+  uintptr_t mem;
+
+  lua_pushlightuserdata(L, &encode_buffer_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  buf = (cbson_encode_buffer_t*)lua_touserdata(L, -1);
+
+  if (buf && !buf->busy)
+  {
+    buf->busy = true;
+    return buf;
+  }
+  lua_pop(L, 1);
+
+  if (buf)
+  {
+    lua_gc(L, LUA_GCSTEP, (int)((buf->ctx.bson->len + buf->ctx.out->len) >> 10) + 1);
+  }
+
+  buf = lua_newuserdata(L, sizeof(cbson_encode_buffer_t) + sizeof(bson_t) + BSON_T_ALIGN - 1);
+  mem = (uintptr_t)(buf + 1);
+  buf->ctx.bson = (bson_t*)((mem + BSON_T_ALIGN - 1) & ~(uintptr_t)(BSON_T_ALIGN - 1));
+  buf->ctx.out = buf->ctx.bson;
+  buf->busy = true;
+  bson_init(buf->ctx.bson);
+
+  if (luaL_newmetatable(L, ENCODE_BUFFER_METATABLE))
+  {
+    lua_pushcfunction(L, encode_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+
+  lua_pushlightuserdata(L, &encode_buffer_key);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  return buf;
+}
+
+// Calls f with nargs arguments on top of the stack and context above them, f encodes into context buffer
+// and pushes single result, which replaces arguments. Arena scope needs protected call, otherwise f is
+// called directly and buffer left by error is destroyed by __gc of its userdata.
+static void encode_run(lua_State *L, lua_CFunction f, int nargs, bool placeholders)
+{
+  int base = lua_gettop(L) - nargs;
+  cbson_encode_buffer_t* buf;
+
+  if (cbson_alloc_mode == CBSON_ALLOC_ARENA)
+  {
+    cbson_encode_ctx_t local;
+    cbson_arena_scope_t scope;
+    bson_t bson;
+    int status;
+
+    bson_init(&bson);
+    local.bson = local.out = &bson;
+    local.placeholders = placeholders;
+
+    cbson_arena_enter(&scope, true);
+    lua_pushlightuserdata(L, &local);
+    status = cbson_pcall(L, f, nargs + 1, 1);
+    bson_destroy(local.out);
+    cbson_arena_leave(&scope);
+
+    if (status != 0)
+    {
+      lua_error(L);
+    }
+    return;
+  }
+
+  buf = encode_buffer(L);
+  buf->ctx.placeholders = placeholders;
+  f(L);
+
+  // buffer is kept for the next call, unless it grew too large
+  if (buf->ctx.out != buf->ctx.bson)
+  {
+    bson_destroy(buf->ctx.out);
+    buf->ctx.out = buf->ctx.bson;
+  }
+  if (buf->ctx.bson->len > CBSON_ENCODE_RETAIN)
+  {
+    bson_destroy(buf->ctx.bson);
+    bson_init(buf->ctx.bson);
+  }
+  else
+  {
+    bson_reinit(buf->ctx.bson);
+  }
+  buf->busy = false;
+
+  lua_replace(L, base + 1);
+  lua_settop(L, base + 1);
+}
+
+int cbson_encode_protected(lua_State *L, lua_CFunction f)
+{
+  encode_run(L, f, lua_gettop(L), false);
+  return 1;
+}
+
+static int encode_document_call(lua_State *L)
+{
+  cbson_encode_ctx_t* ctx = cbson_encode_ctx(L);
+  cbson_encode_state_t state = {true, NULL};
+
+  encode_table(L, lua_gettop(L) - 1, ctx->out, ctx->placeholders ? &state : &default_state);
+  lua_pushlstring(L, (const char*)bson_get_data(ctx->out), ctx->out->len);
+  return 1;
+}
+
+static void check_document(lua_State *L, int index, bson_t* bson, bool placeholders)
+{
+  size_t len;
+  const uint8_t* data;
+
+  if (index < 0)
+  {
+    index = lua_gettop(L) + index + 1;
+  }
+
+  if (lua_type(L, index) != LUA_TSTRING)
+  {
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_pushvalue(L, index);
+    encode_run(L, encode_document_call, 1, placeholders);
+    lua_replace(L, index);
+  }
+
+  data = (const uint8_t*)lua_tolstring(L, index, &len);
+  if (!bson_init_static(bson, data, len))
+  {
+    luaL_error(L, "Can't init bson from data.");
+  }
+}
+
+// binary BSON argument, used in place
+void cbson_check_bson(lua_State *L, int index, bson_t* bson)
+{
+  size_t len;
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, index, &len);
+
+  if (!bson_init_static(bson, data, len))
+  {
+    luaL_error(L, "Can't init bson from data.");
+  }
+}
+
+// BSON strings are used in place, tables are encoded and replaced by encoded string. Caller destroys bson.
+void cbson_check_document(lua_State *L, int index, bson_t* bson)
+{
+  check_document(L, index, bson, false);
+}
+
+void cbson_check_template(lua_State *L, int index, bson_t* bson)
+{
+  check_document(L, index, bson, true);
+}
+
+static int encode_call(lua_State *L)
+{
+  cbson_encode_ctx_t* ctx = cbson_encode_ctx(L);
+  bson_t* out = ctx->out;
+  bool presize = false;
+  CBSON_STATS_BEGIN();
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  if (!lua_isnil(L, 2))
+  {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "presize");
+    presize = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  // size pass, so buffer is allocated once
+  if (presize)
+  {
+    int64_t size = document_size(L, 1);
+
+    if (size <= INT32_MAX)
+    {
+      out = ctx->out = bson_sized_new((size_t)size);
+    }
+  }
+
+  encode_table(L, 1, out, &default_state);
+
+  const uint8_t* data=bson_get_data(out);
+  lua_pushlstring(L, (const char*)data, out->len);
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_ENCODE, 0, out->len);
+  return 1;
+}
+
+int cbson_encode(lua_State *L)
+{
+  lua_settop(L, 2);
+  return cbson_encode_protected(L, encode_call);
+}
+
+static int encode_first_call(lua_State *L)
 {
-  bson_t bson = BSON_INITIALIZER;
+  cbson_encode_ctx_t* ctx = cbson_encode_ctx(L);
+  bson_t* bson = ctx->out;
+  CBSON_STATS_BEGIN();
 
   const char* key = luaL_checkstring(L,1);
 
   luaL_checktype(L, 2, LUA_TTABLE);
 
-  iterate_table(L, 2,  &bson, 1, 0, key);
+  iterate_table(L, 2, bson, 1, 0, key, &default_state);
 
-  const uint8_t* data=bson_get_data(&bson);
-  lua_pushlstring(L, (const char*)data, bson.len);
-  bson_destroy(&bson);
+  const uint8_t* data=bson_get_data(bson);
+  lua_pushlstring(L, (const char*)data, bson->len);
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_ENCODE_FIRST, 0, bson->len);
   return 1;
 }
 
-int cbson_from_json(lua_State *L)
+int cbson_encode_first(lua_State *L)
+{
+  lua_settop(L, 2);
+  return cbson_encode_protected(L, encode_first_call);
+}
+
+// Open addressing set of keys already written by encode_ordered, key strings are anchored by key list
+typedef struct {
+  uint32_t hash;
+  uint32_t len;
+  const char* str;
+} cbson_keyset_slot_t;
+
+#define KEYSET_LOCAL_SLOTS 64
+
+typedef struct {
+  cbson_keyset_slot_t* slots;
+  uint32_t mask;
+  cbson_keyset_slot_t local[KEYSET_LOCAL_SLOTS];
+} cbson_keyset_t;
+
+// pushes userdata holding slots of large set (nil for small one), so they are collected when encoding raises
+static void keyset_init(lua_State *L, cbson_keyset_t* set, size_t count)
+{
+  size_t size = 8;
+
+  while (size < count * 2)
+  {
+    size *= 2;
+  }
+
+  if (size <= KEYSET_LOCAL_SLOTS)
+  {
+    set->slots = set->local;
+    lua_pushnil(L);
+  }
+  else
+  {
+    set->slots = lua_newuserdata(L, size * sizeof(cbson_keyset_slot_t));
+  }
+  set->mask = (uint32_t)size - 1;
+  memset(set->slots, 0, size * sizeof(cbson_keyset_slot_t));
+}
+
+// returns slot of key, empty one if key is not in set
+static cbson_keyset_slot_t* keyset_find(cbson_keyset_t* set, const char* str, size_t len)
+{
+  uint32_t hash = cbson_intern_hash(str, len);
+  uint32_t i = hash & set->mask;
+
+  while (set->slots[i].str)
+  {
+    cbson_keyset_slot_t* slot = &set->slots[i];
+
+    if (slot->hash == hash && slot->len == len && memcmp(slot->str, str, len) == 0)
+    {
+      return slot;
+    }
+    i = (i + 1) & set->mask;
+  }
+
+  set->slots[i].hash = hash;
+  return &set->slots[i];
+}
+
+// Writes keys of list at index `keys` first, in list order, then the rest of table. Missing keys are skipped.
+// Key list may hold nested key list under key name, it's used for subdocument stored under that key and
+// can't be given for arrays and ordered tables.
+static void iterate_table_keys(lua_State *L, int index, int keys, bson_t* bson, int level)
+{
+  cbson_keyset_t set;
+  int count = (int)cbson_objlen(L, keys);
+  int i;
+
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
+  keyset_init(L, &set, count);
+
+  for (i = 1; i <= count; i++)
+  {
+    cbson_keyset_slot_t* slot;
+    size_t len;
+    const char* key;
+
+    lua_rawgeti(L, keys, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+      luaL_error(L, "Invalid key %d in key list, expected string", i);
+    }
+    key = lua_tolstring(L, -1, &len);
+
+    slot = keyset_find(&set, key, len);
+    if (slot->str)
+    {
+      // listed twice
+      lua_pop(L, 1);
+      continue;
+    }
+    slot->str = key;
+    slot->len = (uint32_t)len;
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, index);
+    if (!lua_isnil(L, -1))
+    {
+      // nested key list for plain subdocument
+      lua_pushvalue(L, -2);
+      lua_rawget(L, keys);
+      if (lua_type(L, -1) == LUA_TTABLE && lua_type(L, -2) == LUA_TTABLE)
+      {
+        bson_t child;
+
+        if (is_flat_ordered(L, -2) || is_array(L, -2))
+        {
+          luaL_error(L, "Key list for '%s' given, but its value is array or ordered table", key);
+        }
+
+        if (level >= BSON_MAX_RECURSION)
+        {
+          luaL_error(L, "table is too deep");
+        }
+
+        CBSON_STATS_DEPTH(level + 1);
+        BSON_APPEND_DOCUMENT_BEGIN(bson, key, &child);
+        iterate_table_keys(L, lua_gettop(L) - 1, lua_gettop(L), &child, level + 1);
+        bson_append_document_end(bson, &child);
+      }
+      else
+      {
+        switch_value(L, -2, bson, level, key);
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    size_t len;
+    const char* key;
+
+    lua_pushvalue(L, -2);
+    key = lua_tolstring(L, -1, &len);
+    if (key && !keyset_find(&set, key, len)->str)
+    {
+      switch_value(L, -2, bson, level, key);
+    }
+    lua_pop(L, 2);
+  }
+
+  lua_pop(L, 1);
+}
+
+// cbson.encode_ordered(key_list, data) - listed keys go first, in list order
+static int encode_ordered_call(lua_State *L)
+{
+  cbson_encode_ctx_t* ctx = cbson_encode_ctx(L);
+  bson_t* bson = ctx->out;
+  CBSON_STATS_BEGIN();
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  iterate_table_keys(L, 2, 1, bson, 0);
+
+  lua_pushlstring(L, (const char*)bson_get_data(bson), bson->len);
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_ENCODE_ORDERED, 0, bson->len);
+  return 1;
+}
+
+int cbson_encode_ordered(lua_State *L)
+{
+  lua_settop(L, 2);
+  return cbson_encode_protected(L, encode_ordered_call);
+}
+
+static int from_json_call(lua_State *L)
 {
   bson_t *bson;
   size_t len;
   bson_error_t error;
+  CBSON_STATS_BEGIN();
 
   const uint8_t* data = (uint8_t*)luaL_checklstring(L, 1, &len);
 
@@ -433,6 +1485,8 @@ int cbson_from_json(lua_State *L)
   {
     data = bson_get_data(bson);
     lua_pushlstring(L, (const char*)data, bson->len);
+    CBSON_STATS_DOCUMENTS(1);
+    CBSON_STATS_END(CBSON_STAT_FROM_JSON, len, bson->len);
     bson_destroy(bson);
   }
   else
@@ -441,3 +1495,8 @@ int cbson_from_json(lua_State *L)
   }
   return 1;
 }
+
+int cbson_from_json(lua_State *L)
+{
+  return cbson_arena_call(L, from_json_call);
+}
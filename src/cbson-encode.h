@@ -2,9 +2,36 @@
 #define __CBSON_ENCODE_H__
 
 #include <lua.h>
+#include <bson.h>
 
 int cbson_encode(lua_State *L);
 int cbson_encode_first(lua_State *L);
+int cbson_encode_ordered(lua_State *L);
+int cbson_size(lua_State *L);
 int cbson_from_json(lua_State *L);
 
+// binary BSON argument at index, bson points into the string
+void cbson_check_bson(lua_State *L, int index, bson_t* bson);
+void cbson_check_document(lua_State *L, int index, bson_t* bson);
+// same, placeholders in table are written
+void cbson_check_template(lua_State *L, int index, bson_t* bson);
+
+#define ENCODE_BUFFER_METATABLE "bson-encode-buffer metatable"
+
+// Encoding may raise in the middle (cycle, too deep table, bad key list), so the output buffer is owned
+// by caller: it's destroyed after the call and by __gc of holding userdata if the call raises.
+typedef struct {
+  bson_t* bson;       // own buffer, aligned as bson_t requires
+  bson_t* out;        // bson or presized buffer
+  bool placeholders;
+} cbson_encode_ctx_t;
+
+// calls f with arguments of current call and context on top of them, f encodes into context buffer and
+// pushes single result
+int cbson_encode_protected(lua_State *L, lua_CFunction f);
+cbson_encode_ctx_t* cbson_encode_ctx(lua_State *L);
+
+// appends value at index under key, type is discovered at runtime
+void switch_value(lua_State *L, int index, bson_t* bson, int level, const char* key);
+
 #endif
@@ -0,0 +1,160 @@
+#include <bson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "cbson-ffi.h"
+
+// finds element by dotted path, value data points into input buffer
+bool cbson_ffi_find(const uint8_t* data, size_t len, const char* path, cbson_ffi_value_t* value)
+{
+  bson_t bson;
+  bson_iter_t iter, found;
+  bson_subtype_t subtype;
+  uint32_t timestamp, increment;
+
+  memset(value, 0, sizeof(*value));
+
+  if (!bson_init_static(&bson, data, len) || !bson_iter_init(&iter, &bson) ||
+      !bson_iter_find_descendant(&iter, path, &found))
+  {
+    return false;
+  }
+
+  value->type = bson_iter_type(&found);
+
+  switch (bson_iter_type(&found))
+  {
+    case BSON_TYPE_DOUBLE:
+      value->number = bson_iter_double(&found);
+      break;
+    case BSON_TYPE_INT32:
+      value->integer = bson_iter_int32(&found);
+      break;
+    case BSON_TYPE_INT64:
+      value->integer = bson_iter_int64(&found);
+      break;
+    case BSON_TYPE_DATE_TIME:
+      value->integer = bson_iter_date_time(&found);
+      break;
+    case BSON_TYPE_BOOL:
+      value->integer = bson_iter_bool(&found);
+      break;
+    case BSON_TYPE_UTF8:
+      value->data = (const uint8_t*)bson_iter_utf8(&found, &value->len);
+      break;
+    case BSON_TYPE_SYMBOL:
+      value->data = (const uint8_t*)bson_iter_symbol(&found, &value->len);
+      break;
+    case BSON_TYPE_CODE:
+      value->data = (const uint8_t*)bson_iter_code(&found, &value->len);
+      break;
+    case BSON_TYPE_DOCUMENT:
+      bson_iter_document(&found, &value->len, &value->data);
+      break;
+    case BSON_TYPE_ARRAY:
+      bson_iter_array(&found, &value->len, &value->data);
+      break;
+    case BSON_TYPE_BINARY:
+      bson_iter_binary(&found, &subtype, &value->len, &value->data);
+      value->integer = subtype;
+      break;
+    case BSON_TYPE_OID:
+      value->data = bson_iter_oid(&found)->bytes;
+      value->len = 12;
+      break;
+    case BSON_TYPE_TIMESTAMP:
+      bson_iter_timestamp(&found, &timestamp, &increment);
+      value->integer = (int64_t)(((uint64_t)timestamp << 32) | increment);
+      break;
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_MINKEY:
+    case BSON_TYPE_MAXKEY:
+      break;
+    default:
+    {
+      // regex, dbpointer, decimal128, code with scope: raw value bytes, key and type excluded
+      const uint8_t* raw = (const uint8_t*)bson_iter_key(&found) + strlen(bson_iter_key(&found)) + 1;
+      value->data = raw;
+      value->len = (uint32_t)(found.raw + found.next_off - raw);
+      break;
+    }
+  }
+
+  return true;
+}
+
+// size of document starting at offset of concatenated BSON stream (mongodump file),
+// 0 at the end of stream, -1 if document is truncated or malformed
+int64_t cbson_ffi_next_document(const uint8_t* data, size_t len, size_t offset)
+{
+  uint32_t size;
+
+  if (offset >= len)
+  {
+    return 0;
+  }
+
+  if (len - offset < 5)
+  {
+    return -1;
+  }
+
+  memcpy(&size, data + offset, sizeof(size));
+  size = BSON_UINT32_FROM_LE(size);
+
+  if (size < 5 || size > len - offset || data[offset + size - 1] != 0)
+  {
+    return -1;
+  }
+
+  return size;
+}
+
+bool cbson_ffi_oid_from_string(const char* str, size_t len, cbson_ffi_oid_t* oid)
+{
+  bson_oid_t boid;
+
+  if (len != 24 || !bson_oid_is_valid(str, len))
+  {
+    return false;
+  }
+
+  bson_oid_init_from_string(&boid, str);
+  memcpy(oid->bytes, boid.bytes, sizeof(oid->bytes));
+  return true;
+}
+
+// str must have room for 25 chars
+void cbson_ffi_oid_to_string(const cbson_ffi_oid_t* oid, char* str)
+{
+  bson_oid_t boid;
+
+  memcpy(boid.bytes, oid->bytes, sizeof(boid.bytes));
+  bson_oid_to_string(&boid, str);
+}
+
+uint32_t cbson_ffi_oid_timestamp(const cbson_ffi_oid_t* oid)
+{
+  return ((uint32_t)oid->bytes[0] << 24) | ((uint32_t)oid->bytes[1] << 16) |
+         ((uint32_t)oid->bytes[2] << 8) | (uint32_t)oid->bytes[3];
+}
+
+// false if str isn't whole decimal integer or doesn't fit in int64
+bool cbson_ffi_int64_from_string(const char* str, int64_t* value)
+{
+  char* end;
+
+  errno = 0;
+  *value = strtoll(str, &end, 10);
+  return end != str && *end == '\0' && errno != ERANGE;
+}
+
+// str must have room for 21 chars, returns length
+int cbson_ffi_int64_to_string(int64_t value, char* str)
+{
+  return snprintf(str, 21, "%" PRId64, value);
+}
@@ -0,0 +1,33 @@
+#ifndef __CBSON_FFI_H__
+#define __CBSON_FFI_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Plain C functions for LuaJIT FFI (see lua/cbson/ffi.lua), they don't touch lua_State.
+// Declarations are mirrored in ffi.cdef, keep both in sync.
+
+typedef struct {
+  uint8_t bytes[12];
+} cbson_ffi_oid_t;
+
+typedef struct {
+  int32_t type;         // bson_type_t of element
+  uint32_t len;         // length of data
+  const uint8_t* data;  // string, binary, oid, document/array or raw value bytes, points into input buffer
+  int64_t integer;      // int32, int64, date, bool, binary subtype or timestamp << 32 | increment
+  double number;        // double
+} cbson_ffi_value_t;
+
+bool cbson_ffi_find(const uint8_t* data, size_t len, const char* path, cbson_ffi_value_t* value);
+int64_t cbson_ffi_next_document(const uint8_t* data, size_t len, size_t offset);
+
+bool cbson_ffi_oid_from_string(const char* str, size_t len, cbson_ffi_oid_t* oid);
+void cbson_ffi_oid_to_string(const cbson_ffi_oid_t* oid, char* str);
+uint32_t cbson_ffi_oid_timestamp(const cbson_ffi_oid_t* oid);
+
+bool cbson_ffi_int64_from_string(const char* str, int64_t* value);
+int cbson_ffi_int64_to_string(int64_t value, char* str);
+
+#endif
@@ -0,0 +1,756 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <regex.h>
+
+#include "cbson.h"
+#include "cbson-filter.h"
+#include "cbson-compare.h"
+#include "cbson-encode.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+
+// filter bytes are stored right after the struct, compiled nodes point into them
+#define FILTER_DATA(f) ((uint8_t*)((f) + 1))
+
+enum {
+  FILTER_AND,
+  FILTER_OR,
+  FILTER_NOR,
+  FILTER_NOT,
+  FILTER_EQ,
+  FILTER_GT,
+  FILTER_GTE,
+  FILTER_LT,
+  FILTER_LTE,
+  FILTER_IN,
+  FILTER_EXISTS,
+  FILTER_REGEX
+};
+
+DEFINE_CHECK(FILTER, filter)
+
+static int filter_node_add(lua_State *L, cbson_filter_t* f, int op, const char* path)
+{
+  cbson_filter_node_t* node;
+
+  if (f->count == f->size)
+  {
+    int size = f->size ? f->size * 2 : 16;
+    cbson_filter_node_t* nodes = realloc(f->nodes, size * sizeof(cbson_filter_node_t));
+
+    if (!nodes)
+    {
+      luaL_error(L, "Not enough memory to compile filter");
+    }
+
+    f->nodes = nodes;
+    f->size = size;
+  }
+
+  node = &f->nodes[f->count];
+  memset(node, 0, sizeof(cbson_filter_node_t));
+  node->op = op;
+  node->path = path;
+  node->child = -1;
+  node->next = -1;
+
+  return f->count++;
+}
+
+static void filter_node_append(cbson_filter_t* f, int parent, int child)
+{
+  int* link = &f->nodes[parent].child;
+
+  while (*link >= 0)
+  {
+    link = &f->nodes[*link].next;
+  }
+
+  *link = child;
+}
+
+static int filter_node_not(lua_State *L, cbson_filter_t* f, int child)
+{
+  int node = filter_node_add(L, f, FILTER_NOT, NULL);
+
+  filter_node_append(f, node, child);
+  return node;
+}
+
+// pushes pattern with every '.' outside of bracket expressions replaced
+static void filter_regex_dots(lua_State *L, const char* pattern, const char* dot)
+{
+  luaL_Buffer b;
+  const char* p = pattern;
+
+  luaL_buffinit(L, &b);
+  while (*p)
+  {
+    if (*p == '.')
+    {
+      luaL_addstring(&b, dot);
+      p++;
+    }
+    else if (*p == '\\' && p[1])
+    {
+      luaL_addlstring(&b, p, 2);
+      p += 2;
+    }
+    else if (*p == '[')
+    {
+      const char* end = p + 1;
+
+      if (*end == '^')
+      {
+        end++;
+      }
+      if (*end == ']')
+      {
+        end++;
+      }
+      while (*end && *end != ']')
+      {
+        // [:class:], [=equiv=] and [.coll.] may contain ']'
+        if (*end == '[' && (end[1] == ':' || end[1] == '=' || end[1] == '.'))
+        {
+          const char* close = end + 2;
+
+          while (*close && !(close[0] == end[1] && close[1] == ']'))
+          {
+            close++;
+          }
+          end = *close ? close + 2 : close;
+        }
+        else
+        {
+          end++;
+        }
+      }
+      if (*end)
+      {
+        end++;
+      }
+      luaL_addlstring(&b, p, end - p);
+      p = end;
+    }
+    else
+    {
+      luaL_addchar(&b, *p);
+      p++;
+    }
+  }
+  luaL_pushresult(&b);
+}
+
+static int filter_compile_regex(lua_State *L, cbson_filter_t* f, const char* path, const bson_iter_t* iter, const char* options)
+{
+  const char* pattern;
+  const char* regex_options = NULL;
+  int cflags = REG_EXTENDED | REG_NOSUB;
+  bool dotall = false;
+  int node, res;
+  regex_t* regex;
+
+  if (bson_iter_type(iter) == BSON_TYPE_REGEX)
+  {
+    pattern = bson_iter_regex(iter, &regex_options);
+  }
+  else if (BSON_ITER_HOLDS_UTF8(iter))
+  {
+    pattern = bson_iter_utf8(iter, NULL);
+  }
+  else
+  {
+    return luaL_error(L, "$regex has to be a string");
+  }
+
+  if (options == NULL)
+  {
+    options = regex_options ? regex_options : "";
+  }
+
+  for (; *options; options++)
+  {
+    switch (*options)
+    {
+      case 'i':
+        cflags |= REG_ICASE;
+        break;
+      case 'm':
+        cflags |= REG_NEWLINE;
+        break;
+      case 's':
+        dotall = true;
+        break;
+      default:
+        return luaL_error(L, "Unsupported regex option '%c'", *options);
+    }
+  }
+
+  node = filter_node_add(L, f, FILTER_REGEX, path);
+
+  // REG_NEWLINE ties '.' to 'm', while in mongodb '.' matches newline only with 's'
+  if (dotall == !!(cflags & REG_NEWLINE))
+  {
+    filter_regex_dots(L, pattern, dotall ? "(.|\n)" : "[^\n]");
+  }
+  else
+  {
+    lua_pushstring(L, pattern);
+  }
+
+  regex = malloc(sizeof(regex_t));
+  if (!regex)
+  {
+    return luaL_error(L, "Not enough memory to compile filter");
+  }
+
+  res = regcomp(regex, lua_tostring(L, -1), cflags);
+  lua_pop(L, 1);
+  if (res != 0)
+  {
+    char error[128];
+
+    regerror(res, regex, error, sizeof(error));
+    free(regex);
+    return luaL_error(L, "Invalid regex '%s': %s", pattern, error);
+  }
+
+  f->nodes[node].regex = regex;
+
+  return node;
+}
+
+static int filter_compile_in(lua_State *L, cbson_filter_t* f, const char* path, const bson_iter_t* iter)
+{
+  bson_iter_t elements;
+  int node, in;
+
+  if (!BSON_ITER_HOLDS_ARRAY(iter) || !bson_iter_recurse(iter, &elements))
+  {
+    return luaL_error(L, "'%s' expects an array", bson_iter_key(iter));
+  }
+
+  // regexes inside $in are matched as patterns, everything else by value
+  node = filter_node_add(L, f, FILTER_OR, NULL);
+  in = filter_node_add(L, f, FILTER_IN, path);
+  f->nodes[in].operand = *iter;
+  filter_node_append(f, node, in);
+
+  while (bson_iter_next(&elements))
+  {
+    if (bson_iter_type(&elements) == BSON_TYPE_REGEX)
+    {
+      filter_node_append(f, node, filter_compile_regex(L, f, path, &elements, NULL));
+    }
+  }
+
+  return node;
+}
+
+static int filter_compile_expression(lua_State *L, cbson_filter_t* f, const char* path, bson_iter_t* ops, int depth)
+{
+  int node = filter_node_add(L, f, FILTER_AND, NULL);
+  const char* options = NULL;
+  bson_iter_t opt = *ops;
+
+  if (depth >= BSON_MAX_RECURSION)
+  {
+    return luaL_error(L, "Filter is too deep");
+  }
+
+  if (bson_iter_find(&opt, "$options") && BSON_ITER_HOLDS_UTF8(&opt))
+  {
+    options = bson_iter_utf8(&opt, NULL);
+  }
+
+  while (bson_iter_next(ops))
+  {
+    const char* op = bson_iter_key(ops);
+    int child;
+
+    if (strcmp(op, "$eq") == 0 || strcmp(op, "$ne") == 0)
+    {
+      child = filter_node_add(L, f, FILTER_EQ, path);
+      f->nodes[child].operand = *ops;
+      if (op[1] == 'n')
+      {
+        child = filter_node_not(L, f, child);
+      }
+    }
+    else if (strcmp(op, "$gt") == 0 || strcmp(op, "$gte") == 0 || strcmp(op, "$lt") == 0 || strcmp(op, "$lte") == 0)
+    {
+      int type = op[1] == 'g' ? (op[3] ? FILTER_GTE : FILTER_GT) : (op[3] ? FILTER_LTE : FILTER_LT);
+
+      child = filter_node_add(L, f, type, path);
+      f->nodes[child].operand = *ops;
+    }
+    else if (strcmp(op, "$in") == 0 || strcmp(op, "$nin") == 0)
+    {
+      child = filter_compile_in(L, f, path, ops);
+      if (op[1] == 'n')
+      {
+        child = filter_node_not(L, f, child);
+      }
+    }
+    else if (strcmp(op, "$exists") == 0)
+    {
+      child = filter_node_add(L, f, FILTER_EXISTS, path);
+      if (!bson_iter_as_bool(ops))
+      {
+        child = filter_node_not(L, f, child);
+      }
+    }
+    else if (strcmp(op, "$regex") == 0)
+    {
+      child = filter_compile_regex(L, f, path, ops, options);
+    }
+    else if (strcmp(op, "$options") == 0)
+    {
+      continue;
+    }
+    else if (strcmp(op, "$not") == 0)
+    {
+      if (BSON_ITER_HOLDS_DOCUMENT(ops))
+      {
+        bson_iter_t sub;
+
+        bson_iter_recurse(ops, &sub);
+        child = filter_compile_expression(L, f, path, &sub, depth + 1);
+      }
+      else if (bson_iter_type(ops) == BSON_TYPE_REGEX)
+      {
+        child = filter_compile_regex(L, f, path, ops, NULL);
+      }
+      else
+      {
+        return luaL_error(L, "$not needs a regex or a document");
+      }
+      child = filter_node_not(L, f, child);
+    }
+    else
+    {
+      return luaL_error(L, "Unsupported filter operator '%s'", op);
+    }
+
+    filter_node_append(f, node, child);
+  }
+
+  return node;
+}
+
+static bool filter_is_expression(const bson_iter_t* iter)
+{
+  bson_iter_t sub;
+
+  return BSON_ITER_HOLDS_DOCUMENT(iter) && bson_iter_recurse(iter, &sub) && bson_iter_next(&sub) && bson_iter_key(&sub)[0] == '$';
+}
+
+static int filter_compile_document(lua_State *L, cbson_filter_t* f, bson_iter_t* iter, int depth)
+{
+  int node = filter_node_add(L, f, FILTER_AND, NULL);
+
+  if (depth >= BSON_MAX_RECURSION)
+  {
+    return luaL_error(L, "Filter is too deep");
+  }
+
+  while (bson_iter_next(iter))
+  {
+    const char* key = bson_iter_key(iter);
+    int child;
+
+    if (key[0] == '$')
+    {
+      bson_iter_t list, sub;
+      int op;
+
+      if (strcmp(key, "$and") == 0)
+      {
+        op = FILTER_AND;
+      }
+      else if (strcmp(key, "$or") == 0)
+      {
+        op = FILTER_OR;
+      }
+      else if (strcmp(key, "$nor") == 0)
+      {
+        op = FILTER_NOR;
+      }
+      else
+      {
+        return luaL_error(L, "Unsupported filter operator '%s'", key);
+      }
+
+      if (!BSON_ITER_HOLDS_ARRAY(iter) || !bson_iter_recurse(iter, &list))
+      {
+        return luaL_error(L, "'%s' expects an array", key);
+      }
+
+      child = filter_node_add(L, f, op, NULL);
+      while (bson_iter_next(&list))
+      {
+        if (!BSON_ITER_HOLDS_DOCUMENT(&list) || !bson_iter_recurse(&list, &sub))
+        {
+          return luaL_error(L, "'%s' expects an array of documents", key);
+        }
+        filter_node_append(f, child, filter_compile_document(L, f, &sub, depth + 1));
+      }
+    }
+    else if (filter_is_expression(iter))
+    {
+      bson_iter_t ops;
+
+      bson_iter_recurse(iter, &ops);
+      child = filter_compile_expression(L, f, key, &ops, depth + 1);
+    }
+    else if (bson_iter_type(iter) == BSON_TYPE_REGEX)
+    {
+      child = filter_compile_regex(L, f, key, iter, NULL);
+    }
+    else
+    {
+      child = filter_node_add(L, f, FILTER_EQ, key);
+      f->nodes[child].operand = *iter;
+    }
+
+    filter_node_append(f, node, child);
+  }
+
+  return node;
+}
+
+static bool filter_equals(const bson_iter_t* value, const bson_iter_t* operand)
+{
+  bson_type_t type = bson_iter_type(operand);
+
+  // null matches missing fields and undefined
+  if (type == BSON_TYPE_NULL)
+  {
+    return value == NULL || bson_iter_type(value) == BSON_TYPE_NULL || bson_iter_type(value) == BSON_TYPE_UNDEFINED;
+  }
+
+  return value != NULL && cbson_compare_values(value, operand) == 0;
+}
+
+static bool filter_match_scalar(cbson_filter_node_t* node, const bson_iter_t* value)
+{
+  switch (node->op)
+  {
+    case FILTER_EQ:
+      return filter_equals(value, &node->operand);
+
+    case FILTER_GT:
+    case FILTER_GTE:
+    case FILTER_LT:
+    case FILTER_LTE:
+    {
+      int res;
+
+      // comparisons only match values of the same type bracket
+      if (value == NULL || cbson_canonical_type(bson_iter_type(value)) != cbson_canonical_type(bson_iter_type(&node->operand)))
+      {
+        return false;
+      }
+
+      res = cbson_compare_values(value, &node->operand);
+      switch (node->op)
+      {
+        case FILTER_GT:  return res > 0;
+        case FILTER_GTE: return res >= 0;
+        case FILTER_LT:  return res < 0;
+        default:         return res <= 0;
+      }
+    }
+
+    case FILTER_IN:
+    {
+      bson_iter_t elements;
+
+      bson_iter_recurse(&node->operand, &elements);
+      while (bson_iter_next(&elements))
+      {
+        if (bson_iter_type(&elements) != BSON_TYPE_REGEX && filter_equals(value, &elements))
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    case FILTER_REGEX:
+    {
+      const char* str;
+
+      if (value == NULL)
+      {
+        return false;
+      }
+
+      if (BSON_ITER_HOLDS_UTF8(value))
+      {
+        str = bson_iter_utf8(value, NULL);
+      }
+      else if (bson_iter_type(value) == BSON_TYPE_SYMBOL)
+      {
+        str = bson_iter_symbol(value, NULL);
+      }
+      else
+      {
+        return false;
+      }
+
+      return regexec(node->regex, str, 0, NULL, 0) == 0;
+    }
+
+    default:
+      return false;
+  }
+}
+
+static bool filter_match_value(cbson_filter_node_t* node, const bson_iter_t* value)
+{
+  bson_iter_t elements;
+
+  if (node->op == FILTER_EXISTS)
+  {
+    return value != NULL;
+  }
+
+  if (filter_match_scalar(node, value))
+  {
+    return true;
+  }
+
+  // arrays match when any of their elements does
+  if (value != NULL && BSON_ITER_HOLDS_ARRAY(value) && bson_iter_recurse(value, &elements))
+  {
+    while (bson_iter_next(&elements))
+    {
+      if (filter_match_scalar(node, &elements))
+      {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+static bool is_index(const char* path, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    if (path[i] < '0' || path[i] > '9')
+    {
+      return false;
+    }
+  }
+
+  return len > 0;
+}
+
+static bool filter_match_path(cbson_filter_node_t* node, bson_iter_t* iter, const char* path)
+{
+  const char* dot = strchr(path, '.');
+  size_t len = dot ? (size_t)(dot - path) : strlen(path);
+  bson_iter_t child;
+
+  while (bson_iter_next(iter))
+  {
+    const char* key = bson_iter_key(iter);
+
+    if (strncmp(key, path, len) != 0 || key[len] != '\0')
+    {
+      continue;
+    }
+
+    if (!dot)
+    {
+      return filter_match_value(node, iter);
+    }
+
+    if (BSON_ITER_HOLDS_DOCUMENT(iter) && bson_iter_recurse(iter, &child))
+    {
+      return filter_match_path(node, &child, dot + 1);
+    }
+
+    if (BSON_ITER_HOLDS_ARRAY(iter) && bson_iter_recurse(iter, &child))
+    {
+      bson_iter_t elements = child;
+      const char* next = dot + 1;
+      const char* next_dot = strchr(next, '.');
+
+      // numeric components address array elements directly
+      if (is_index(next, next_dot ? (size_t)(next_dot - next) : strlen(next)) && filter_match_path(node, &child, next))
+      {
+        return true;
+      }
+
+      while (bson_iter_next(&elements))
+      {
+        if (BSON_ITER_HOLDS_DOCUMENT(&elements) && bson_iter_recurse(&elements, &child) && filter_match_path(node, &child, next))
+        {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    break;
+  }
+
+  return filter_match_value(node, NULL);
+}
+
+static bool filter_match(cbson_filter_t* f, int index, const bson_iter_t* doc)
+{
+  cbson_filter_node_t* node = &f->nodes[index];
+  bson_iter_t iter;
+  int child;
+
+  switch (node->op)
+  {
+    case FILTER_AND:
+      for (child = node->child; child >= 0; child = f->nodes[child].next)
+      {
+        if (!filter_match(f, child, doc))
+        {
+          return false;
+        }
+      }
+      return true;
+
+    case FILTER_OR:
+    case FILTER_NOR:
+      for (child = node->child; child >= 0; child = f->nodes[child].next)
+      {
+        if (filter_match(f, child, doc))
+        {
+          return node->op == FILTER_OR;
+        }
+      }
+      return node->op == FILTER_NOR;
+
+    case FILTER_NOT:
+      return !filter_match(f, node->child, doc);
+
+    default:
+      iter = *doc;
+      return filter_match_path(node, &iter, node->path);
+  }
+}
+
+static int compile_filter_call(lua_State* L)
+{
+  bson_t filter;
+  bson_iter_t iter;
+  cbson_filter_t* f;
+
+  cbson_check_document(L, 1, &filter);
+
+  f = lua_newuserdata(L, sizeof(cbson_filter_t) + filter.len);
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_FILTER);
+  memset(f, 0, sizeof(cbson_filter_t));
+  f->len = filter.len;
+  memcpy(FILTER_DATA(f), bson_get_data(&filter), filter.len);
+  bson_destroy(&filter);
+
+  luaL_getmetatable(L, FILTER_METATABLE);
+  lua_setmetatable(L, -2);
+
+  if (!bson_init_static(&filter, FILTER_DATA(f), f->len) || !bson_iter_init(&iter, &filter))
+  {
+    return luaL_error(L, "Can't init bson iterator.");
+  }
+
+  f->root = filter_compile_document(L, f, &iter, 0);
+
+  return 1;
+}
+
+int cbson_compile_filter(lua_State* L)
+{
+  return cbson_arena_call(L, compile_filter_call);
+}
+
+int cbson_filter_match(lua_State* L)
+{
+  cbson_filter_t* f = check_cbson_filter(L, 1);
+  size_t len;
+  bson_t doc;
+  bson_iter_t iter;
+  CBSON_STATS_BEGIN();
+
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 2, &len);
+
+  if (!bson_init_static(&doc, data, len) || !bson_iter_init(&iter, &doc))
+  {
+    return luaL_error(L, "Can't init bson from data.");
+  }
+
+  lua_pushboolean(L, filter_match(f, f->root, &iter));
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_FILTER_MATCH, len, 0);
+  return 1;
+}
+
+int cbson_filter_destroy(lua_State* L)
+{
+  cbson_filter_t* f = check_cbson_filter(L, 1);
+  int i;
+
+  for (i = 0; i < f->count; i++)
+  {
+    if (f->nodes[i].regex)
+    {
+      regfree(f->nodes[i].regex);
+      free(f->nodes[i].regex);
+    }
+  }
+
+  free(f->nodes);
+  f->nodes = NULL;
+  f->count = 0;
+  f->size = 0;
+
+  return 0;
+}
+
+int cbson_filter_tostring(lua_State* L)
+{
+  cbson_filter_t* f = check_cbson_filter(L, 1);
+  bson_t filter;
+
+  if (bson_init_static(&filter, FILTER_DATA(f), f->len))
+  {
+    size_t len;
+    char* str = bson_as_json(&filter, &len);
+
+    lua_pushlstring(L, str, len);
+    bson_free(str);
+  }
+  else
+  {
+    lua_pushstring(L, "filter");
+  }
+
+  return 1;
+}
+
+const struct luaL_Reg cbson_filter_meta[] = {
+  {"__tostring", cbson_filter_tostring},
+  {"__gc",       cbson_filter_destroy},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_filter_methods[] = {
+  {"match", cbson_filter_match},
+  {NULL, NULL}
+};
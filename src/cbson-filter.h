@@ -0,0 +1,33 @@
+#ifndef __CBSON_FILTER_H__
+#define __CBSON_FILTER_H__
+
+#include <lua.h>
+#include <bson.h>
+#include <regex.h>
+
+#define FILTER_METATABLE "bson-filter metatable"
+
+typedef struct {
+  int op;
+  const char* path;
+  bson_iter_t operand;
+  regex_t* regex;
+  int child;
+  int next;
+} cbson_filter_node_t;
+
+typedef struct {
+  cbson_filter_node_t* nodes;
+  int count;
+  int size;
+  int root;
+  uint32_t len;
+} cbson_filter_t;
+
+int cbson_compile_filter(lua_State* L);
+cbson_filter_t* check_cbson_filter(lua_State *L, int index);
+
+extern const struct luaL_Reg cbson_filter_meta[];
+extern const struct luaL_Reg cbson_filter_methods[];
+
+#endif
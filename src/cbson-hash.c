@@ -0,0 +1,403 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "cbson.h"
+#include "cbson-hash.h"
+#include "cbson-encode.h"
+#include "cbson-int.h"
+#include "cbson-uint.h"
+#include "cbson-util.h"
+#include "cbson-stats.h"
+
+// xxHash64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t xxh_read64(const uint8_t* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return BSON_UINT64_FROM_LE(v);
+}
+
+static inline uint32_t xxh_read32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return BSON_UINT32_FROM_LE(v);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = XXH_ROTL64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val)
+{
+  acc ^= xxh_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t cbson_xxh64(const void* input, size_t len, uint64_t seed)
+{
+  const uint8_t* p = input;
+  const uint8_t* end = p + len;
+  uint64_t h;
+
+  if (len >= 32)
+  {
+    // four independent lanes, so the compiler can keep them in parallel
+    const uint8_t* limit = end - 32;
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+
+    do
+    {
+      v1 = xxh_round(v1, xxh_read64(p));
+      v2 = xxh_round(v2, xxh_read64(p + 8));
+      v3 = xxh_round(v3, xxh_read64(p + 16));
+      v4 = xxh_round(v4, xxh_read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+    h = xxh_merge_round(h, v1);
+    h = xxh_merge_round(h, v2);
+    h = xxh_merge_round(h, v3);
+    h = xxh_merge_round(h, v4);
+  }
+  else
+  {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  h += (uint64_t)len;
+
+  while (p + 8 <= end)
+  {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+
+  if (p + 4 <= end)
+  {
+    h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+    h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+
+  while (p < end)
+  {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+// raw bytes of the current element value, type and key excluded
+static const uint8_t* element_value(const bson_iter_t* iter, size_t key_len, uint32_t* len)
+{
+  const uint8_t* value = (const uint8_t*)bson_iter_key(iter) + key_len + 1;
+
+  *len = (uint32_t)(iter->raw + iter->next_off - value);
+  return value;
+}
+
+static uint64_t hash_unordered_document(bson_iter_t* iter, uint64_t seed, int depth);
+
+// documents nested past BSON_MAX_RECURSION levels are hashed and compared by raw bytes
+static uint64_t hash_unordered_element(bson_iter_t* iter, uint64_t seed, int depth)
+{
+  const char* key = bson_iter_key(iter);
+  size_t key_len = strlen(key);
+  bson_iter_t child;
+  uint8_t buf[9];
+  uint64_t value;
+
+  if (depth >= BSON_MAX_RECURSION)
+  {
+    uint32_t len;
+    const uint8_t* data = element_value(iter, key_len, &len);
+    value = cbson_xxh64(data, len, seed);
+  }
+  else if (BSON_ITER_HOLDS_DOCUMENT(iter) && bson_iter_recurse(iter, &child))
+  {
+    value = hash_unordered_document(&child, seed, depth + 1);
+  }
+  else if (BSON_ITER_HOLDS_ARRAY(iter) && bson_iter_recurse(iter, &child))
+  {
+    // arrays keep order, but their subdocuments are still hashed unordered
+    value = seed;
+    while (bson_iter_next(&child))
+    {
+      uint64_t h = hash_unordered_element(&child, seed, depth + 1);
+      value = cbson_xxh64(&h, sizeof(h), value);
+    }
+  }
+  else
+  {
+    uint32_t len;
+    const uint8_t* data = element_value(iter, key_len, &len);
+    value = cbson_xxh64(data, len, seed);
+  }
+
+  buf[0] = (uint8_t)bson_iter_type(iter);
+  memcpy(buf + 1, &value, sizeof(value));
+
+  return cbson_xxh64(buf, sizeof(buf), cbson_xxh64(key, key_len, seed));
+}
+
+// element hashes are summed, so field order doesn't matter
+static uint64_t hash_unordered_document(bson_iter_t* iter, uint64_t seed, int depth)
+{
+  uint64_t sum = 0;
+  uint64_t count = 0;
+
+  while (bson_iter_next(iter))
+  {
+    sum += hash_unordered_element(iter, seed, depth);
+    count++;
+  }
+
+  return cbson_xxh64(&sum, sizeof(sum), seed + count);
+}
+
+static bool equal_unordered_documents(const bson_iter_t* a, const bson_iter_t* b, int depth);
+
+static bool equal_unordered_elements(bson_iter_t* a, bson_iter_t* b, int depth)
+{
+  bson_iter_t a_child, b_child;
+
+  if (bson_iter_type(a) != bson_iter_type(b))
+  {
+    return false;
+  }
+
+  if (BSON_ITER_HOLDS_DOCUMENT(a) && depth < BSON_MAX_RECURSION)
+  {
+    return bson_iter_recurse(a, &a_child) && bson_iter_recurse(b, &b_child) &&
+           equal_unordered_documents(&a_child, &b_child, depth + 1);
+  }
+
+  if (BSON_ITER_HOLDS_ARRAY(a) && depth < BSON_MAX_RECURSION)
+  {
+    if (!bson_iter_recurse(a, &a_child) || !bson_iter_recurse(b, &b_child))
+    {
+      return false;
+    }
+
+    while (true)
+    {
+      bool a_next = bson_iter_next(&a_child);
+      bool b_next = bson_iter_next(&b_child);
+
+      if (!a_next || !b_next)
+      {
+        return a_next == b_next;
+      }
+
+      if (!equal_unordered_elements(&a_child, &b_child, depth + 1))
+      {
+        return false;
+      }
+    }
+  }
+
+  uint32_t a_len, b_len;
+  const uint8_t* a_data = element_value(a, strlen(bson_iter_key(a)), &a_len);
+  const uint8_t* b_data = element_value(b, strlen(bson_iter_key(b)), &b_len);
+
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+// every field of a must have equal field in b, tries same position first and scans b otherwise
+static bool equal_unordered_documents(const bson_iter_t* a, const bson_iter_t* b, int depth)
+{
+  bson_iter_t a_iter = *a;
+  bson_iter_t b_pos = *b;
+  uint32_t a_count = 0, b_count = 0;
+
+  while (bson_iter_next(&a_iter))
+  {
+    const char* key = bson_iter_key(&a_iter);
+    bool found = false;
+
+    if (bson_iter_next(&b_pos) && strcmp(key, bson_iter_key(&b_pos)) == 0)
+    {
+      found = equal_unordered_elements(&a_iter, &b_pos, depth);
+    }
+    else
+    {
+      bson_iter_t b_iter = *b;
+
+      if (bson_iter_find(&b_iter, key))
+      {
+        found = equal_unordered_elements(&a_iter, &b_iter, depth);
+      }
+    }
+
+    if (!found)
+    {
+      return false;
+    }
+
+    a_count++;
+  }
+
+  b_pos = *b;
+  while (bson_iter_next(&b_pos))
+  {
+    b_count++;
+  }
+
+  return a_count == b_count;
+}
+
+// seed is taken as 64 bits of cbson.int, cbson.uint or integral number in int64 range (negative ones wrap)
+static uint64_t check_seed(lua_State* L, int index)
+{
+  double n;
+
+  if (luaL_checkudata_ex(L, index, INT64_METATABLE) || luaL_checkudata_ex(L, index, UINT64_METATABLE))
+  {
+    return *(uint64_t*)lua_touserdata(L, index);
+  }
+
+#ifdef CBSON_NATIVE_INTEGERS
+  if (lua_isinteger(L, index))
+  {
+    return (uint64_t)lua_tointeger(L, index);
+  }
+#endif
+
+  n = luaL_checknumber(L, index);
+  if (!(n >= -9223372036854775808.0 && n < 9223372036854775808.0) || n != floor(n))
+  {
+    luaL_error(L, "Invalid seed, expected integer in int64 range, cbson.int or cbson.uint");
+  }
+
+  return (uint64_t)(int64_t)n;
+}
+
+// reads boolean "ordered" option, absent means ordered
+static bool check_ordered_option(lua_State* L, int index)
+{
+  bool ordered = true;
+
+  if (!lua_isnoneornil(L, index))
+  {
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "ordered");
+    if (!lua_isnil(L, -1))
+    {
+      ordered = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+
+  return ordered;
+}
+
+int cbson_hash(lua_State* L)
+{
+  bson_t bson;
+  uint64_t seed = 0;
+  uint64_t h;
+  char buf[17];
+  bool ordered;
+  CBSON_STATS_BEGIN();
+
+  cbson_check_bson(L, 1, &bson);
+  ordered = check_ordered_option(L, 2);
+
+  if (!lua_isnoneornil(L, 2))
+  {
+    lua_getfield(L, 2, "algo");
+    if (!lua_isnil(L, -1) && strcmp(luaL_checkstring(L, -1), "xxh64") != 0)
+    {
+      return luaL_error(L, "Unsupported hash algorithm '%s'", lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "seed");
+    if (!lua_isnil(L, -1))
+    {
+      seed = check_seed(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (ordered)
+  {
+    h = cbson_xxh64(bson_get_data(&bson), bson.len, seed);
+  }
+  else
+  {
+    bson_iter_t iter;
+
+    if (!bson_iter_init(&iter, &bson))
+    {
+      return luaL_error(L, "Can't init bson iterator.");
+    }
+
+    h = hash_unordered_document(&iter, seed, 0);
+  }
+
+  snprintf(buf, sizeof(buf), "%016" PRIx64, h);
+  lua_pushlstring(L, buf, 16);
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_HASH, bson.len, 16);
+  return 1;
+}
+
+int cbson_equal(lua_State* L)
+{
+  bson_t a, b;
+  bson_iter_t a_iter, b_iter;
+  bool ordered;
+  bool equal;
+  CBSON_STATS_BEGIN();
+
+  cbson_check_bson(L, 1, &a);
+  cbson_check_bson(L, 2, &b);
+  ordered = check_ordered_option(L, 3);
+
+  equal = a.len == b.len && memcmp(bson_get_data(&a), bson_get_data(&b), a.len) == 0;
+
+  if (!equal && !ordered)
+  {
+    if (!bson_iter_init(&a_iter, &a) || !bson_iter_init(&b_iter, &b))
+    {
+      return luaL_error(L, "Can't init bson iterator.");
+    }
+
+    equal = equal_unordered_documents(&a_iter, &b_iter, 0);
+  }
+
+  lua_pushboolean(L, equal);
+  CBSON_STATS_DOCUMENTS(2);
+  CBSON_STATS_END(CBSON_STAT_EQUAL, a.len + b.len, 0);
+  return 1;
+}
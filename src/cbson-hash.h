@@ -0,0 +1,13 @@
+#ifndef __CBSON_HASH_H__
+#define __CBSON_HASH_H__
+
+#include <lua.h>
+#include <stdint.h>
+#include <stddef.h>
+
+uint64_t cbson_xxh64(const void* input, size_t len, uint64_t seed);
+
+int cbson_hash(lua_State* L);
+int cbson_equal(lua_State* L);
+
+#endif
@@ -7,6 +7,7 @@
 #include "cbson-uint.h"
 #include "cbson-date.h"
 #include "cbson-util.h"
+#include "cbson-stats.h"
 #include "intpow.h"
 
 enum {
@@ -20,13 +21,16 @@ int64_t cbson_int64_check(lua_State *L, int index)
   {
     return *(int64_t*)lua_touserdata(L, index);
   }
-  else if (lua_isnumber(L, index))
+  else if (lua_type(L, index) == LUA_TNUMBER)
   {
-    return lua_tonumber(L, index);
+    return cbson_toint64(L, index);
   }
   else if (lua_isstring(L, index))
   {
-    return strtoll(lua_tostring(L, index), NULL, 10);
+    // decimal strings are parsed as is to keep all 64 bits, anything else ("1e3", "0x10") is converted by lua
+    char* end;
+    int64_t value = strtoll(lua_tostring(L, index), &end, 10);
+    return *end == '\0' ? value : cbson_toint64(L, index);
   }
   else
   {
@@ -39,6 +43,7 @@ int64_t cbson_int64_check(lua_State *L, int index)
 int cbson_int64_create(lua_State* L, int64_t val)
 {
   cbson_int64_t* ud = lua_newuserdata(L, sizeof(cbson_int64_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_INT);
 
   *ud = val;
 
@@ -56,7 +61,11 @@ int cbson_int64_number(lua_State* L)
 {
   cbson_int64_t a = cbson_int64_check(L, 1);
 
+#ifdef CBSON_NATIVE_INTEGERS
+  lua_pushinteger(L, a);
+#else
   lua_pushnumber(L, a);
+#endif
   return 1;
 }
 
@@ -2,6 +2,7 @@
 
 #include "cbson.h"
 #include "cbson-misc.h"
+#include "cbson-stats.h"
 
 // UNDEFINED
 
@@ -10,6 +11,7 @@ DEFINE_CHECK(UNDEFINED, undefined)
 int cbson_undefined_create(lua_State* L)
 {
   lua_newuserdata(L, sizeof(cbson_undefined_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_UNDEFINED);
 
   luaL_getmetatable(L, UNDEFINED_METATABLE);
   lua_setmetatable(L, -2);
@@ -45,6 +47,7 @@ DEFINE_CHECK(CBNULL, null)
 int cbson_null_create(lua_State* L)
 {
   lua_newuserdata(L, sizeof(cbson_null_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_NULL);
 
   luaL_getmetatable(L, CBNULL_METATABLE);
   lua_setmetatable(L, -2);
@@ -83,6 +86,7 @@ DEFINE_CHECK(ARRAY, array)
 int cbson_array_create(lua_State* L)
 {
   lua_newuserdata(L, sizeof(cbson_array_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_ARRAY);
 
   luaL_getmetatable(L, ARRAY_METATABLE);
   lua_setmetatable(L, -2);
@@ -122,6 +126,7 @@ DEFINE_CHECK(MINKEY, minkey)
 int cbson_minkey_create(lua_State* L)
 {
   lua_newuserdata(L, sizeof(cbson_minkey_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_MINKEY);
 
   luaL_getmetatable(L, MINKEY_METATABLE);
   lua_setmetatable(L, -2);
@@ -158,6 +163,7 @@ DEFINE_CHECK(MAXKEY, maxkey)
 int cbson_maxkey_create(lua_State* L)
 {
   lua_newuserdata(L, sizeof(cbson_maxkey_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_MAXKEY);
 
   luaL_getmetatable(L, MAXKEY_METATABLE);
   lua_setmetatable(L, -2);
@@ -0,0 +1,417 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // dladdr
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "cbson.h"
+#include "cbson-util.h"
+#include "cbson-offload.h"
+#include "cbson-decode.h"
+#include "cbson-stats.h"
+
+#define OFFLOAD_QUEUED  0
+#define OFFLOAD_RUNNING 1
+#define OFFLOAD_DONE    2
+
+typedef struct cbson_offload_job_s {
+  struct cbson_offload_job_s* next;
+  const uint8_t* data;  // bytes of lua string, anchored by userdata
+  uint32_t len;
+  int state;            // guarded by pool_lock
+  pid_t pid;            // process whose workers run the job
+  cbson_tape_t tape;
+} cbson_offload_job_t;
+
+typedef struct {
+  cbson_offload_job_t* job;
+  int data_ref;
+  int result_ref;
+} cbson_offload_t;
+
+DEFINE_CHECK(OFFLOAD, offload)
+
+// Process-wide pool. Workers are started on first use and only touch jobs and tapes.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static cbson_offload_job_t* queue_head = NULL;
+static cbson_offload_job_t* queue_tail = NULL;
+static int pool_threads = 0;    // configured size, 0 for default
+static int pool_running = 0;    // started workers
+static pid_t pool_pid = 0;      // workers don't survive fork
+
+static int default_threads(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cpus < 1)
+  {
+    return 1;
+  }
+
+  return cpus > CBSON_OFFLOAD_MAX_DEFAULT_THREADS ? CBSON_OFFLOAD_MAX_DEFAULT_THREADS : (int)cpus;
+}
+
+static void* worker(void* arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock(&pool_lock);
+  for (;;)
+  {
+    cbson_offload_job_t* job = queue_head;
+
+    if (!job)
+    {
+      pthread_cond_wait(&pool_work, &pool_lock);
+      continue;
+    }
+
+    queue_head = job->next;
+    if (!queue_head)
+    {
+      queue_tail = NULL;
+    }
+    job->state = OFFLOAD_RUNNING;
+    pthread_mutex_unlock(&pool_lock);
+
+    cbson_tape_build(job->data, job->len, &job->tape);
+
+    pthread_mutex_lock(&pool_lock);
+    job->state = OFFLOAD_DONE;
+    pthread_cond_broadcast(&pool_done);
+  }
+
+  return NULL;
+}
+
+// Workers sleep in code of this library, so it must stay loaded when lua_close unloads the module
+static void pin_library(void)
+{
+  static bool pinned = false;
+  Dl_info info;
+
+  if (!pinned && dladdr((void*)worker, &info) && info.dli_fname)
+  {
+    pinned = dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) != NULL;
+  }
+}
+
+// pool_lock is held over fork, so child doesn't get it locked by worker
+static void fork_prepare(void)
+{
+  pthread_mutex_lock(&pool_lock);
+}
+
+static void fork_release(void)
+{
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// Forked child has no workers, queue of parent is dropped. Called with pool_lock held.
+static void check_fork(void)
+{
+  if (pool_pid != getpid())
+  {
+    pool_pid = getpid();
+    pool_running = 0;
+    queue_head = queue_tail = NULL;
+  }
+}
+
+// Job queued or running in parent before fork is never finished in child. Tape of running one may be
+// half-built, so it's dropped. Called with pool_lock held, returns true if job has to be built by caller.
+static bool orphan_job(cbson_offload_job_t* job)
+{
+  check_fork();
+
+  if (job->state == OFFLOAD_DONE || job->pid == pool_pid)
+  {
+    return false;
+  }
+
+  memset(&job->tape, 0, sizeof(job->tape));
+  job->state = OFFLOAD_DONE;
+  return true;
+}
+
+// orphaned job counts as ready, wait builds it. Called with pool_lock held.
+static bool job_ready(const cbson_offload_job_t* job)
+{
+  return job->state == OFFLOAD_DONE || job->pid != getpid();
+}
+
+// starts missing workers, returns false if there are none. Called with pool_lock held.
+static bool start_workers(void)
+{
+  int size = pool_threads ? pool_threads : default_threads();
+
+  check_fork();
+
+  if (pool_running < size)
+  {
+    static bool atfork = false;
+
+    pin_library();
+    if (!atfork)
+    {
+      atfork = pthread_atfork(fork_prepare, fork_release, fork_release) == 0;
+    }
+  }
+
+  while (pool_running < size)
+  {
+    pthread_t thread;
+    pthread_attr_t attr;
+    int err;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, worker, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0)
+    {
+      break;
+    }
+    pool_running++;
+  }
+
+  return pool_running > 0;
+}
+
+// removes queued job or waits for running one. Called with pool_lock held.
+static void cancel_job(cbson_offload_job_t* job)
+{
+  if (orphan_job(job))
+  {
+    return;
+  }
+
+  if (job->state == OFFLOAD_QUEUED)
+  {
+    cbson_offload_job_t** link = &queue_head;
+
+    queue_tail = NULL;
+    while (*link)
+    {
+      if (*link == job)
+      {
+        *link = job->next;
+        continue;
+      }
+      queue_tail = *link;
+      link = &(*link)->next;
+    }
+    job->state = OFFLOAD_DONE;
+  }
+
+  while (job->state != OFFLOAD_DONE)
+  {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+}
+
+int cbson_decode_offload(lua_State* L)
+{
+  size_t len;
+  const uint8_t* data = (const uint8_t*)luaL_checklstring(L, 1, &len);
+  cbson_offload_t* ud;
+  cbson_offload_job_t* job;
+
+  cbson_check_data(L, data, len);
+
+  ud = lua_newuserdata(L, sizeof(cbson_offload_t));
+  ud->job = NULL;
+  ud->data_ref = LUA_NOREF;
+  ud->result_ref = LUA_NOREF;
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_JOB);
+
+  luaL_getmetatable(L, OFFLOAD_METATABLE);
+  lua_setmetatable(L, -2);
+
+  job = calloc(1, sizeof(cbson_offload_job_t));
+  if (!job)
+  {
+    luaL_error(L, "Not enough memory");
+  }
+  job->data = data;
+  job->len = (uint32_t)len;
+  ud->job = job;
+
+  lua_pushvalue(L, 1);
+  ud->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  pthread_mutex_lock(&pool_lock);
+  if (start_workers())
+  {
+    job->state = OFFLOAD_QUEUED;
+    job->pid = pool_pid;
+    if (queue_tail)
+    {
+      queue_tail->next = job;
+    }
+    else
+    {
+      queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+  }
+  else
+  {
+    // no threads, parse right away
+    pthread_mutex_unlock(&pool_lock);
+    cbson_tape_build(job->data, job->len, &job->tape);
+    job->state = OFFLOAD_DONE;
+  }
+
+  return 1;
+}
+
+static void release_job(lua_State* L, cbson_offload_t* ud)
+{
+  if (ud->job)
+  {
+    pthread_mutex_lock(&pool_lock);
+    cancel_job(ud->job);
+    pthread_mutex_unlock(&pool_lock);
+
+    free(ud->job->tape.entries);
+    free(ud->job);
+    ud->job = NULL;
+  }
+
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->data_ref);
+  ud->data_ref = LUA_NOREF;
+}
+
+int cbson_offload_ready(lua_State* L)
+{
+  cbson_offload_t* ud = check_cbson_offload(L, 1);
+  bool ready = true;
+
+  if (ud->job)
+  {
+    pthread_mutex_lock(&pool_lock);
+    ready = job_ready(ud->job);
+    pthread_mutex_unlock(&pool_lock);
+  }
+
+  lua_pushboolean(L, ready);
+  return 1;
+}
+
+// waits for worker and builds tables from tape, result is kept for subsequent calls
+int cbson_offload_wait(lua_State* L)
+{
+  cbson_offload_t* ud = check_cbson_offload(L, 1);
+  cbson_offload_job_t* job = ud->job;
+
+  if (job)
+  {
+    CBSON_STATS_BEGIN();
+
+    pthread_mutex_lock(&pool_lock);
+    if (orphan_job(job))
+    {
+      pthread_mutex_unlock(&pool_lock);
+      cbson_tape_build(job->data, job->len, &job->tape);
+    }
+    else
+    {
+      while (job->state != OFFLOAD_DONE)
+      {
+        pthread_cond_wait(&pool_done, &pool_lock);
+      }
+      pthread_mutex_unlock(&pool_lock);
+    }
+
+    if (job->tape.failed)
+    {
+      release_job(L, ud);
+      luaL_error(L, "Not enough memory");
+    }
+
+    cbson_tape_materialize(L, job->data, &job->tape);
+    CBSON_STATS_DOCUMENTS(1);
+    CBSON_STATS_END(CBSON_STAT_OFFLOAD_WAIT, job->len, 0);
+
+    ud->result_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    release_job(L, ud);
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->result_ref);
+  return 1;
+}
+
+int cbson_offload_gc(lua_State* L)
+{
+  cbson_offload_t* ud = check_cbson_offload(L, 1);
+
+  release_job(L, ud);
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->result_ref);
+  ud->result_ref = LUA_NOREF;
+  return 0;
+}
+
+int cbson_offload_tostring(lua_State* L)
+{
+  cbson_offload_t* ud = check_cbson_offload(L, 1);
+  const char* state = "decoded";
+
+  if (ud->job)
+  {
+    pthread_mutex_lock(&pool_lock);
+    state = job_ready(ud->job) ? "ready" : "pending";
+    pthread_mutex_unlock(&pool_lock);
+  }
+
+  lua_pushfstring(L, "offload (%s)", state);
+  return 1;
+}
+
+// cbson.set_offload_threads(n) - pool can only grow, returns previous setting
+int cbson_set_offload_threads(lua_State* L)
+{
+  int threads = (int)luaL_checkinteger(L, 1);
+  int previous;
+
+  if (threads < 1 || threads > 64)
+  {
+    luaL_error(L, "Invalid number of threads, expected 1..64");
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  previous = pool_threads ? pool_threads : default_threads();
+  pool_threads = threads;
+  if (pool_running > 0)
+  {
+    start_workers();
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  lua_pushinteger(L, previous);
+  return 1;
+}
+
+const struct luaL_Reg cbson_offload_meta[] = {
+  {"__tostring", cbson_offload_tostring},
+  {"__gc",       cbson_offload_gc},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_offload_methods[] = {
+  {"ready", cbson_offload_ready},
+  {"wait",  cbson_offload_wait},
+  {NULL, NULL}
+};
@@ -0,0 +1,45 @@
+#ifndef __CBSON_OFFLOAD_H__
+#define __CBSON_OFFLOAD_H__
+
+#include <lua.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OFFLOAD_METATABLE "bson-offload metatable"
+
+// default number of worker threads is number of cpus, up to this
+#define CBSON_OFFLOAD_MAX_DEFAULT_THREADS 4
+
+// Tape is flat list of validated elements in document order. Document or array entry is followed by
+// entries of its elements and CBSON_TAPE_END, so tables are built in one pass without checks.
+#define CBSON_TAPE_END       0x00
+#define CBSON_TAPE_ELLIPSIS  0xF0  // document nested deeper than BSON_MAX_RECURSION, decoded as "..."
+
+typedef struct {
+  uint32_t type;
+  uint32_t key;      // offset of key in buffer
+  uint32_t key_len;
+  uint32_t value;    // offset of value in buffer
+} cbson_tape_entry_t;
+
+// built by worker threads, so it's allocated with malloc: cbson allocator and stats aren't thread-safe
+typedef struct {
+  cbson_tape_entry_t* entries;
+  size_t count;
+  size_t size;
+  bool failed;       // out of memory
+} cbson_tape_t;
+
+// implemented in cbson-tape.c, build doesn't touch lua state
+void cbson_tape_build(const uint8_t* data, uint32_t len, cbson_tape_t* tape);
+void cbson_tape_materialize(lua_State* L, const uint8_t* data, const cbson_tape_t* tape);
+
+int cbson_decode_offload(lua_State* L);
+int cbson_offload_ready(lua_State* L);
+int cbson_offload_wait(lua_State* L);
+int cbson_set_offload_threads(lua_State* L);
+
+extern const struct luaL_Reg cbson_offload_meta[];
+extern const struct luaL_Reg cbson_offload_methods[];
+
+#endif
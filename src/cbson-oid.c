@@ -6,6 +6,7 @@
 #include "cbson.h"
 #include "cbson-oid.h"
 #include "cbson-util.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(OID, oid)
 
@@ -19,6 +20,7 @@ int cbson_oid_create(lua_State* L, const char* oid)
   }
 
   cbson_oid_t* ud = lua_newuserdata(L, sizeof(cbson_oid_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_OID);
   strcpy(ud->oid, oid);
 
   luaL_getmetatable(L, OID_METATABLE);
@@ -5,12 +5,14 @@
 
 #include "cbson.h"
 #include "cbson-ref.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(REF, ref)
 
 int cbson_ref_create(lua_State* L, const char* ref, const char* id)
 {
   cbson_ref_t* ud = lua_newuserdata(L, sizeof(cbson_ref_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_REF);
 
   ud->ref = malloc(strlen(ref)+1);
   ud->id = malloc(strlen(id)+1);
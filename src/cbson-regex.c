@@ -4,12 +4,14 @@
 
 #include "cbson.h"
 #include "cbson-regex.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(REGEX, regex)
 
 int cbson_regex_create(lua_State* L, const char* regex, const char* options)
 {
   cbson_regex_t* ud = lua_newuserdata(L, sizeof(cbson_regex_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_REGEX);
 
   ud->regex = malloc(strlen(regex)+1);
   ud->options = malloc(strlen(options)+1);
@@ -0,0 +1,603 @@
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cbson.h"
+#include "cbson-scan.h"
+#include "cbson-alloc.h"
+#include "cbson-stats.h"
+
+int luaopen_cbson(lua_State *L); // cbson.c
+
+#define SLOT_FREE    0
+#define SLOT_RUNNING 1
+#define SLOT_DONE    2
+
+// batch of consecutive documents, its output is kept until it's written
+typedef struct {
+  int state;
+  size_t start;
+  size_t end;
+  char* out;
+  size_t out_len;
+  size_t out_size;
+} cbson_scan_slot_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;      // slot freed or scan failed
+  pthread_cond_t done;      // batch done or worker exited
+  const uint8_t* data;      // mapped file, shared by all workers
+  size_t len;
+  const char* script;
+  int threads;
+  bool ordered;
+  size_t batch_size;
+  size_t next_offset;       // start of first unclaimed document
+  size_t next_index;        // number of claimed batches
+  size_t emitted;           // number of written batches
+  int running;              // workers alive
+  bool failed;
+  char error[256];
+  uint64_t documents;
+  int slot_count;
+  cbson_scan_slot_t* slots; // batch n is in slot n % slot_count when ordered
+} cbson_scan_t;
+
+typedef struct {
+  cbson_scan_t* scan;
+  int id;
+} cbson_scan_worker_t;
+
+int cbson_scan_active = 0;
+
+static uint32_t document_size(const uint8_t* p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// keeps first error only. Called with lock held.
+static void scan_fail(cbson_scan_t* scan, const char* fmt, ...)
+{
+  va_list args;
+
+  if (!scan->failed)
+  {
+    va_start(args, fmt);
+    vsnprintf(scan->error, sizeof(scan->error), fmt, args);
+    va_end(args);
+    scan->failed = true;
+  }
+
+  pthread_cond_broadcast(&scan->work);
+  pthread_cond_broadcast(&scan->done);
+}
+
+// takes documents of next batch from file, waits for free slot. Returns NULL when there is nothing left
+// to do. Called with lock held.
+static cbson_scan_slot_t* claim_batch(cbson_scan_t* scan)
+{
+  for (;;)
+  {
+    cbson_scan_slot_t* slot = NULL;
+    size_t start = scan->next_offset;
+    size_t end = start;
+    int i;
+
+    if (scan->failed || scan->next_offset >= scan->len)
+    {
+      return NULL;
+    }
+
+    if (scan->ordered)
+    {
+      slot = &scan->slots[scan->next_index % scan->slot_count];
+      slot = slot->state == SLOT_FREE ? slot : NULL;
+    }
+    else
+    {
+      for (i = 0; i < scan->slot_count && !slot; i++)
+      {
+        slot = scan->slots[i].state == SLOT_FREE ? &scan->slots[i] : NULL;
+      }
+    }
+
+    if (!slot)
+    {
+      pthread_cond_wait(&scan->work, &scan->lock);
+      continue;
+    }
+
+    // malformed header ends the batch, it's reported when next batch starts with it
+    while (end < scan->len && end - start < scan->batch_size)
+    {
+      size_t left = scan->len - end;
+      uint32_t size = left < 5 ? 0 : document_size(scan->data + end);
+
+      if (size < 5 || size > left)
+      {
+        break;
+      }
+      end += size;
+    }
+
+    if (end == start)
+    {
+      scan_fail(scan, "Truncated or malformed document at offset %llu", (unsigned long long)start);
+      return NULL;
+    }
+
+    slot->state = SLOT_RUNNING;
+    slot->start = start;
+    slot->end = end;
+    slot->out_len = 0;
+    scan->next_offset = end;
+    scan->next_index++;
+    return slot;
+  }
+}
+
+static bool append_output(cbson_scan_slot_t* slot, const char* str, size_t len)
+{
+  if (slot->out_len + len > slot->out_size)
+  {
+    size_t size = slot->out_size ? slot->out_size : 4096;
+    char* out;
+
+    while (size < slot->out_len + len)
+    {
+      size *= 2;
+    }
+
+    out = realloc(slot->out, size);
+    if (!out)
+    {
+      return false;
+    }
+    slot->out = out;
+    slot->out_size = size;
+  }
+
+  memcpy(slot->out + slot->out_len, str, len);
+  slot->out_len += len;
+  return true;
+}
+
+// calls worker function for every document of batch. On error message is left on stack
+// and *offset is set to failed document.
+static bool run_batch(lua_State* L, int fn, const uint8_t* data, cbson_scan_slot_t* slot, size_t* offset,
+                      uint64_t* documents)
+{
+  for (*offset = slot->start; *offset < slot->end; (*documents)++)
+  {
+    uint32_t size = document_size(data + *offset);
+
+    // documents are passed as strings, so the existing decode/to_json work on them as usual
+    lua_pushvalue(L, fn);
+    lua_pushlstring(L, (const char*)data + *offset, size);
+    lua_pushinteger(L, (lua_Integer)*offset);
+    if (lua_pcall(L, 2, 1, 0) != 0)
+    {
+      return false;
+    }
+
+    if (lua_isstring(L, -1))
+    {
+      size_t len;
+      const char* str = lua_tolstring(L, -1, &len);
+
+      if (!append_output(slot, str, len))
+      {
+        lua_pushliteral(L, "Not enough memory");
+        return false;
+      }
+    }
+    else if (!lua_isnil(L, -1))
+    {
+      lua_pushliteral(L, "worker function must return string or nil");
+      return false;
+    }
+    lua_pop(L, 1);
+
+    *offset += size;
+  }
+
+  return true;
+}
+
+// opens libs and preloaded cbson, runs worker script and leaves returned function on stack
+static int init_worker(lua_State* L)
+{
+  cbson_scan_worker_t* worker = (cbson_scan_worker_t*)lua_touserdata(L, 1);
+
+  luaL_openlibs(L);
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaded");
+  lua_pushcfunction(L, luaopen_cbson);
+  lua_call(L, 0, 1);
+  lua_setfield(L, -2, CBSON_MODNAME);
+  lua_pop(L, 2);
+
+  if (luaL_loadfile(L, worker->scan->script) != 0)
+  {
+    lua_error(L);
+  }
+  lua_pushinteger(L, worker->id);
+  lua_pushinteger(L, worker->scan->threads);
+  lua_call(L, 2, 1);
+
+  if (!lua_isfunction(L, -1))
+  {
+    luaL_error(L, "worker script must return function");
+  }
+
+  return 1;
+}
+
+static void* scan_worker(void* arg)
+{
+  cbson_scan_worker_t* worker = (cbson_scan_worker_t*)arg;
+  cbson_scan_t* scan = worker->scan;
+  lua_State* L = luaL_newstate();
+  cbson_scan_slot_t* slot;
+
+  if (!L)
+  {
+    pthread_mutex_lock(&scan->lock);
+    scan_fail(scan, "Not enough memory");
+    pthread_mutex_unlock(&scan->lock);
+  }
+  else
+  {
+    lua_pushcfunction(L, init_worker);
+    lua_pushlightuserdata(L, worker);
+    if (lua_pcall(L, 1, 1, 0) != 0)
+    {
+      pthread_mutex_lock(&scan->lock);
+      scan_fail(scan, "%s", lua_isstring(L, -1) ? lua_tostring(L, -1) : "worker script failed");
+      pthread_mutex_unlock(&scan->lock);
+    }
+  }
+
+  pthread_mutex_lock(&scan->lock);
+  while (!scan->failed && (slot = claim_batch(scan)) != NULL)
+  {
+    uint64_t documents = 0;
+    size_t offset;
+    bool ok;
+
+    pthread_mutex_unlock(&scan->lock);
+    ok = run_batch(L, 1, scan->data, slot, &offset, &documents);
+    pthread_mutex_lock(&scan->lock);
+
+    if (!ok)
+    {
+      scan_fail(scan, "document at offset %llu: %s", (unsigned long long)offset,
+                lua_isstring(L, -1) ? lua_tostring(L, -1) : "worker function failed");
+      lua_settop(L, 1);
+    }
+    scan->documents += documents;
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&scan->done);
+  }
+  scan->running--;
+  pthread_cond_broadcast(&scan->done);
+  pthread_mutex_unlock(&scan->lock);
+
+  if (L)
+  {
+    lua_close(L);
+  }
+
+  return NULL;
+}
+
+// finds next batch to write, NULL when scan is over. Called with lock held.
+static cbson_scan_slot_t* next_output(cbson_scan_t* scan)
+{
+  for (;;)
+  {
+    bool busy = false;
+    int i;
+
+    if (scan->failed)
+    {
+      return NULL;
+    }
+
+    if (scan->ordered)
+    {
+      cbson_scan_slot_t* slot = &scan->slots[scan->emitted % scan->slot_count];
+
+      if (scan->emitted < scan->next_index && slot->state == SLOT_DONE)
+      {
+        return slot;
+      }
+      busy = scan->emitted < scan->next_index;
+    }
+    else
+    {
+      for (i = 0; i < scan->slot_count; i++)
+      {
+        if (scan->slots[i].state == SLOT_DONE)
+        {
+          return &scan->slots[i];
+        }
+        busy = busy || scan->slots[i].state == SLOT_RUNNING;
+      }
+    }
+
+    if (!busy && (scan->next_offset >= scan->len || scan->running == 0))
+    {
+      return NULL;
+    }
+    pthread_cond_wait(&scan->done, &scan->lock);
+  }
+}
+
+static int default_threads(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cpus < 1)
+  {
+    return 1;
+  }
+
+  return cpus > CBSON_SCAN_MAX_THREADS ? CBSON_SCAN_MAX_THREADS : (int)cpus;
+}
+
+static int check_option(lua_State* L, int index, const char* name, int def, int min, int max)
+{
+  int value = def;
+
+  lua_getfield(L, index, name);
+  if (!lua_isnil(L, -1))
+  {
+    lua_Number n = luaL_checknumber(L, -1);
+
+    if (n < min || n > max)
+    {
+      luaL_error(L, "Invalid %s, expected %d..%d", name, min, max);
+    }
+    value = (int)n;
+  }
+  lua_pop(L, 1);
+
+  return value;
+}
+
+// cbson.parallel_scan(path, worker_script[, options]) - runs worker_script in separate lua state per thread,
+// function it returns is called for every document of concatenated bson file (mongodump). Returns number
+// of documents.
+int cbson_parallel_scan(lua_State* L)
+{
+  const char* path = luaL_checkstring(L, 1);
+  const char* script = luaL_checkstring(L, 2);
+  int threads = default_threads();
+  int batch_size = CBSON_SCAN_BATCH_SIZE;
+  bool ordered = true;
+  int sink = 0;
+  const char* output = NULL;
+  FILE* out = stdout;
+  cbson_scan_t scan;
+  cbson_scan_worker_t* workers;
+  pthread_t* handles;
+  struct stat st;
+  int fd, i, started = 0;
+  bool sink_failed = false;
+#ifdef CBSON_STATS
+  int stats_enabled = cbson_stats_enabled;
+#endif
+
+  if (!lua_isnoneornil(L, 3))
+  {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    threads = check_option(L, 3, "threads", threads, 1, CBSON_SCAN_MAX_THREADS);
+    batch_size = check_option(L, 3, "batch_size", batch_size, 1, INT32_MAX);
+
+    lua_getfield(L, 3, "ordered");
+    ordered = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 3, "output");
+    if (lua_isfunction(L, -1))
+    {
+      sink = lua_gettop(L);
+    }
+    else if (lua_isstring(L, -1))
+    {
+      output = lua_tostring(L, -1);
+    }
+    else if (!lua_isnil(L, -1))
+    {
+      luaL_error(L, "Invalid output, expected file name or function");
+    }
+  }
+
+  if (cbson_scan_active)
+  {
+    luaL_error(L, "parallel_scan is already running");
+  }
+
+  // other allocators keep process-wide state without locking
+  if (cbson_alloc_mode != CBSON_ALLOC_SYSTEM)
+  {
+    luaL_error(L, "parallel_scan requires \"system\" allocator");
+  }
+
+  memset(&scan, 0, sizeof(scan));
+  scan.script = script;
+  scan.threads = threads;
+  scan.ordered = ordered;
+  scan.batch_size = (size_t)batch_size;
+  scan.slot_count = threads * CBSON_SCAN_BATCHES_PER_THREAD;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    luaL_error(L, "Can't open %s", path);
+  }
+
+  scan.len = (size_t)st.st_size;
+  if (scan.len == 0)
+  {
+    close(fd);
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+
+  scan.data = mmap(NULL, scan.len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (scan.data == MAP_FAILED)
+  {
+    luaL_error(L, "Can't map %s", path);
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise((void*)scan.data, scan.len, MADV_SEQUENTIAL);
+#endif
+
+  if (output && !(out = fopen(output, "wb")))
+  {
+    munmap((void*)scan.data, scan.len);
+    luaL_error(L, "Can't open %s", output);
+  }
+
+  scan.slots = calloc((size_t)scan.slot_count, sizeof(cbson_scan_slot_t));
+  workers = calloc((size_t)threads, sizeof(cbson_scan_worker_t));
+  handles = calloc((size_t)threads, sizeof(pthread_t));
+
+  if (!scan.slots || !workers || !handles)
+  {
+    scan.failed = true;
+    strcpy(scan.error, "Not enough memory");
+    threads = 0;
+  }
+
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.work, NULL);
+  pthread_cond_init(&scan.done, NULL);
+
+  // from here errors are collected in scan.error and raised after workers are joined
+  cbson_scan_active = 1;
+#ifdef CBSON_STATS
+  cbson_stats_enabled = 0; // counters aren't atomic
+#endif
+
+  pthread_mutex_lock(&scan.lock);
+  for (i = 0; i < threads; i++)
+  {
+    workers[i].scan = &scan;
+    workers[i].id = i + 1;
+    if (pthread_create(&handles[i], NULL, scan_worker, &workers[i]) != 0)
+    {
+      break;
+    }
+    started++;
+  }
+  scan.running = started;
+  if (started == 0 && threads > 0)
+  {
+    scan_fail(&scan, "Can't start worker threads");
+  }
+
+  for (;;)
+  {
+    cbson_scan_slot_t* slot = next_output(&scan);
+    bool written = true;
+
+    if (!slot)
+    {
+      break;
+    }
+    pthread_mutex_unlock(&scan.lock);
+
+    if (sink && slot->out_len > 0)
+    {
+      lua_pushvalue(L, sink);
+      lua_pushlstring(L, slot->out, slot->out_len);
+      sink_failed = lua_pcall(L, 1, 0, 0) != 0;
+    }
+    else if (!sink && slot->out_len > 0)
+    {
+      written = fwrite(slot->out, 1, slot->out_len, out) == slot->out_len;
+    }
+
+    pthread_mutex_lock(&scan.lock);
+    if (sink_failed)
+    {
+      scan_fail(&scan, "output function failed");
+    }
+    else if (!written)
+    {
+      scan_fail(&scan, "Can't write output");
+    }
+    slot->state = SLOT_FREE;
+    scan.emitted++;
+    pthread_cond_broadcast(&scan.work);
+  }
+  pthread_mutex_unlock(&scan.lock);
+
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(handles[i], NULL);
+  }
+
+  cbson_scan_active = 0;
+#ifdef CBSON_STATS
+  cbson_stats_enabled = stats_enabled;
+  if (stats_enabled && !scan.failed)
+  {
+    cbson_stats_data.documents += scan.documents;
+  }
+#endif
+
+  for (i = 0; scan.slots && i < scan.slot_count; i++)
+  {
+    free(scan.slots[i].out);
+  }
+  free(scan.slots);
+  free(workers);
+  free(handles);
+  pthread_cond_destroy(&scan.done);
+  pthread_cond_destroy(&scan.work);
+  pthread_mutex_destroy(&scan.lock);
+  munmap((void*)scan.data, scan.len);
+
+  if (output && fclose(out) != 0 && !scan.failed)
+  {
+    luaL_error(L, "Can't write output");
+  }
+  else if (!output)
+  {
+    fflush(out);
+  }
+
+  if (sink_failed)
+  {
+    lua_error(L); // error of output function is on top of the stack
+  }
+  else if (scan.failed)
+  {
+    luaL_error(L, "%s", scan.error);
+  }
+
+  lua_pushinteger(L, (lua_Integer)scan.documents);
+  return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef __CBSON_SCAN_H__
+#define __CBSON_SCAN_H__
+
+#include <lua.h>
+
+// documents are handed to workers in batches of about this many bytes
+#define CBSON_SCAN_BATCH_SIZE (1024 * 1024)
+
+// batches in flight (being processed or waiting for output) per worker
+#define CBSON_SCAN_BATCHES_PER_THREAD 4
+
+#define CBSON_SCAN_MAX_THREADS 64
+
+// non-zero while parallel_scan workers run: allocator and stats settings are process-wide
+// and must not change under them
+extern int cbson_scan_active;
+
+int cbson_parallel_scan(lua_State* L);
+
+#endif
@@ -0,0 +1,588 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "cbson.h"
+#include "cbson-util.h"
+#include "cbson-schema.h"
+#include "cbson-encode.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+#include "cbson-oid.h"
+#include "cbson-binary.h"
+#include "cbson-timestamp.h"
+#include "cbson-int.h"
+#include "cbson-uint.h"
+#include "cbson-date.h"
+#include "cbson-decimal.h"
+
+// bson_t has to be aligned, userdata memory is not
+#define BSON_T_ALIGN 128
+
+static const char* schema_type_names[] = {
+  "any", "double", "int32", "int64", "string", "bool", "oid", "date", "binary", "decimal", "timestamp",
+  "document", "array", NULL
+};
+
+DEFINE_CHECK(SCHEMA, schema)
+
+static int schema_node_add(lua_State *L, cbson_schema_t* s)
+{
+  cbson_schema_node_t* node;
+
+  if (s->count == s->size)
+  {
+    int size = s->size ? s->size * 2 : 16;
+    cbson_schema_node_t* nodes = realloc(s->nodes, size * sizeof(cbson_schema_node_t));
+
+    if (!nodes)
+    {
+      luaL_error(L, "Not enough memory to compile schema");
+    }
+
+    s->nodes = nodes;
+    s->size = size;
+  }
+
+  node = &s->nodes[s->count];
+  memset(node, 0, sizeof(cbson_schema_node_t));
+  node->key_index = 2 * s->count + 1;
+  node->child = -1;
+  node->next = -1;
+
+  return s->count++;
+}
+
+// path string on top of stack is anchored in keys table
+static void schema_set_path(lua_State *L, cbson_schema_t* s, int node, int keys)
+{
+  lua_rawseti(L, keys, s->nodes[node].key_index + 1);
+  lua_rawgeti(L, keys, s->nodes[node].key_index + 1);
+  s->nodes[node].path = lua_tostring(L, -1);
+  lua_pop(L, 1);
+}
+
+static int schema_compile_fields(lua_State *L, cbson_schema_t* s, int fields, int keys, int parent, int depth);
+
+// type at index is type name or table of fields of nested document
+static void schema_compile_type(lua_State *L, cbson_schema_t* s, int node, int index, int keys, int depth)
+{
+  if (lua_type(L, index) == LUA_TTABLE)
+  {
+    int child = schema_compile_fields(L, s, index, keys, node, depth + 1);
+
+    s->nodes[node].type = CBSON_SCHEMA_DOCUMENT;
+    s->nodes[node].child = child;
+  }
+  else if (lua_type(L, index) == LUA_TSTRING)
+  {
+    const char* name = lua_tostring(L, index);
+    int type;
+
+    for (type = 0; schema_type_names[type]; type++)
+    {
+      if (type != CBSON_SCHEMA_DOCUMENT && strcmp(schema_type_names[type], name) == 0)
+      {
+        break;
+      }
+    }
+
+    if (!schema_type_names[type])
+    {
+      luaL_error(L, "Field '%s' has unknown type '%s'", s->nodes[node].path, name);
+    }
+    s->nodes[node].type = type;
+  }
+  else
+  {
+    luaL_error(L, "Field '%s' has no type", s->nodes[node].path);
+  }
+}
+
+static int schema_compile_field(lua_State *L, cbson_schema_t* s, int spec, int keys, int parent, int first, int depth)
+{
+  size_t len;
+  const char* name;
+  int node, sibling;
+
+  lua_rawgeti(L, spec, 1);
+  name = lua_tolstring(L, -1, &len);
+  if (lua_type(L, -1) != LUA_TSTRING || len == 0 || strlen(name) != len)
+  {
+    luaL_error(L, "Invalid field name, expected non-empty string");
+  }
+
+  for (sibling = first; sibling >= 0; sibling = s->nodes[sibling].next)
+  {
+    if (s->nodes[sibling].key_len == (int)len && memcmp(s->nodes[sibling].key, name, len) == 0)
+    {
+      luaL_error(L, "Duplicate field '%s'", name);
+    }
+  }
+
+  node = schema_node_add(L, s);
+  s->nodes[node].key = name;
+  s->nodes[node].key_len = (int)len;
+
+  // key stays on stack for path, then is anchored
+  if (parent >= 0)
+  {
+    lua_pushstring(L, s->nodes[parent].path);
+    lua_pushliteral(L, ".");
+    lua_pushvalue(L, -3);
+    lua_concat(L, 3);
+  }
+  else
+  {
+    lua_pushvalue(L, -1);
+  }
+  schema_set_path(L, s, node, keys);
+  lua_rawseti(L, keys, s->nodes[node].key_index);
+
+  lua_getfield(L, spec, "optional");
+  s->nodes[node].optional = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, spec, 2);
+  schema_compile_type(L, s, node, lua_gettop(L), keys, depth);
+  lua_pop(L, 1);
+
+  lua_getfield(L, spec, "items");
+  if (!lua_isnil(L, -1))
+  {
+    int item;
+
+    if (s->nodes[node].type != CBSON_SCHEMA_ARRAY)
+    {
+      luaL_error(L, "Field '%s' is not an array, items are not allowed", s->nodes[node].path);
+    }
+
+    item = schema_node_add(L, s);
+    lua_pushstring(L, s->nodes[node].path);
+    lua_pushliteral(L, "[]");
+    lua_concat(L, 2);
+    schema_set_path(L, s, item, keys);
+
+    schema_compile_type(L, s, item, lua_gettop(L), keys, depth);
+    s->nodes[node].child = item;
+  }
+  lua_pop(L, 1);
+
+  return node;
+}
+
+// returns first field, fields are kept in schema order
+static int schema_compile_fields(lua_State *L, cbson_schema_t* s, int fields, int keys, int parent, int depth)
+{
+  int first = -1, last = -1;
+  int count, i;
+
+  if (depth >= BSON_MAX_RECURSION)
+  {
+    luaL_error(L, "Schema is too deep");
+  }
+
+  luaL_checkstack(L, LUA_MINSTACK, "schema is too deep");
+  count = (int)cbson_objlen(L, fields);
+
+  for (i = 1; i <= count; i++)
+  {
+    int node;
+
+    lua_rawgeti(L, fields, i);
+    if (lua_type(L, -1) != LUA_TTABLE)
+    {
+      luaL_error(L, "Invalid field %d, expected table", i);
+    }
+
+    node = schema_compile_field(L, s, lua_gettop(L), keys, parent, first, depth);
+    lua_pop(L, 1);
+
+    if (last >= 0)
+    {
+      s->nodes[last].next = node;
+    }
+    else
+    {
+      first = node;
+    }
+    last = node;
+  }
+
+  return first;
+}
+
+int cbson_compile_encoder(lua_State* L)
+{
+  cbson_schema_t* s;
+  uintptr_t mem;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+
+  s = lua_newuserdata(L, sizeof(cbson_schema_t) + sizeof(bson_t) + BSON_T_ALIGN - 1);
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_ENCODER);
+  memset(s, 0, sizeof(cbson_schema_t));
+  s->root = -1;
+  s->ref = LUA_NOREF;
+
+  mem = (uintptr_t)(s + 1);
+  s->bson = (bson_t*)((mem + BSON_T_ALIGN - 1) & ~(uintptr_t)(BSON_T_ALIGN - 1));
+  bson_init(s->bson);
+
+  luaL_getmetatable(L, SCHEMA_METATABLE);
+  lua_setmetatable(L, -2);
+
+  lua_newtable(L);
+  s->root = schema_compile_fields(L, s, 1, 3, -1, 0);
+  s->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  return 1;
+}
+
+static void schema_type_error(lua_State *L, const cbson_schema_node_t* node, int index)
+{
+  luaL_error(L, "Field '%s' expects %s, got %s", node->path, schema_type_names[node->type], luaL_typename(L, index));
+}
+
+// integral numbers and cbson.int/uint
+static bool schema_to_int64(lua_State *L, int index, int64_t* value)
+{
+  if (lua_type(L, index) == LUA_TNUMBER)
+  {
+    lua_Number n;
+
+#ifdef CBSON_NATIVE_INTEGERS
+    if (lua_isinteger(L, index))
+    {
+      *value = (int64_t)lua_tointeger(L, index);
+      return true;
+    }
+#endif
+
+    n = lua_tonumber(L, index);
+    if (n != floor(n) || n < -9223372036854775808.0 || n >= 9223372036854775808.0)
+    {
+      return false;
+    }
+    *value = (int64_t)n;
+    return true;
+  }
+
+  if (luaL_checkudata_ex(L, index, INT64_METATABLE) || luaL_checkudata_ex(L, index, UINT64_METATABLE))
+  {
+    *value = cbson_int64_check(L, index);
+    return true;
+  }
+
+  return false;
+}
+
+static void schema_encode_fields(lua_State *L, cbson_schema_t* s, int first, int index, int keys, bson_t* bson, int level);
+
+static void schema_encode_value(lua_State *L, cbson_schema_t* s, const cbson_schema_node_t* node, int index, int keys,
+  bson_t* bson, const char* key, int key_len, int level)
+{
+  int64_t i;
+
+  switch (node->type)
+  {
+    case CBSON_SCHEMA_DOUBLE:
+      if (lua_type(L, index) != LUA_TNUMBER)
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_double(bson, key, key_len, lua_tonumber(L, index));
+      break;
+
+    case CBSON_SCHEMA_INT32:
+      if (!schema_to_int64(L, index, &i) || i < INT32_MIN || i > INT32_MAX)
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_int32(bson, key, key_len, (int32_t)i);
+      break;
+
+    case CBSON_SCHEMA_INT64:
+      if (!schema_to_int64(L, index, &i))
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_int64(bson, key, key_len, i);
+      break;
+
+    case CBSON_SCHEMA_STRING:
+    {
+      size_t len;
+      const char* str;
+
+      if (lua_type(L, index) != LUA_TSTRING)
+      {
+        schema_type_error(L, node, index);
+      }
+      str = lua_tolstring(L, index, &len);
+      bson_append_utf8(bson, key, key_len, str, (int)len);
+      break;
+    }
+
+    case CBSON_SCHEMA_BOOL:
+      if (lua_type(L, index) != LUA_TBOOLEAN)
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_bool(bson, key, key_len, lua_toboolean(L, index));
+      break;
+
+    case CBSON_SCHEMA_OID:
+    {
+      bson_oid_t oid;
+      size_t len;
+
+      if (luaL_checkudata_ex(L, index, OID_METATABLE))
+      {
+        bson_oid_init_from_string(&oid, check_cbson_oid(L, index)->oid);
+      }
+      else if (lua_type(L, index) == LUA_TSTRING && (lua_tolstring(L, index, &len), len == 24) &&
+        bson_oid_is_valid(lua_tostring(L, index), len))
+      {
+        bson_oid_init_from_string(&oid, lua_tostring(L, index));
+      }
+      else
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_oid(bson, key, key_len, &oid);
+      break;
+    }
+
+    case CBSON_SCHEMA_DATE:
+      if (luaL_checkudata_ex(L, index, DATE_METATABLE))
+      {
+        i = cbson_date_check(L, index);
+      }
+      else if (!schema_to_int64(L, index, &i))
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_date_time(bson, key, key_len, i);
+      break;
+
+    case CBSON_SCHEMA_BINARY:
+      if (luaL_checkudata_ex(L, index, BINARY_METATABLE))
+      {
+        cbson_binary_t* bin = check_cbson_binary(L, index);
+
+        bson_append_binary(bson, key, key_len, bin->type, (const uint8_t*)bin->data, bin->size);
+      }
+      else if (lua_type(L, index) == LUA_TSTRING)
+      {
+        size_t len;
+        const char* data = lua_tolstring(L, index, &len);
+
+        bson_append_binary(bson, key, key_len, BSON_SUBTYPE_BINARY, (const uint8_t*)data, (uint32_t)len);
+      }
+      else
+      {
+        schema_type_error(L, node, index);
+      }
+      break;
+
+    case CBSON_SCHEMA_DECIMAL:
+      if (!luaL_checkudata_ex(L, index, DECIMAL_METATABLE))
+      {
+        schema_type_error(L, node, index);
+      }
+      bson_append_decimal128(bson, key, key_len, &check_cbson_decimal(L, index)->dec);
+      break;
+
+    case CBSON_SCHEMA_TIMESTAMP:
+    {
+      cbson_timestamp_t* time;
+
+      if (!luaL_checkudata_ex(L, index, TIMESTAMP_METATABLE))
+      {
+        schema_type_error(L, node, index);
+      }
+      time = check_cbson_timestamp(L, index);
+      bson_append_timestamp(bson, key, key_len, time->timestamp, time->increment);
+      break;
+    }
+
+    case CBSON_SCHEMA_DOCUMENT:
+    {
+      bson_t child;
+
+      if (lua_type(L, index) != LUA_TTABLE)
+      {
+        schema_type_error(L, node, index);
+      }
+      CBSON_STATS_DEPTH(level + 1);
+      bson_append_document_begin(bson, key, key_len, &child);
+      schema_encode_fields(L, s, node->child, index, keys, &child, level + 1);
+      bson_append_document_end(bson, &child);
+      break;
+    }
+
+    case CBSON_SCHEMA_ARRAY:
+    {
+      bson_t child;
+      int count, n;
+
+      if (lua_type(L, index) != LUA_TTABLE)
+      {
+        schema_type_error(L, node, index);
+      }
+      if (level + 1 >= BSON_MAX_RECURSION)
+      {
+        luaL_error(L, "Field '%s' is too deep", node->path);
+      }
+
+      luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
+      CBSON_STATS_DEPTH(level + 1);
+      bson_append_array_begin(bson, key, key_len, &child);
+
+      count = (int)cbson_objlen(L, index);
+      for (n = 0; n < count; n++)
+      {
+        char buf[16];
+        const char* item_key;
+        size_t item_len = bson_uint32_to_string((uint32_t)n, &item_key, buf, sizeof(buf));
+
+        lua_rawgeti(L, index, n + 1);
+        if (node->child >= 0)
+        {
+          schema_encode_value(L, s, &s->nodes[node->child], lua_gettop(L), keys, &child, item_key, (int)item_len,
+            level + 1);
+        }
+        else
+        {
+          switch_value(L, lua_gettop(L), &child, level + 1, item_key);
+        }
+        lua_pop(L, 1);
+      }
+
+      bson_append_array_end(bson, &child);
+      break;
+    }
+
+    default:
+      switch_value(L, index, bson, level, key);
+      break;
+  }
+}
+
+static void schema_encode_fields(lua_State *L, cbson_schema_t* s, int first, int index, int keys, bson_t* bson, int level)
+{
+  int node;
+
+  luaL_checkstack(L, LUA_MINSTACK, "table is too deep");
+
+  for (node = first; node >= 0; node = s->nodes[node].next)
+  {
+    const cbson_schema_node_t* n = &s->nodes[node];
+
+    lua_rawgeti(L, keys, n->key_index);
+    lua_rawget(L, index);
+
+    if (lua_isnil(L, -1))
+    {
+      if (!n->optional)
+      {
+        luaL_error(L, "Field '%s' is missing", n->path);
+      }
+    }
+    else
+    {
+      schema_encode_value(L, s, n, lua_gettop(L), keys, bson, n->key, n->key_len, level);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+static int schema_encode_call(lua_State* L)
+{
+  cbson_schema_t* s = check_cbson_schema(L, 1);
+  CBSON_STATS_BEGIN();
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->ref);
+
+  // failed encode may leave buffer inside unfinished child document
+  if (s->dirty)
+  {
+    bson_destroy(s->bson);
+    bson_init(s->bson);
+  }
+  else
+  {
+    bson_reinit(s->bson);
+  }
+
+  s->dirty = true;
+  schema_encode_fields(L, s, s->root, 2, 3, s->bson, 0);
+  s->dirty = false;
+
+  lua_pushlstring(L, (const char*)bson_get_data(s->bson), s->bson->len);
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_SCHEMA_ENCODE, 0, s->bson->len);
+  return 1;
+}
+
+// output buffer is kept by encoder, it can't come from arena
+int cbson_schema_encode(lua_State* L)
+{
+  return cbson_persistent_call(L, schema_encode_call);
+}
+
+int cbson_schema_destroy(lua_State* L)
+{
+  cbson_schema_t* s = check_cbson_schema(L, 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+  s->ref = LUA_NOREF;
+
+  free(s->nodes);
+  s->nodes = NULL;
+  s->count = 0;
+  s->size = 0;
+  s->root = -1;
+
+  if (s->bson)
+  {
+    bson_destroy(s->bson);
+    s->bson = NULL;
+  }
+
+  return 0;
+}
+
+int cbson_schema_tostring(lua_State* L)
+{
+  cbson_schema_t* s = check_cbson_schema(L, 1);
+  int count = 0;
+  int node;
+
+  for (node = s->root; node >= 0; node = s->nodes[node].next)
+  {
+    count++;
+  }
+
+  lua_pushfstring(L, "schema encoder (%d fields)", count);
+  return 1;
+}
+
+const struct luaL_Reg cbson_schema_meta[] = {
+  {"__tostring", cbson_schema_tostring},
+  {"__gc",       cbson_schema_destroy},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_schema_methods[] = {
+  {"encode", cbson_schema_encode},
+  {NULL, NULL}
+};
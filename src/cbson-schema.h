@@ -0,0 +1,55 @@
+#ifndef __CBSON_SCHEMA_H__
+#define __CBSON_SCHEMA_H__
+
+#include <lua.h>
+#include <bson.h>
+#include <stdbool.h>
+
+#define SCHEMA_METATABLE "bson-schema metatable"
+
+enum {
+  CBSON_SCHEMA_ANY,
+  CBSON_SCHEMA_DOUBLE,
+  CBSON_SCHEMA_INT32,
+  CBSON_SCHEMA_INT64,
+  CBSON_SCHEMA_STRING,
+  CBSON_SCHEMA_BOOL,
+  CBSON_SCHEMA_OID,
+  CBSON_SCHEMA_DATE,
+  CBSON_SCHEMA_BINARY,
+  CBSON_SCHEMA_DECIMAL,
+  CBSON_SCHEMA_TIMESTAMP,
+  CBSON_SCHEMA_DOCUMENT,
+  CBSON_SCHEMA_ARRAY
+};
+
+// Field of compiled schema. Key and path point into lua strings anchored in keys table,
+// key is at index key_index there and path right after it.
+typedef struct {
+  int type;
+  bool optional;
+  const char* key;
+  int key_len;
+  int key_index;
+  const char* path;
+  int child;         // first field of document, item of array, -1 if none
+  int next;          // next field, -1 if none
+} cbson_schema_node_t;
+
+typedef struct {
+  cbson_schema_node_t* nodes;
+  int count;
+  int size;
+  int root;          // first top level field, -1 for empty schema
+  int ref;           // keys table in registry
+  bool dirty;        // encoding was interrupted by error, buffer has to be recreated
+  bson_t* bson;      // reused output buffer, lives in userdata right after the struct
+} cbson_schema_t;
+
+int cbson_compile_encoder(lua_State* L);
+cbson_schema_t* check_cbson_schema(lua_State *L, int index);
+
+extern const struct luaL_Reg cbson_schema_meta[];
+extern const struct luaL_Reg cbson_schema_methods[];
+
+#endif
@@ -0,0 +1,132 @@
+#include <lauxlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cbson-stats.h"
+#include "cbson-scan.h"
+
+#ifdef CBSON_STATS
+
+static const char* entry_names[CBSON_STAT_ENTRY_COUNT] = {
+  "encode", "encode_first", "decode", "to_json", "to_relaxed_json", "from_json",
+  "filter_match", "compare", "sort", "hash", "equal", "diff", "merge", "concat", "size",
+  "encode_ordered", "columns", "schema_encode", "template_render", "decode_into", "decoder_decode", "offload_wait"
+};
+
+static const char* userdata_names[CBSON_STAT_UD_COUNT] = {
+  "oid", "regex", "binary", "symbol", "code", "codewscope", "undefined", "null", "array",
+  "minkey", "maxkey", "ref", "timestamp", "int", "uint", "date", "decimal", "filter", "decoder", "job", "encoder",
+  "placeholder", "template"
+};
+
+int cbson_stats_enabled = 1;
+cbson_stats_t cbson_stats_data;
+
+uint64_t cbson_stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void cbson_stats_record(cbson_stat_entry_t entry, uint64_t start, size_t bytes_in, size_t bytes_out)
+{
+  cbson_stat_counter_t* counter = &cbson_stats_data.entries[entry];
+
+  counter->calls++;
+  counter->bytes_in += bytes_in;
+  counter->bytes_out += bytes_out;
+  counter->ns += cbson_stats_now() - start;
+}
+
+static void set_counter(lua_State* L, const char* name, uint64_t value)
+{
+  // integers keep ns exact past 2^53 where they exist
+#if LUA_VERSION_NUM >= 503
+  lua_pushinteger(L, (lua_Integer)value);
+#else
+  lua_pushnumber(L, (lua_Number)value);
+#endif
+  lua_setfield(L, -2, name);
+}
+
+int cbson_stats(lua_State* L)
+{
+  int i;
+
+  lua_newtable(L);
+
+  lua_pushboolean(L, cbson_stats_enabled);
+  lua_setfield(L, -2, "enabled");
+
+  set_counter(L, "documents", cbson_stats_data.documents);
+  set_counter(L, "max_depth", cbson_stats_data.max_depth);
+
+  for (i = 0; i < CBSON_STAT_ENTRY_COUNT; i++)
+  {
+    cbson_stat_counter_t* counter = &cbson_stats_data.entries[i];
+
+    lua_createtable(L, 0, 4);
+    set_counter(L, "calls", counter->calls);
+    set_counter(L, "bytes_in", counter->bytes_in);
+    set_counter(L, "bytes_out", counter->bytes_out);
+    set_counter(L, "ns", counter->ns);
+    lua_setfield(L, -2, entry_names[i]);
+  }
+
+  lua_createtable(L, 0, CBSON_STAT_UD_COUNT);
+  for (i = 0; i < CBSON_STAT_UD_COUNT; i++)
+  {
+    set_counter(L, userdata_names[i], cbson_stats_data.userdata[i]);
+  }
+  lua_setfield(L, -2, "userdata");
+
+  return 1;
+}
+
+int cbson_stats_reset(lua_State* L)
+{
+  memset(&cbson_stats_data, 0, sizeof(cbson_stats_data));
+  return 0;
+}
+
+int cbson_stats_enable(lua_State* L)
+{
+  luaL_checkany(L, 1);
+
+  if (cbson_scan_active)
+  {
+    luaL_error(L, "Can't change stats while parallel_scan is running");
+  }
+  cbson_stats_enabled = lua_toboolean(L, 1);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+#else
+
+int cbson_stats(lua_State* L)
+{
+  lua_newtable(L);
+
+  lua_pushboolean(L, 0);
+  lua_setfield(L, -2, "enabled");
+
+  return 1;
+}
+
+int cbson_stats_reset(lua_State* L)
+{
+  return 0;
+}
+
+// counters are compiled out, report that they can't be enabled
+int cbson_stats_enable(lua_State* L)
+{
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
+#endif
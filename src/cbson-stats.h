@@ -0,0 +1,113 @@
+#ifndef __CBSON_STATS_H__
+#define __CBSON_STATS_H__
+
+#include <lua.h>
+#include <stdint.h>
+
+// entry points with call/bytes/time counters
+typedef enum {
+  CBSON_STAT_ENCODE = 0,
+  CBSON_STAT_ENCODE_FIRST,
+  CBSON_STAT_DECODE,
+  CBSON_STAT_TO_JSON,
+  CBSON_STAT_TO_RELAXED_JSON,
+  CBSON_STAT_FROM_JSON,
+  CBSON_STAT_FILTER_MATCH,
+  CBSON_STAT_COMPARE,
+  CBSON_STAT_SORT,
+  CBSON_STAT_HASH,
+  CBSON_STAT_EQUAL,
+  CBSON_STAT_DIFF,
+  CBSON_STAT_MERGE,
+  CBSON_STAT_CONCAT,
+  CBSON_STAT_SIZE,
+  CBSON_STAT_ENCODE_ORDERED,
+  CBSON_STAT_COLUMNS,
+  CBSON_STAT_SCHEMA_ENCODE,
+  CBSON_STAT_TEMPLATE_RENDER,
+  CBSON_STAT_DECODE_INTO,
+  CBSON_STAT_DECODER_DECODE,
+  CBSON_STAT_OFFLOAD_WAIT,
+  CBSON_STAT_ENTRY_COUNT
+} cbson_stat_entry_t;
+
+// userdata types counted on creation
+typedef enum {
+  CBSON_STAT_UD_OID = 0,
+  CBSON_STAT_UD_REGEX,
+  CBSON_STAT_UD_BINARY,
+  CBSON_STAT_UD_SYMBOL,
+  CBSON_STAT_UD_CODE,
+  CBSON_STAT_UD_CODEWSCOPE,
+  CBSON_STAT_UD_UNDEFINED,
+  CBSON_STAT_UD_NULL,
+  CBSON_STAT_UD_ARRAY,
+  CBSON_STAT_UD_MINKEY,
+  CBSON_STAT_UD_MAXKEY,
+  CBSON_STAT_UD_REF,
+  CBSON_STAT_UD_TIMESTAMP,
+  CBSON_STAT_UD_INT,
+  CBSON_STAT_UD_UINT,
+  CBSON_STAT_UD_DATE,
+  CBSON_STAT_UD_DECIMAL,
+  CBSON_STAT_UD_FILTER,
+  CBSON_STAT_UD_DECODER,
+  CBSON_STAT_UD_JOB,
+  CBSON_STAT_UD_ENCODER,
+  CBSON_STAT_UD_PLACEHOLDER,
+  CBSON_STAT_UD_TEMPLATE,
+  CBSON_STAT_UD_COUNT
+} cbson_stat_userdata_t;
+
+int cbson_stats(lua_State* L);
+int cbson_stats_reset(lua_State* L);
+int cbson_stats_enable(lua_State* L);
+
+#ifdef CBSON_STATS
+
+typedef struct {
+  uint64_t calls;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t ns;
+} cbson_stat_counter_t;
+
+typedef struct {
+  cbson_stat_counter_t entries[CBSON_STAT_ENTRY_COUNT];
+  uint64_t userdata[CBSON_STAT_UD_COUNT];
+  uint64_t documents;
+  uint32_t max_depth;
+} cbson_stats_t;
+
+extern int cbson_stats_enabled;
+extern cbson_stats_t cbson_stats_data;
+
+uint64_t cbson_stats_now(void);
+void cbson_stats_record(cbson_stat_entry_t entry, uint64_t start, size_t bytes_in, size_t bytes_out);
+
+#define CBSON_STATS_BEGIN() \
+  uint64_t cbson_stats_start_ = cbson_stats_enabled ? cbson_stats_now() : 0
+
+#define CBSON_STATS_END(entry, bytes_in, bytes_out) \
+  do { if (cbson_stats_start_) cbson_stats_record(entry, cbson_stats_start_, bytes_in, bytes_out); } while (0)
+
+#define CBSON_STATS_DOCUMENTS(count) \
+  do { if (cbson_stats_enabled) cbson_stats_data.documents += (count); } while (0)
+
+#define CBSON_STATS_DEPTH(depth) \
+  do { if (cbson_stats_enabled && (uint32_t)(depth) > cbson_stats_data.max_depth) cbson_stats_data.max_depth = (depth); } while (0)
+
+#define CBSON_STATS_USERDATA(type) \
+  do { if (cbson_stats_enabled) cbson_stats_data.userdata[type]++; } while (0)
+
+#else
+
+#define CBSON_STATS_BEGIN()
+#define CBSON_STATS_END(entry, bytes_in, bytes_out) do {} while (0)
+#define CBSON_STATS_DOCUMENTS(count) do {} while (0)
+#define CBSON_STATS_DEPTH(depth) do {} while (0)
+#define CBSON_STATS_USERDATA(type) do {} while (0)
+
+#endif
+
+#endif
@@ -4,12 +4,14 @@
 
 #include "cbson.h"
 #include "cbson-symbol.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(SYMBOL, symbol)
 
 int cbson_symbol_create(lua_State* L, const char* symbol)
 {
   cbson_symbol_t* ud = lua_newuserdata(L, sizeof(cbson_symbol_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_SYMBOL);
 
   ud->symbol = malloc(strlen(symbol)+1);
   strcpy(ud->symbol, symbol);
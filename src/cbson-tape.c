@@ -0,0 +1,170 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cbson.h"
+#include "cbson-offload.h"
+#include "cbson-decode.h"
+#include "cbson-stats.h"
+
+static cbson_tape_entry_t* tape_push(cbson_tape_t* tape, uint32_t type)
+{
+  cbson_tape_entry_t* entry;
+
+  if (tape->count == tape->size)
+  {
+    size_t size = tape->size ? tape->size * 2 : 64;
+    cbson_tape_entry_t* entries = realloc(tape->entries, size * sizeof(cbson_tape_entry_t));
+
+    if (!entries)
+    {
+      tape->failed = true;
+      return NULL;
+    }
+    tape->entries = entries;
+    tape->size = size;
+  }
+
+  entry = &tape->entries[tape->count++];
+  entry->type = type;
+  return entry;
+}
+
+// Appends elements of document and CBSON_TAPE_END, stops at corrupt element like decode_document.
+// Returns number of elements.
+static uint32_t tape_document(const uint8_t* base, const uint8_t* data, uint32_t len, uint32_t depth, cbson_tape_t* tape)
+{
+  const uint8_t* limit = data + len - 1;
+  const uint8_t* p = data + 4;
+  uint32_t count = 0;
+
+  while (p < limit)
+  {
+    uint8_t type = *p++;
+    const uint8_t* key = p;
+    const uint8_t* key_end = memchr(key, 0, limit - key);
+    const uint8_t* value;
+    const uint8_t* next;
+    cbson_tape_entry_t* entry;
+    uint32_t sublen;
+
+    if (!key_end || !cbson_valid_utf8(key, key_end - key))
+    {
+      break;
+    }
+
+    value = key_end + 1;
+    if (type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY)
+    {
+      if (!cbson_check_subdocument(value, limit, &sublen)) break;
+      next = value + sublen;
+    }
+    else if (!(next = cbson_skip_value(type, value, limit)))
+    {
+      break;
+    }
+
+    if (!(entry = tape_push(tape, type)))
+    {
+      return count;
+    }
+    entry->key = key - base;
+    entry->key_len = key_end - key;
+    entry->value = value - base;
+
+    if (type == BSON_TYPE_DOCUMENT || type == BSON_TYPE_ARRAY)
+    {
+      if (depth >= BSON_MAX_RECURSION)
+      {
+        entry->type = CBSON_TAPE_ELLIPSIS;
+      }
+      else
+      {
+        // entry may move while nested elements are appended, container keeps its element count in value
+        size_t index = tape->count - 1;
+        uint32_t n = tape_document(base, value, sublen, depth + 1, tape);
+        tape->entries[index].value = n;
+      }
+    }
+
+    count++;
+    p = next;
+  }
+
+  tape_push(tape, CBSON_TAPE_END);
+  return count;
+}
+
+// len is checked by caller
+void cbson_tape_build(const uint8_t* data, uint32_t len, cbson_tape_t* tape)
+{
+  uint32_t n = tape_document(data, data, len, 0, tape);
+
+  // root entry is last, it only holds number of elements
+  cbson_tape_entry_t* root = tape_push(tape, BSON_TYPE_DOCUMENT);
+  if (root)
+  {
+    root->value = n;
+  }
+}
+
+// pushes table from entries starting at i, returns index of its CBSON_TAPE_END
+static size_t tape_table(lua_State* L, const uint8_t* data, const cbson_tape_entry_t* e, size_t i, uint32_t n, uint32_t depth, bool keys)
+{
+  int count = 0;
+
+  luaL_checkstack(L, LUA_MINSTACK, "document is too deep");
+  CBSON_STATS_DEPTH(depth);
+
+  if (keys)
+  {
+    lua_createtable(L, 0, n);
+  }
+  else
+  {
+    lua_createtable(L, n, 0);
+    luaL_getmetatable(L, CBSON_ARRAY_MT);
+    lua_setmetatable(L, -2);
+  }
+
+  for (; e[i].type != CBSON_TAPE_END; i++)
+  {
+    if (keys)
+    {
+      lua_pushlstring(L, (const char*)data + e[i].key, e[i].key_len);
+    }
+
+    switch (e[i].type)
+    {
+      case BSON_TYPE_DOCUMENT:
+      case BSON_TYPE_ARRAY:
+        i = tape_table(L, data, e, i + 1, e[i].value, depth + 1, e[i].type == BSON_TYPE_DOCUMENT);
+        break;
+      case CBSON_TAPE_ELLIPSIS:
+        lua_pushlstring(L, "...", 3);
+        break;
+      default:
+        cbson_push_value(L, e[i].type, data + e[i].value);
+        break;
+    }
+
+    if (keys)
+    {
+      lua_rawset(L, -3);
+    }
+    else
+    {
+      lua_rawseti(L, -2, ++count);
+    }
+  }
+
+  return i;
+}
+
+// pushes decoded table, tape must be built from data
+void cbson_tape_materialize(lua_State* L, const uint8_t* data, const cbson_tape_t* tape)
+{
+  tape_table(L, data, tape->entries, 0, tape->entries[tape->count - 1].value, 0, true);
+}
@@ -0,0 +1,350 @@
+#include <lua.h>
+#include <lauxlib.h>
+#include <bson.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cbson.h"
+#include "cbson-template.h"
+#include "cbson-encode.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
+
+// encoded template bytes are stored right after the struct
+#define TEMPLATE_DATA(t) ((uint8_t*)((t) + 1))
+
+// PLACEHOLDER
+
+DEFINE_CHECK(PLACEHOLDER, placeholder)
+
+int cbson_placeholder_new(lua_State* L)
+{
+  int index = (int)luaL_checkinteger(L, 1);
+  cbson_placeholder_t* ph;
+
+  luaL_argcheck(L, index >= 1, 1, "placeholder index has to be positive");
+
+  ph = lua_newuserdata(L, sizeof(cbson_placeholder_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_PLACEHOLDER);
+  ph->index = index;
+
+  luaL_getmetatable(L, PLACEHOLDER_METATABLE);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+void cbson_placeholder_append(bson_t* bson, const char* key, int index)
+{
+  uint8_t payload[CBSON_PLACEHOLDER_SIZE];
+
+  memcpy(payload, CBSON_PLACEHOLDER_MAGIC, 8);
+  payload[8] = (uint8_t)index;
+  payload[9] = (uint8_t)(index >> 8);
+  payload[10] = (uint8_t)(index >> 16);
+  payload[11] = (uint8_t)(index >> 24);
+
+  BSON_APPEND_BINARY(bson, key, CBSON_PLACEHOLDER_SUBTYPE, payload, CBSON_PLACEHOLDER_SIZE);
+}
+
+int cbson_placeholder_tostring(lua_State* L)
+{
+  cbson_placeholder_t* ph = check_cbson_placeholder(L, 1);
+
+  lua_pushfstring(L, "placeholder(%d)", ph->index);
+  return 1;
+}
+
+const struct luaL_Reg cbson_placeholder_meta[] = {
+  {"__tostring", cbson_placeholder_tostring},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_placeholder_methods[] = {
+  {NULL, NULL}
+};
+
+// TEMPLATE
+
+DEFINE_CHECK(TEMPLATE, template)
+
+static void template_add_slot(lua_State* L, cbson_template_t* t, int index, int level, uint32_t start, uint32_t end)
+{
+  if (t->slot_count == t->slot_size)
+  {
+    int size = t->slot_size ? t->slot_size * 2 : 8;
+    cbson_template_slot_t* slots = realloc(t->slots, size * sizeof(cbson_template_slot_t));
+
+    if (!slots)
+    {
+      luaL_error(L, "Not enough memory to compile template");
+    }
+
+    t->slots = slots;
+    t->slot_size = size;
+  }
+
+  t->slots[t->slot_count].index = index;
+  t->slots[t->slot_count].level = level;
+  t->slots[t->slot_count].start = start;
+  t->slots[t->slot_count].end = end;
+  t->slot_count++;
+}
+
+static void template_add_doc(lua_State* L, cbson_template_t* t, uint32_t offset, uint32_t len)
+{
+  if (t->doc_count == t->doc_size)
+  {
+    int size = t->doc_size ? t->doc_size * 2 : 8;
+    cbson_template_doc_t* docs = realloc(t->docs, size * sizeof(cbson_template_doc_t));
+
+    if (!docs)
+    {
+      luaL_error(L, "Not enough memory to compile template");
+    }
+
+    t->docs = docs;
+    t->doc_size = size;
+  }
+
+  t->docs[t->doc_count].offset = offset;
+  t->docs[t->doc_count].len = len;
+  t->doc_count++;
+}
+
+// records placeholders of document in byte order, returns their number
+static int template_scan(lua_State* L, cbson_template_t* t, const uint8_t* doc, uint32_t len, int level)
+{
+  const uint8_t* base = TEMPLATE_DATA(t);
+  bson_t bson;
+  bson_iter_t iter;
+  int found = 0;
+
+  if (!bson_init_static(&bson, doc, len) || !bson_iter_init(&iter, &bson))
+  {
+    luaL_error(L, "Can't init bson iterator.");
+  }
+
+  while (bson_iter_next(&iter))
+  {
+    const uint8_t* data;
+    uint32_t data_len;
+    bson_subtype_t subtype;
+
+    switch (bson_iter_type(&iter))
+    {
+      case BSON_TYPE_BINARY:
+        bson_iter_binary(&iter, &subtype, &data_len, &data);
+        if (subtype == CBSON_PLACEHOLDER_SUBTYPE && data_len == CBSON_PLACEHOLDER_SIZE &&
+          memcmp(data, CBSON_PLACEHOLDER_MAGIC, 8) == 0)
+        {
+          int index = (int)((uint32_t)data[8] | (uint32_t)data[9] << 8 | (uint32_t)data[10] << 16 |
+            (uint32_t)data[11] << 24);
+
+          template_add_slot(L, t, index, level, (uint32_t)((const uint8_t*)bson_iter_key(&iter) - 1 - base),
+            (uint32_t)(data + data_len - base));
+          found++;
+        }
+        break;
+
+      case BSON_TYPE_DOCUMENT:
+      case BSON_TYPE_ARRAY:
+      {
+        int inner;
+
+        if (bson_iter_type(&iter) == BSON_TYPE_DOCUMENT)
+        {
+          bson_iter_document(&iter, &data_len, &data);
+        }
+        else
+        {
+          bson_iter_array(&iter, &data_len, &data);
+        }
+
+        inner = template_scan(L, t, data, data_len, level + 1);
+        if (inner)
+        {
+          template_add_doc(L, t, (uint32_t)(data - base), data_len);
+          found += inner;
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  return found;
+}
+
+static int template_new_call(lua_State* L)
+{
+  bson_t bson;
+  cbson_template_t* t;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  cbson_check_template(L, 1, &bson);
+
+  t = lua_newuserdata(L, sizeof(cbson_template_t) + bson.len);
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_TEMPLATE);
+  memset(t, 0, sizeof(cbson_template_t));
+  t->len = bson.len;
+  memcpy(TEMPLATE_DATA(t), bson_get_data(&bson), bson.len);
+  bson_destroy(&bson);
+
+  luaL_getmetatable(L, TEMPLATE_METATABLE);
+  lua_setmetatable(L, -2);
+
+  if (template_scan(L, t, TEMPLATE_DATA(t), t->len, 0))
+  {
+    template_add_doc(L, t, 0, t->len);
+  }
+
+  return 1;
+}
+
+int cbson_template_new(lua_State* L)
+{
+  return cbson_arena_call(L, template_new_call);
+}
+
+static void write_uint32(uint8_t* p, uint32_t value)
+{
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+  p[2] = (uint8_t)(value >> 16);
+  p[3] = (uint8_t)(value >> 24);
+}
+
+// tpl:render(...) - placeholder n is replaced by n-th argument encoded as by encode, missing ones are null
+static int template_render_call(lua_State* L)
+{
+  bson_t* values = cbson_encode_ctx(L)->out;
+  cbson_template_t* t = check_cbson_template(L, 1);
+  const uint8_t* tpl = TEMPLATE_DATA(t);
+  int args = lua_gettop(L) - 2;
+  const uint8_t* encoded;
+  uint8_t* out;
+  int64_t total = t->len;
+  uint32_t src = 0, dst = 0;
+  uint32_t* spans;
+  int i, j;
+  CBSON_STATS_BEGIN();
+
+  // encoded element of slot i is spans[2i]..spans[2i + 1] of values, collected with the call on error
+  spans = (uint32_t*)lua_newuserdata(L, 2 * sizeof(uint32_t) * (t->slot_count ? t->slot_count : 1));
+  luaL_checkstack(L, LUA_MINSTACK, "too many arguments");
+
+  for (i = 0; i < t->slot_count; i++)
+  {
+    const cbson_template_slot_t* slot = &t->slots[i];
+
+    if (slot->index <= args)
+    {
+      lua_pushvalue(L, slot->index + 1);
+    }
+    else
+    {
+      lua_pushnil(L);
+    }
+
+    spans[2 * i] = values->len - 1;
+    switch_value(L, lua_gettop(L), values, slot->level, (const char*)tpl + slot->start + 1);
+    spans[2 * i + 1] = values->len - 1;
+    lua_pop(L, 1);
+
+    total += (int64_t)(spans[2 * i + 1] - spans[2 * i]) - (int64_t)(slot->end - slot->start);
+  }
+
+  if (total > INT32_MAX)
+  {
+    return luaL_error(L, "Rendered document is too large");
+  }
+
+  out = (uint8_t*)bson_malloc((size_t)total);
+  encoded = bson_get_data(values);
+
+  // static parts are copied as they are, placeholders are replaced by encoded elements
+  for (i = 0; i < t->slot_count; i++)
+  {
+    const cbson_template_slot_t* slot = &t->slots[i];
+    uint32_t size = spans[2 * i + 1] - spans[2 * i];
+
+    memcpy(out + dst, tpl + src, slot->start - src);
+    dst += slot->start - src;
+    memcpy(out + dst, encoded + spans[2 * i], size);
+    dst += size;
+    src = slot->end;
+  }
+  memcpy(out + dst, tpl + src, t->len - src);
+
+  // documents holding placeholders get new lengths, at positions moved by preceding replacements
+  for (j = 0; j < t->doc_count; j++)
+  {
+    const cbson_template_doc_t* doc = &t->docs[j];
+    int64_t shift = 0, grow = 0;
+
+    for (i = 0; i < t->slot_count; i++)
+    {
+      const cbson_template_slot_t* slot = &t->slots[i];
+      int64_t delta = (int64_t)(spans[2 * i + 1] - spans[2 * i]) - (int64_t)(slot->end - slot->start);
+
+      if (slot->end <= doc->offset)
+      {
+        shift += delta;
+      }
+      else if (slot->start >= doc->offset && slot->end <= doc->offset + doc->len)
+      {
+        grow += delta;
+      }
+    }
+
+    write_uint32(out + doc->offset + shift, (uint32_t)(doc->len + grow));
+  }
+
+  lua_pushlstring(L, (const char*)out, (size_t)total);
+  bson_free(out);
+
+  CBSON_STATS_DOCUMENTS(1);
+  CBSON_STATS_END(CBSON_STAT_TEMPLATE_RENDER, 0, (size_t)total);
+  return 1;
+}
+
+int cbson_template_render(lua_State* L)
+{
+  return cbson_encode_protected(L, template_render_call);
+}
+
+int cbson_template_destroy(lua_State* L)
+{
+  cbson_template_t* t = check_cbson_template(L, 1);
+
+  free(t->slots);
+  free(t->docs);
+  t->slots = NULL;
+  t->docs = NULL;
+  t->slot_count = t->slot_size = 0;
+  t->doc_count = t->doc_size = 0;
+
+  return 0;
+}
+
+int cbson_template_tostring(lua_State* L)
+{
+  cbson_template_t* t = check_cbson_template(L, 1);
+
+  lua_pushfstring(L, "template (%d placeholders)", t->slot_count);
+  return 1;
+}
+
+const struct luaL_Reg cbson_template_meta[] = {
+  {"__tostring", cbson_template_tostring},
+  {"__gc",       cbson_template_destroy},
+  {NULL, NULL}
+};
+
+const struct luaL_Reg cbson_template_methods[] = {
+  {"render", cbson_template_render},
+  {NULL, NULL}
+};
@@ -0,0 +1,56 @@
+#ifndef __CBSON_TEMPLATE_H__
+#define __CBSON_TEMPLATE_H__
+
+#include <lua.h>
+#include <bson.h>
+#include <stdint.h>
+
+#define PLACEHOLDER_METATABLE "bson-placeholder metatable"
+#define TEMPLATE_METATABLE    "bson-template metatable"
+
+// placeholders are encoded as binary of user defined subtype with magic payload, then found in encoded template
+#define CBSON_PLACEHOLDER_SUBTYPE 0xC5
+#define CBSON_PLACEHOLDER_MAGIC   "cbson-ph"
+#define CBSON_PLACEHOLDER_SIZE    12  // magic + int32 index
+
+typedef struct {
+  int index;
+} cbson_placeholder_t;
+
+// placeholder element spans [start, end) of template bytes, its key is at start + 1
+typedef struct {
+  int index;
+  int level;
+  uint32_t start;
+  uint32_t end;
+} cbson_template_slot_t;
+
+// document or array containing placeholders, its length header is patched on render
+typedef struct {
+  uint32_t offset;
+  uint32_t len;
+} cbson_template_doc_t;
+
+typedef struct {
+  cbson_template_slot_t* slots;
+  int slot_count;
+  int slot_size;
+  cbson_template_doc_t* docs;
+  int doc_count;
+  int doc_size;
+  uint32_t len;
+} cbson_template_t;
+
+int cbson_placeholder_new(lua_State* L);
+cbson_placeholder_t* check_cbson_placeholder(lua_State *L, int index);
+void cbson_placeholder_append(bson_t* bson, const char* key, int index);
+
+int cbson_template_new(lua_State* L);
+cbson_template_t* check_cbson_template(lua_State *L, int index);
+
+extern const struct luaL_Reg cbson_placeholder_meta[];
+extern const struct luaL_Reg cbson_placeholder_methods[];
+extern const struct luaL_Reg cbson_template_meta[];
+extern const struct luaL_Reg cbson_template_methods[];
+
+#endif
@@ -2,13 +2,16 @@
 #include <inttypes.h>
 
 #include "cbson.h"
+#include "cbson-util.h"
 #include "cbson-timestamp.h"
+#include "cbson-stats.h"
 
 DEFINE_CHECK(TIMESTAMP, timestamp)
 
 int cbson_timestamp_create(lua_State* L, uint32_t timestamp, uint32_t increment)
 {
   cbson_timestamp_t* ud = lua_newuserdata(L, sizeof(cbson_timestamp_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_TIMESTAMP);
 
   ud->timestamp = timestamp;
   ud->increment = increment;
@@ -7,6 +7,7 @@
 #include "cbson-int.h"
 #include "cbson-date.h"
 #include "cbson-util.h"
+#include "cbson-stats.h"
 #include "intpow.h"
 
 enum {
@@ -20,13 +21,16 @@ uint64_t cbson_uint64_check(lua_State *L, int index)
   {
     return *(uint64_t*)lua_touserdata(L, index);
   }
-  else if (lua_isnumber(L, index))
+  else if (lua_type(L, index) == LUA_TNUMBER)
   {
-    return lua_tonumber(L, index);
+    return (uint64_t)cbson_toint64(L, index);
   }
   else if (lua_isstring(L, index))
   {
-    return strtoull(lua_tostring(L, index), NULL, 10);
+    // decimal strings are parsed as is to keep all 64 bits, anything else ("1e3", "0x10") is converted by lua
+    char* end;
+    uint64_t value = strtoull(lua_tostring(L, index), &end, 10);
+    return *end == '\0' ? value : (uint64_t)cbson_toint64(L, index);
   }
   else
   {
@@ -39,6 +43,7 @@ uint64_t cbson_uint64_check(lua_State *L, int index)
 int cbson_uint64_create(lua_State* L, uint64_t val)
 {
   cbson_uint64_t* ud = lua_newuserdata(L, sizeof(cbson_uint64_t));
+  CBSON_STATS_USERDATA(CBSON_STAT_UD_UINT);
 
   *ud = val;
 
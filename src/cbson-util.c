@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 #include "cbson-util.h"
 
 int luaL_checkudata_ex(lua_State *L, int ud, const char *tname)
@@ -20,3 +22,24 @@ int luaL_checkudata_ex(lua_State *L, int ud, const char *tname)
   }
   return 0;
 }
+
+int cbson_pcall(lua_State *L, lua_CFunction f, int nargs, int nresults)
+{
+#if LUA_VERSION_NUM >= 502
+  lua_pushcfunction(L, f);
+#else
+  lua_pushlightuserdata(L, (void*)(uintptr_t)f);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_pushcfunction(L, f);
+    lua_pushlightuserdata(L, (void*)(uintptr_t)f);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+#endif
+  lua_insert(L, -nargs - 1);
+
+  return lua_pcall(L, nargs, nresults, 0);
+}
@@ -2,6 +2,29 @@
 #define __CBSON_UTIL_H__
 
 #include <lua.h>
+
+#if LUA_VERSION_NUM >= 502
+#define cbson_objlen(L, index) lua_rawlen(L, index)
+#else
+#define cbson_objlen(L, index) lua_objlen(L, index)
+#endif
+
+// Lua 5.3+ has native 64-bit integers, older versions keep everything in doubles
+#if LUA_VERSION_NUM >= 503
+#define CBSON_NATIVE_INTEGERS 1
+#define cbson_toint64(L, index) (lua_isinteger(L, index) ? (int64_t)lua_tointeger(L, index) : (int64_t)lua_tonumber(L, index))
+#else
+#define cbson_toint64(L, index) ((int64_t)lua_tonumber(L, index))
+#endif
+
+#if LUA_VERSION_NUM >= 503 && !defined(luaL_optint)
+#define luaL_optint(L, arg, def) ((int)luaL_optinteger(L, (arg), (def)))
+#endif
+
 int luaL_checkudata_ex(lua_State *L, int ud, const char *tname);
 
+// lua_pcall of C function f with nargs arguments on top of the stack. Lua 5.1 and LuaJIT closure of f
+// is created once and kept in registry, so the call doesn't allocate.
+int cbson_pcall(lua_State *L, lua_CFunction f, int nargs, int nresults);
+
 #endif
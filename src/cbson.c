@@ -14,6 +14,19 @@
 #include "cbson-uint.h"
 #include "cbson-date.h"
 #include "cbson-decimal.h"
+#include "cbson-filter.h"
+#include "cbson-schema.h"
+#include "cbson-template.h"
+#include "cbson-decoder.h"
+#include "cbson-async.h"
+#include "cbson-offload.h"
+#include "cbson-scan.h"
+#include "cbson-columns.h"
+#include "cbson-compare.h"
+#include "cbson-hash.h"
+#include "cbson-diff.h"
+#include "cbson-stats.h"
+#include "cbson-alloc.h"
 
 #include "cbson-encode.h"
 #include "cbson-decode.h"
@@ -56,13 +69,36 @@ int cbson_set_array_mt(lua_State *state)
 }
 
 
+// cbson.ordered([t]) - tags flat {k1, v1, k2, v2, ...} array as ordered document
+int cbson_ordered(lua_State *L)
+{
+  if (lua_isnoneornil(L, 1))
+  {
+    lua_newtable(L);
+  }
+  else
+  {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+  }
+
+  luaL_getmetatable(L, CBSON_ORDERED_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
 int luaopen_cbson(lua_State *L)
 {
   luaL_Reg cbsonlib[] = {
     { "set_array_mt",    cbson_set_array_mt },
+    { "ordered",         cbson_ordered },
     { "decode",          cbson_decode },
+    { "decode_into",     cbson_decode_into },
     { "encode",          cbson_encode },
+    { "size",            cbson_size },
     { "encode_first",    cbson_encode_first },
+    { "encode_ordered",  cbson_encode_ordered },
     { "to_json",         cbson_to_json },
     { "to_relaxed_json", cbson_to_relaxed_json },
     { "from_json",       cbson_from_json },
@@ -87,6 +123,28 @@ int luaopen_cbson(lua_State *L)
     { "raw_to_int",      cbson_int64_from_raw },
     { "uint_to_raw",     cbson_uint64_to_raw },
     { "raw_to_uint",     cbson_uint64_from_raw },
+    { "compile_filter",  cbson_compile_filter },
+    { "compile_encoder", cbson_compile_encoder },
+    { "placeholder",     cbson_placeholder_new },
+    { "template",        cbson_template_new },
+    { "decoder",         cbson_decoder_new },
+    { "decode_job",      cbson_decode_job_new },
+    { "encode_job",      cbson_encode_job_new },
+    { "decode_offload",  cbson_decode_offload },
+    { "set_offload_threads", cbson_set_offload_threads },
+    { "parallel_scan",   cbson_parallel_scan },
+    { "columns",         cbson_columns },
+    { "compare",         cbson_compare },
+    { "sort",            cbson_sort },
+    { "hash",            cbson_hash },
+    { "equal",           cbson_equal },
+    { "diff",            cbson_diff },
+    { "merge",           cbson_merge },
+    { "concat",          cbson_concat },
+    { "stats",           cbson_stats },
+    { "stats_reset",     cbson_stats_reset },
+    { "stats_enable",    cbson_stats_enable },
+    { "set_allocator",   cbson_set_allocator },
     { NULL, NULL }
   };
 
@@ -108,6 +166,14 @@ int luaopen_cbson(lua_State *L)
   DECLARE_CLASS(L, DECIMAL,    decimal);
   DECLARE_CLASS(L, DATE,       date);
   DECLARE_CLASS(L, UINT64,     uint64);
+  DECLARE_CLASS(L, FILTER,     filter);
+  DECLARE_CLASS(L, SCHEMA,     schema);
+  DECLARE_CLASS(L, PLACEHOLDER, placeholder);
+  DECLARE_CLASS(L, TEMPLATE,   template);
+  DECLARE_CLASS(L, DECODER,    decoder);
+  DECLARE_CLASS(L, DECODE_JOB, decode_job);
+  DECLARE_CLASS(L, ENCODE_JOB, encode_job);
+  DECLARE_CLASS(L, OFFLOAD,    offload);
 
   // cbson module
   lua_newtable(L);
@@ -130,5 +196,10 @@ int luaopen_cbson(lua_State *L)
 
   lua_setfield(L, -2, "ordered_map_mt");
 
+  luaL_newmetatable(L, CBSON_ORDERED_MT); // ordered_mt
+  lua_setfield(L, -2, "ordered_mt");
+
+  cbson_async_register(L);
+
   return 1;
 }
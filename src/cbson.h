@@ -13,8 +13,14 @@
 #define BSON_MAX_RECURSION 100
 #endif
 
+// encoder checks tables nested deeper than this for reference cycles
+#ifndef CBSON_CYCLE_DEPTH
+#define CBSON_CYCLE_DEPTH 16
+#endif
+
 #define CBSON_ARRAY_MT "CBSON_ARRAY_MT"
 #define CBSON_ORDERED_MAP_MT "CBSON_ORDERED_MAP_MT"
+#define CBSON_ORDERED_MT "CBSON_ORDERED_MT"
 
 
 #define DEFINE_CHECK(name, type) \
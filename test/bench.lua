@@ -0,0 +1,345 @@
+-- Throughput benchmark for encode/decode/to_json/from_json/encode_first.
+-- "decoder" op decodes with cbson.decoder() object (key cache), "decoder_values" also caches short string values,
+-- "decode_into" decodes into the same table every time, "decode_offload" parses in worker thread and waits for it,
+-- "parallel_scan_to_json" converts whole mongodump file with cbson.parallel_scan, "columns" extracts single field
+-- with cbson.columns, "compiled_encode" encodes with cbson.compile_encoder() built from document shape,
+-- "template_render" renders cbson.template() with first key as placeholder, "encode_presize" encodes with
+-- presize option, "size" only computes encoded size and "decode_ordered" decodes into cbson.ordered tables.
+--
+-- Usage: lua bench.lua [-t seconds] [-f filter] [-d dump.bson] [-a allocator] [-o results.jsonl]
+--
+--   -t  minimal measured time per case, in seconds (default 0.5)
+--   -f  run only cases whose "case/op" name contains filter
+--   -d  mongodump file used for "mongodump" case, the case is skipped without it
+--   -a  libbson allocator, see cbson.set_allocator() (default system)
+--   -o  write results to file instead of stdout
+--
+-- Each result is a single JSON object per line. "bytes" is size of operation input:
+-- BSON document for decode/to_json, produced BSON for encode/encode_first and JSON text for from_json.
+-- "gc_bytes_per_op" counts memory allocated by lua per operation (with GC stopped), libbson's own
+-- allocations are not included. "clock" is "cpu" for os.clock() and "wall" for wall time, which is used by
+-- threaded ops (decode_offload, parallel_scan_to_json) under LuaJIT or with luasocket installed.
+
+local cbson = require("cbson")
+
+local min_time = 0.5
+local filter = nil
+local dump_file = nil
+local allocator = "system"
+local out = io.stdout
+
+local i = 1
+while i <= #arg do
+  local opt, value = arg[i], arg[i + 1]
+  if opt == "-t" then
+    min_time = tonumber(value)
+  elseif opt == "-f" then
+    filter = value
+  elseif opt == "-d" then
+    dump_file = value
+  elseif opt == "-a" then
+    allocator = value
+  elseif opt == "-o" then
+    out = assert(io.open(value, "w"))
+  else
+    error("unknown option " .. tostring(opt))
+  end
+  i = i + 2
+end
+
+local runtime = jit and jit.version or _VERSION
+
+cbson.set_allocator(allocator)
+
+local function readAll(file)
+  local f = assert(io.open(file, "rb"))
+  local content = f:read("*all")
+  f:close()
+  return content
+end
+
+-- splits mongodump file into separate documents
+local function splitDump(data)
+  local docs = {}
+  local pos = 1
+  while pos <= #data do
+    local s1, s2, s3, s4 = data:byte(pos, pos + 3)
+    local size = s4 and s4 * 16777216 + s3 * 65536 + s2 * 256 + s1
+    if not size or size < 5 or pos + size - 1 > #data then
+      error("Truncated or malformed document at offset " .. (pos - 1))
+    end
+    docs[#docs + 1] = data:sub(pos, pos + size - 1)
+    pos = pos + size
+  end
+  return docs
+end
+
+-- corpus
+
+local function smallCommand()
+  return {
+    find = "users",
+    filter = {age = {["$gt"] = 21}, status = "active"},
+    projection = {name = 1, email = 1},
+    limit = 10,
+    ["$db"] = "test"
+  }, "find"
+end
+
+local function wideFlat()
+  local doc = {}
+  for n = 1, 200 do
+    local kind = n % 3
+    if kind == 0 then
+      doc["field" .. n] = "value number " .. n
+    elseif kind == 1 then
+      doc["field" .. n] = n * 1.5
+    else
+      doc["field" .. n] = (n % 2 == 0)
+    end
+  end
+  return doc, "field1"
+end
+
+local function deepNesting()
+  local doc = {name = "leaf"}
+  for n = 1, 50 do
+    doc = {level = n, tag = "node", child = doc}
+  end
+  return doc, "level"
+end
+
+local function numericArray()
+  local values = {}
+  for n = 1, 10000 do
+    values[n] = n + 0.25
+  end
+  return {name = "series", values = values}, "name"
+end
+
+local function binaryHeavy()
+  local blobs = {}
+  for n = 1, 16 do
+    -- "AAAA" is base64 for three zero bytes, so each blob is 48KB
+    blobs[n] = cbson.binary(string.rep("AAAA", 16384))
+  end
+  return {name = "files", blobs = blobs}, "name"
+end
+
+local cases = {
+  {name = "small_command", make = smallCommand},
+  {name = "wide_flat",     make = wideFlat},
+  {name = "deep_nesting",  make = deepNesting},
+  {name = "numeric_array", make = numericArray},
+  {name = "binary_heavy",  make = binaryHeavy},
+}
+
+-- measurement
+
+-- os.clock() is cpu time of whole process, so ops running worker threads need wall time.
+-- It comes from ffi (LuaJIT) or luasocket, without them these ops are measured in cpu time as well.
+local wallClock
+if jit then
+  local ffi = require("ffi")
+  ffi.cdef("typedef struct { long tv_sec; long tv_nsec; } bench_timespec_t;" ..
+    "int clock_gettime(int clock_id, bench_timespec_t* ts);")
+  local ts = ffi.new("bench_timespec_t")
+  wallClock = function()
+    ffi.C.clock_gettime(1, ts) -- CLOCK_MONOTONIC
+    return tonumber(ts.tv_sec) + tonumber(ts.tv_nsec) * 1e-9
+  end
+else
+  local ok, socket = pcall(require, "socket")
+  wallClock = ok and socket.gettime or nil
+end
+
+local function timeRun(fn, input, n, clock)
+  local start = clock()
+  for _ = 1, n do
+    fn(input)
+  end
+  return clock() - start
+end
+
+-- runs fn until it takes at least min_time, returns iterations and elapsed time
+local function measureTime(fn, input, clock)
+  local n = 1
+  timeRun(fn, input, n, clock)
+  while true do
+    local elapsed = timeRun(fn, input, n, clock)
+    if elapsed >= min_time then
+      return n, elapsed
+    end
+    if elapsed > 0 then
+      n = math.max(n * 2, math.ceil(n * min_time * 1.2 / elapsed))
+    else
+      n = n * 10
+    end
+  end
+end
+
+local function measureGC(fn, input, n)
+  n = math.max(1, math.min(n, 100))
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  for _ = 1, n do
+    fn(input)
+  end
+  local after = collectgarbage("count")
+  collectgarbage("restart")
+  collectgarbage("collect")
+  return (after - before) * 1024 / n
+end
+
+local function report(case, op, bytes, n, elapsed, gc_bytes, clock)
+  local ops = n / elapsed
+  out:write(string.format(
+    '{"runtime":"%s","allocator":"%s","case":"%s","op":"%s","bytes":%d,"iterations":%d,"seconds":%.6f,' ..
+    '"clock":"%s","ops_per_sec":%.2f,"mb_per_sec":%.3f,"gc_bytes_per_op":%.1f}\n',
+    runtime, allocator, case, op, bytes, n, elapsed, clock, ops, ops * bytes / (1024 * 1024), gc_bytes))
+  out:flush()
+end
+
+-- threaded ops are timed with wall clock when there is one
+local function bench(case, op, fn, input, bytes, threaded)
+  if filter and not (case .. "/" .. op):find(filter, 1, true) then
+    return
+  end
+  local clock = threaded and wallClock or os.clock
+  local n, elapsed = measureTime(fn, input, clock)
+  report(case, op, bytes, n, elapsed, measureGC(fn, input, n), clock == os.clock and "cpu" or "wall")
+end
+
+-- schema for cbson.compile_encoder, scalars get their types, other arrays and userdata are "any"
+local function schemaOf(doc)
+  local keys, fields = {}, {}
+  for k in pairs(doc) do
+    keys[#keys + 1] = k
+  end
+  table.sort(keys)
+  for _, k in ipairs(keys) do
+    local v = doc[k]
+    if type(v) == "string" then
+      fields[#fields + 1] = {k, "string"}
+    elseif type(v) == "boolean" then
+      fields[#fields + 1] = {k, "bool"}
+    elseif type(v) == "number" then
+      fields[#fields + 1] = {k, math.type and math.type(v) == "integer" and "int64" or "double"}
+    elseif type(v) == "table" and #v == 0 then
+      fields[#fields + 1] = {k, schemaOf(v)}
+    elseif type(v) == "table" and type(v[1]) == "number" then
+      fields[#fields + 1] = {k, "array", items = "double"}
+    else
+      fields[#fields + 1] = {k, "any"}
+    end
+  end
+  return fields
+end
+
+local function benchDocument(case, doc, first_key)
+  local bson = cbson.encode(doc)
+  local json = cbson.to_json(bson)
+
+  bench(case, "encode", cbson.encode, doc, #bson)
+  bench(case, "encode_presize", function(d) return cbson.encode(d, {presize = true}) end, doc, #bson)
+  bench(case, "size", cbson.size, doc, #bson)
+  bench(case, "encode_first", function(d) return cbson.encode_first(first_key, d) end, doc, #bson)
+  local encoder = cbson.compile_encoder(schemaOf(doc))
+  bench(case, "compiled_encode", function(d) return encoder:encode(d) end, doc, #bson)
+  local value = doc[first_key]
+  doc[first_key] = cbson.placeholder(1)
+  local tpl = cbson.template(doc)
+  doc[first_key] = value
+  bench(case, "template_render", function(v) return tpl:render(v) end, value, #bson)
+  bench(case, "decode", cbson.decode, bson, #bson)
+  bench(case, "decode_ordered", function(b) return cbson.decode(b, {ordered = true}) end, bson, #bson)
+  local decoder = cbson.decoder()
+  bench(case, "decoder", function(b) return decoder:decode(b) end, bson, #bson)
+  local value_decoder = cbson.decoder({value_cache = 1024})
+  bench(case, "decoder_values", function(b) return value_decoder:decode(b) end, bson, #bson)
+  local target = {}
+  bench(case, "decode_into", function(b) return cbson.decode_into(b, target) end, bson, #bson)
+  bench(case, "decode_offload", function(b) return cbson.decode_offload(b):wait() end, bson, #bson, true)
+  bench(case, "columns", function(b) return cbson.columns({b}, {first_key}) end, bson, #bson)
+  bench(case, "to_json", cbson.to_json, bson, #bson)
+  bench(case, "from_json", cbson.from_json, json, #json)
+end
+
+for _, case in ipairs(cases) do
+  benchDocument(case.name, case.make())
+end
+
+-- command with key order, as ordered map, as flat cbson.ordered table and as plain table with key list
+local ordered_map = setmetatable({{find = "users"}, {filter = {status = "active"}},
+  {sort = setmetatable({{age = -1}, {name = 1}}, cbson.ordered_map_mt)}, {limit = 10}, {["$db"] = "test"}}, cbson.ordered_map_mt)
+local ordered_flat = cbson.ordered({"find", "users", "filter", {status = "active"},
+  "sort", cbson.ordered({"age", -1, "name", 1}), "limit", 10, "$db", "test"})
+local ordered_size = #cbson.encode(ordered_flat)
+bench("ordered_command", "encode_ordered_map", cbson.encode, ordered_map, ordered_size)
+bench("ordered_command", "encode_ordered", cbson.encode, ordered_flat, ordered_size)
+local command_keys = {"find", "filter", "sort", "limit", "$db", sort = {"age", "name"}}
+local command = {["$db"] = "test", limit = 10, find = "users", filter = {status = "active"}, sort = {name = 1, age = -1}}
+bench("ordered_command", "encode_key_list", function(c) return cbson.encode_ordered(command_keys, c) end, command, ordered_size)
+
+-- mongodump sample: every operation processes whole dump, document by document
+local function benchDump()
+  local dump = splitDump(readAll(dump_file))
+  local dump_docs, dump_json = {}, {}
+  for n, bson in ipairs(dump) do
+    dump_docs[n] = cbson.decode(bson)
+    dump_json[n] = cbson.to_json(bson)
+  end
+
+  local function each(fn)
+    return function(list)
+      for n = 1, #list do
+        fn(list[n])
+      end
+    end
+  end
+
+  local dump_size = #readAll(dump_file)
+  local json_size = 0
+  for _, json in ipairs(dump_json) do
+    json_size = json_size + #json
+  end
+
+  bench("mongodump", "encode", each(cbson.encode), dump_docs, dump_size)
+  bench("mongodump", "encode_first", each(function(d) return cbson.encode_first("_id", d) end), dump_docs, dump_size)
+  bench("mongodump", "decode", each(cbson.decode), dump, dump_size)
+  local dump_decoder = cbson.decoder()
+  bench("mongodump", "decoder", each(function(b) return dump_decoder:decode(b) end), dump, dump_size)
+  local dump_value_decoder = cbson.decoder({value_cache = 1024})
+  bench("mongodump", "decoder_values", each(function(b) return dump_value_decoder:decode(b) end), dump, dump_size)
+  -- all documents are handed to workers before waiting for the first one
+  bench("mongodump", "decode_offload", function(list)
+    local handles = {}
+    for n = 1, #list do
+      handles[n] = cbson.decode_offload(list[n])
+    end
+    for n = 1, #list do
+      handles[n]:wait()
+    end
+  end, dump, dump_size, true)
+  bench("mongodump", "to_json", each(cbson.to_json), dump, dump_size)
+  bench("mongodump", "columns", function(list) return cbson.columns(list, {"_id"}) end, dump, dump_size)
+  -- whole file with worker threads
+  local scan_script = os.tmpname()
+  local f = assert(io.open(scan_script, "w"))
+  f:write('local cbson = require("cbson") return function(doc) return cbson.to_json(doc) end')
+  f:close()
+  bench("mongodump", "parallel_scan_to_json", function(file)
+    cbson.parallel_scan(file, scan_script, {output = function() end})
+  end, dump_file, dump_size, true)
+  os.remove(scan_script)
+  bench("mongodump", "from_json", each(cbson.from_json), dump_json, json_size)
+end
+
+if dump_file then
+  benchDump()
+end
+
+if out ~= io.stdout then
+  out:close()
+end
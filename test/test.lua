@@ -7,6 +7,27 @@ local function readAll(file)
     return content
 end
 
+-- raw bson {a = {a = ... {[leaf] = 1}}} nested depth levels, encode refuses to build it
+local deepCache = {}
+local function deepBson(depth, leaf)
+    local cached = deepCache[depth .. leaf]
+    if cached then
+        return cached
+    end
+    local function int32(n)
+        return string.char(n % 256, math.floor(n / 256) % 256, math.floor(n / 65536) % 256, math.floor(n / 16777216))
+    end
+    local inner = 11 + #leaf
+    local parts = {}
+    for i = depth, 1, -1 do
+        parts[#parts + 1] = int32(inner + 8 * i) .. "\3a\0"
+    end
+    parts[#parts + 1] = int32(inner) .. "\16" .. leaf .. "\0" .. int32(1) .. "\0"
+    parts[#parts + 1] = string.rep("\0", depth)
+    deepCache[depth .. leaf] = table.concat(parts)
+    return deepCache[depth .. leaf]
+end
+
 local regexes = { -- sometimes regex flags change positions
     ["/foo|bar/ims"] = true,
     ["/foo|bar/ism"] = true
@@ -17,6 +38,8 @@ TestBSON = {}
     function TestBSON:setUp() 
       self.cbson = require("cbson")
       self.data = self.cbson.decode(readAll("input.bson"))
+      -- lua 5.3+ builds decode int32/int64 to native integers
+      self.int = math.type and function(v) return v end or self.cbson.int
     end
 
     function TestBSON:test01_Decode()
@@ -30,7 +53,7 @@ TestBSON = {}
 
     function TestBSON:test03_Decode_int()
         luaunit.assertNotNil(self.data["bar"])
-        luaunit.assertEquals(self.data["bar"], self.cbson.int(12341))
+        luaunit.assertEquals(self.data["bar"], self.int(12341))
     end
 
     function TestBSON:test04_Decode_double()
@@ -41,7 +64,7 @@ TestBSON = {}
     function TestBSON:test05_Decode_map()
         luaunit.assertNotNil(self.data["map"])
         luaunit.assertNotNil(self.data["map"]["a"])
-        luaunit.assertEquals(self.data["map"]["a"], self.cbson.int(1))
+        luaunit.assertEquals(self.data["map"]["a"], self.int(1))
     end
 
     function TestBSON:test06_Decode_array()
@@ -50,10 +73,10 @@ TestBSON = {}
         luaunit.assertNotNil(self.data["array"][2])
         luaunit.assertNotNil(self.data["array"][3])
         luaunit.assertNotNil(self.data["array"][4])
-        luaunit.assertEquals(self.data["array"][1], self.cbson.int(1))
-        luaunit.assertEquals(self.data["array"][2], self.cbson.int(2))
-        luaunit.assertEquals(self.data["array"][3], self.cbson.int(3))
-        luaunit.assertEquals(self.data["array"][4], self.cbson.int(4))
+        luaunit.assertEquals(self.data["array"][1], self.int(1))
+        luaunit.assertEquals(self.data["array"][2], self.int(2))
+        luaunit.assertEquals(self.data["array"][3], self.int(3))
+        luaunit.assertEquals(self.data["array"][4], self.int(4))
     end
 
     function TestBSON:test07_Decode_null()
@@ -137,7 +160,7 @@ TestBSON = {}
         local decoded = self.cbson.decode(encoded)
         luaunit.assertNotNil(decoded)
         luaunit.assertNotNil(decoded["foo"])
-        luaunit.assertTrue(decoded["foo"] == self.cbson.int(10))
+        luaunit.assertTrue(decoded["foo"] == self.int(10))
     end
 
     function TestBSON:test20_Encode_double()
@@ -182,6 +205,834 @@ TestBSON = {}
         luaunit.assertTrue(b:data() == "ZGVhZGJlZWY=")
     end
 
+    function TestBSON:test25_Filter_match()
+        local raw = readAll("input.bson")
+        local function match(filter)
+            return self.cbson.compile_filter(filter):match(raw)
+        end
+        luaunit.assertTrue(match({foo = "bar"}))
+        luaunit.assertFalse(match({foo = "baz"}))
+        luaunit.assertTrue(match({bar = {["$gte"] = 12341, ["$lt"] = self.cbson.int(20000)}}))
+        luaunit.assertFalse(match({bar = {["$gt"] = "1"}}))
+        luaunit.assertTrue(match({["map.a"] = 1}))
+        luaunit.assertTrue(match({array = 3}))
+        luaunit.assertTrue(match({["array.1"] = 2}))
+        luaunit.assertTrue(match({array = {["$in"] = {7, 4}}}))
+        luaunit.assertFalse(match({array = {["$nin"] = {7, 4}}}))
+        luaunit.assertTrue(match({missing = {["$exists"] = false}, null = self.cbson.null()}))
+        luaunit.assertTrue(match({["$or"] = {{foo = "nope"}, {baz = {["$lt"] = 200}}}}))
+        luaunit.assertFalse(match({bar = {["$not"] = {["$gt"] = 100}}}))
+        luaunit.assertTrue(match({foo = {["$regex"] = "^B", ["$options"] = "i"}}))
+        luaunit.assertTrue(match({foo = self.cbson.regex("a.$", "")}))
+        luaunit.assertTrue(match(self.cbson.encode({foo = {["$ne"] = "baz"}})))
+        luaunit.assertError(self.cbson.compile_filter, {foo = {["$where"] = "1"}})
+
+        -- '.' matches newline only with 's', '^' and '$' match lines only with 'm'
+        local text = self.cbson.encode({s = "one\ntwo"})
+        local function regex(pattern, options)
+            return self.cbson.compile_filter({s = {["$regex"] = pattern, ["$options"] = options}}):match(text)
+        end
+        luaunit.assertFalse(regex("e.t", ""))
+        luaunit.assertTrue(regex("e.t", "s"))
+        luaunit.assertFalse(regex("e.t", "m"))
+        luaunit.assertTrue(regex("e.t", "ms"))
+        luaunit.assertTrue(regex("e[.\n]t", ""))
+        luaunit.assertFalse(regex("^two", "s"))
+        luaunit.assertTrue(regex("^two", "m"))
+        luaunit.assertTrue(regex("^T[[:alpha:].]o$", "mi"))
+        luaunit.assertErrorMsgContains("Unsupported regex option 'x'", regex, "a", "x")
+    end
+
+    function TestBSON:test26_Compare_sort()
+        local cbson = self.cbson
+        local a = cbson.encode({name = "a", n = 1, tags = {5, 2}})
+        local b = cbson.encode({name = "b", n = cbson.int(1), tags = {3}})
+        local c = cbson.encode({name = "c", n = "1"})
+        local d = cbson.encode({name = "d", n = 0.5, sub = {x = cbson.date(10)}})
+        luaunit.assertEquals(cbson.compare(a, a), 0)
+        luaunit.assertEquals(cbson.compare(a, b, {n = 1}), 0)
+        luaunit.assertEquals(cbson.compare(a, c, {n = 1}), -1)
+        luaunit.assertEquals(cbson.compare(c, d, {n = -1}), -1)
+        luaunit.assertEquals(cbson.compare(d, a, {["sub.x"] = 1}), 1)
+        local function names(list)
+            local res = {}
+            for i, v in ipairs(list) do res[i] = cbson.decode(v).name end
+            return table.concat(res)
+        end
+        luaunit.assertEquals(names(cbson.sort({a, b, c, d}, {n = 1})), "dabc")
+        luaunit.assertEquals(names(cbson.sort({c, b, a, d}, cbson.encode(setmetatable({{n = -1}, {name = -1}}, cbson.ordered_map_mt)))), "cbad")
+        luaunit.assertEquals(names(cbson.sort({a, b, c, d}, {tags = 1})), "cdab")
+        luaunit.assertEquals(names(cbson.sort({a, b, c, d}, {tags = -1})), "abcd")
+        luaunit.assertError(cbson.sort, {a, 1}, {n = 1})
+        luaunit.assertError(cbson.sort, {a, b}, {n = 0})
+
+        -- dotted path goes through arrays of documents, min (max when descending) of reached values counts
+        local items1 = cbson.encode({items = {{p = 5}, {p = 9}}})
+        local items2 = cbson.encode({items = {{p = 1}, {p = 2}}})
+        luaunit.assertEquals(cbson.compare(items1, items2, {["items.p"] = 1}), 1)
+        luaunit.assertEquals(cbson.compare(items1, items2, {["items.p"] = -1}), -1)
+        luaunit.assertEquals(cbson.compare(items1, cbson.encode({items = {{p = 7}, {q = 1}}}), {["items.p"] = 1}), 1)
+        luaunit.assertEquals(cbson.compare(items1, cbson.encode({items = {{p = {3, 6}}}}), {["items.p"] = 1}), 1)
+        luaunit.assertEquals(cbson.compare(items1, cbson.encode({items = {{p = 1}, {p = 5}}}), {["items.1.p"] = 1}), 1)
+
+        -- past BSON_MAX_RECURSION nested documents are compared by bytes instead of recursion
+        local deep_x, deep_y = deepBson(200000, "x"), deepBson(200000, "y")
+        luaunit.assertEquals(cbson.compare(deep_x, deep_x), 0)
+        luaunit.assertEquals(cbson.compare(deep_x, deep_y), -1)
+        luaunit.assertEquals(cbson.compare(deep_y, deep_x, {a = 1}), 1)
+        luaunit.assertEquals(cbson.compare(deepBson(50, "x"), deepBson(50, "y")), -1)
+        luaunit.assertEquals(#cbson.sort({deep_y, deep_x, deep_y}, {a = -1}), 3)
+    end
+
+    function TestBSON:test27_Hash_equal()
+        local cbson = self.cbson
+        local a = cbson.from_json('{"a": 1, "b": {"x": "y", "z": [1, {"p": 1, "q": 2}]}}')
+        local b = cbson.from_json('{"b": {"z": [1, {"q": 2, "p": 1}], "x": "y"}, "a": 1}')
+        local c = cbson.from_json('{"a": 1, "b": {"x": "y", "z": [{"p": 1, "q": 2}, 1]}}')
+        luaunit.assertEquals(cbson.hash(cbson.from_json('{}')), "ad14a64e34a31898")
+        luaunit.assertEquals(#cbson.hash(a), 16)
+        luaunit.assertEquals(cbson.hash(a, {algo = "xxh64"}), cbson.hash(a))
+        luaunit.assertNotEquals(cbson.hash(a), cbson.hash(b))
+        luaunit.assertNotEquals(cbson.hash(a, {seed = 1}), cbson.hash(a))
+        luaunit.assertEquals(cbson.hash(a, {seed = -1}), cbson.hash(a, {seed = cbson.uint("18446744073709551615")}))
+        luaunit.assertEquals(cbson.hash(a, {seed = cbson.int(7)}), cbson.hash(a, {seed = 7}))
+        luaunit.assertError(cbson.hash, a, {seed = 1.5})
+        luaunit.assertError(cbson.hash, a, {seed = 2 ^ 64})
+        luaunit.assertError(cbson.hash, a, {seed = 0 / 0})
+        luaunit.assertEquals(cbson.hash(a, {ordered = false}), cbson.hash(b, {ordered = false}))
+        luaunit.assertNotEquals(cbson.hash(a, {ordered = false}), cbson.hash(c, {ordered = false}))
+        luaunit.assertError(cbson.hash, a, {algo = "md5"})
+        luaunit.assertTrue(cbson.equal(a, cbson.from_json(cbson.to_json(a))))
+        luaunit.assertFalse(cbson.equal(a, b))
+        luaunit.assertTrue(cbson.equal(a, b, {ordered = false}))
+        luaunit.assertFalse(cbson.equal(a, c, {ordered = false}))
+        luaunit.assertFalse(cbson.equal(a, cbson.from_json('{"a": 1}'), {ordered = false}))
+        luaunit.assertFalse(cbson.equal(cbson.from_json('{"a": 1}'), a, {ordered = false}))
+
+        -- nesting past BSON_MAX_RECURSION is hashed and compared by bytes
+        local deep_x, deep_y = deepBson(200000, "x"), deepBson(200000, "y")
+        luaunit.assertEquals(cbson.hash(deep_x, {ordered = false}), cbson.hash(deepBson(200000, "x"), {ordered = false}))
+        luaunit.assertNotEquals(cbson.hash(deep_x, {ordered = false}), cbson.hash(deep_y, {ordered = false}))
+        luaunit.assertTrue(cbson.equal(deep_x, deepBson(200000, "x"), {ordered = false}))
+        luaunit.assertFalse(cbson.equal(deep_x, deep_y, {ordered = false}))
+    end
+
+    function TestBSON:test28_Diff()
+        local cbson = self.cbson
+        local old = cbson.from_json('{"a": 1, "b": {"x": 1, "y": [1, 2], "z": "keep"}, "c": "gone", "d": {"e": 1}}')
+        local new = cbson.from_json('{"b": {"z": "keep", "x": 2, "y": [1, 3]}, "a": 1, "d": 5, "f": {"g": true}}')
+        luaunit.assertEquals(cbson.to_json(cbson.diff(old, new)),
+            '{ "$set" : { "b.x" : 2, "b.y" : [ 1, 3 ], "d" : 5, "f" : { "g" : true } }, "$unset" : { "c" : "" } }')
+        luaunit.assertEquals(cbson.diff(old, old), cbson.encode({}))
+        luaunit.assertEquals(cbson.decode(cbson.diff(new, cbson.encode({}))), {["$unset"] = {a = "", b = "", d = "", f = ""}})
+
+        -- documents nested past BSON_MAX_RECURSION levels are set as a whole
+        local update = cbson.decode(cbson.diff(deepBson(200000, "x"), deepBson(200000, "y")))
+        local path = next(update["$set"])
+        luaunit.assertEquals(path, ("a."):rep(100) .. "a")
+        luaunit.assertNil(next(update["$set"], path))
+
+        -- keys which can't be written as path make their parent set as a whole
+        luaunit.assertEquals(cbson.decode(cbson.diff(cbson.encode({a = {["x.y"] = 1}}), cbson.encode({a = {["x.y"] = 2}}))),
+            {["$set"] = {a = {["x.y"] = 2}}})
+        luaunit.assertEquals(cbson.decode(cbson.diff(cbson.encode({a = {b = {c = 1}}}), cbson.encode({a = {b = {["$inc"] = 1}}}))),
+            {["$set"] = {["a.b"] = {["$inc"] = 1}}})
+        luaunit.assertEquals(cbson.decode(cbson.diff(cbson.encode({a = {[""] = 1, b = 1}}), cbson.encode({a = {b = 2}}))),
+            {["$set"] = {a = {b = 2}}})
+        luaunit.assertError(cbson.diff, cbson.encode({["x.y"] = 1}), cbson.encode({["x.y"] = 2}))
+    end
+
+    function TestBSON:test29_Merge_concat()
+        local cbson = self.cbson
+        local a = cbson.from_json('{"a": "a", "b": {"x": "x", "y": "y"}, "c": "c"}')
+        local b = cbson.from_json('{"b": {"y": "Y", "z": "z"}, "d": "d", "a": "A"}')
+        luaunit.assertEquals(cbson.to_json(cbson.merge(a, b)),
+            '{ "a" : "A", "b" : { "y" : "Y", "z" : "z" }, "c" : "c", "d" : "d" }')
+        luaunit.assertEquals(cbson.to_json(cbson.merge(a, b, {deep = true})),
+            '{ "a" : "A", "b" : { "x" : "x", "y" : "Y", "z" : "z" }, "c" : "c", "d" : "d" }')
+        luaunit.assertEquals(cbson.merge(a, cbson.encode({})), a)
+        luaunit.assertEquals(cbson.to_json(cbson.concat(cbson.from_json('{"a": "a"}'), cbson.from_json('{"b": "b"}'))),
+            '{ "a" : "a", "b" : "b" }')
+        luaunit.assertEquals(cbson.concat(a, cbson.encode({})), a)
+
+        -- deep merge stops at BSON_MAX_RECURSION levels, deeper documents of b win as a whole
+        local deep_x, deep_y = deepBson(200000, "x"), deepBson(200000, "y")
+        luaunit.assertEquals(cbson.merge(deep_x, deep_y, {deep = true}), deep_y)
+        luaunit.assertEquals(#cbson.concat(deep_x, deep_y), 2 * #deep_x - 5)
+    end
+
+    function TestBSON:test30_Deep_nesting()
+        local doc = {name = "leaf"}
+        for n = 1, 90 do
+            doc = {level = n, child = doc}
+        end
+        local decoded = self.cbson.decode(self.cbson.encode(doc))
+        luaunit.assertEquals(decoded.level, 90)
+        luaunit.assertEquals(decoded.child.child.level, 88)
+    end
+
+    function TestBSON:test31_Stats()
+        local cbson = self.cbson
+        if not cbson.stats_enable(true) then
+            luaunit.assertFalse(cbson.stats().enabled)
+            return -- built without USE_STATS
+        end
+        cbson.stats_reset()
+        local bson = cbson.encode({a = {b = {c = 1}}})
+        cbson.decode(bson)
+        cbson.oid("5a8a4ce7a3a2fbd1cd1c8d40")
+        local stats = cbson.stats()
+        luaunit.assertTrue(stats.enabled)
+        luaunit.assertEquals(stats.encode.calls, 1)
+        luaunit.assertEquals(stats.encode.bytes_out, #bson)
+        luaunit.assertEquals(stats.decode.bytes_in, #bson)
+        luaunit.assertEquals(stats.to_json.calls, 0)
+        luaunit.assertEquals(stats.documents, 2)
+        luaunit.assertEquals(stats.max_depth, 2)
+        luaunit.assertEquals(stats.userdata.oid, 1)
+
+        -- columns, compiled encoder and template have their own entries
+        cbson.columns(bson, {"a"})
+        cbson.compile_encoder({{"a", "int32"}}):encode({a = 1})
+        cbson.template({a = cbson.placeholder(1)}):render(1)
+        cbson.decode_into(bson, {})
+        cbson.decoder():decode(bson)
+        stats = cbson.stats()
+        luaunit.assertEquals(stats.encode.calls, 1)
+        luaunit.assertEquals(stats.decode.calls, 1)
+        luaunit.assertEquals(stats.decode_into.calls, 1)
+        luaunit.assertEquals(stats.decoder_decode.calls, 1)
+        luaunit.assertEquals(stats.decoder_decode.bytes_in, #bson)
+        luaunit.assertEquals(stats.offload_wait.calls, 0)
+        if math.type then
+            luaunit.assertEquals(math.type(stats.decode.ns), "integer")
+            luaunit.assertEquals(math.type(stats.documents), "integer")
+        end
+        luaunit.assertEquals(stats.columns.calls, 1)
+        luaunit.assertEquals(stats.schema_encode.calls, 1)
+        luaunit.assertEquals(stats.template_render.calls, 1)
+        cbson.stats_enable(false)
+        cbson.encode({})
+        luaunit.assertEquals(cbson.stats().encode.calls, 1)
+        cbson.stats_enable(true)
+        cbson.stats_reset()
+        luaunit.assertEquals(cbson.stats().encode.calls, 0)
+    end
+
+    function TestBSON:test32_Allocator()
+        local cbson = self.cbson
+        local raw = readAll("input.bson")
+        local json = cbson.to_json(raw)
+        local big = {}
+        for i = 1, 20000 do
+            big[i] = "value " .. i
+        end
+        local encoded = cbson.encode(cbson.decode(raw))
+        luaunit.assertEquals(cbson.set_allocator("system"), "system")
+        for _, mode in ipairs({"arena", "system"}) do
+            cbson.set_allocator(mode)
+            luaunit.assertEquals(cbson.encode(cbson.decode(raw)), encoded)
+            luaunit.assertEquals(cbson.to_json(cbson.from_json(json)), json)
+            luaunit.assertEquals(#cbson.decode(cbson.encode({list = big})).list, 20000)
+            luaunit.assertEquals(cbson.to_json(cbson.merge(cbson.encode({a = "a"}), cbson.encode({b = "b"}))), '{ "a" : "a", "b" : "b" }')
+            luaunit.assertError(cbson.from_json, "{broken")
+        end
+        luaunit.assertEquals(cbson.set_allocator("system"), "system")
+        luaunit.assertError(cbson.set_allocator, "tcmalloc")
+        luaunit.assertError(cbson.set_allocator, "lua")
+
+        -- buffers kept between calls never come from arena, failed call gives its arena back
+        local enc = cbson.compile_encoder({{"s", "string"}})
+        enc:encode({s = ("x"):rep(1000)})
+        cbson.set_allocator("arena")
+        local loop = {}
+        loop.loop = loop
+        luaunit.assertError(cbson.encode, loop)
+        local job = cbson.encode_job({list = big})
+        job:step(10)
+        for _ = 1, 5 do
+            cbson.encode({list = big})
+        end
+        luaunit.assertEquals(enc:encode({s = ("x"):rep(100000)}), cbson.encode({s = ("x"):rep(100000)}))
+        local done, result
+        repeat done, result = job:step(1000) until done
+        luaunit.assertEquals(#cbson.decode(result).list, 20000)
+        cbson.set_allocator("system")
+    end
+
+    function TestBSON:test33_Native_integers()
+        local cbson = self.cbson
+        if not math.type then
+            return -- lua 5.1/5.2 and luajit have no integer subtype
+        end
+        local decoded = cbson.decode(cbson.encode({small = 42, big = 1099511627776, float = 42.0, neg = -7}))
+        luaunit.assertEquals(math.type(decoded.small), "integer")
+        luaunit.assertEquals(math.type(decoded.big), "integer")
+        luaunit.assertEquals(math.type(decoded.float), "float")
+        luaunit.assertEquals(decoded.big, 1099511627776)
+        luaunit.assertEquals(decoded.neg, -7)
+        luaunit.assertEquals(cbson.to_json(cbson.encode({a = 1})), '{ "a" : 1 }')
+        luaunit.assertEquals(cbson.to_json(cbson.encode({a = math.maxinteger})), '{ "a" : 9223372036854775807 }')
+        luaunit.assertEquals(cbson.to_json(cbson.encode({a = cbson.int(5)})), cbson.to_json(cbson.encode({a = 5})))
+        luaunit.assertEquals(cbson.int(math.maxinteger):number(), math.maxinteger)
+        luaunit.assertEquals(cbson.decode(cbson.encode({a = math.mininteger})).a, math.mininteger)
+    end
+
+    function TestBSON:test34_FFI()
+        local cbson = self.cbson
+        if not jit then
+            return -- cbson.ffi needs luajit
+        end
+        local cbfi = require("cbson.ffi")
+        local bson = cbson.encode({a = {b = {c = "deep"}}, n = 1.5, id = cbson.oid("5a1b2c3d4e5f60718293a4b5"),
+                                   big = cbson.int("9007199254740993"), small = cbson.int(7), t = true})
+        luaunit.assertEquals(cbfi.get(bson, "a.b.c"), "deep")
+        luaunit.assertEquals(cbfi.get(bson, "n"), 1.5)
+        luaunit.assertEquals(cbfi.get(bson, "small"), 7)
+        luaunit.assertTrue(cbfi.get(bson, "big") == cbfi.int("9007199254740993"))
+        luaunit.assertTrue(cbfi.int("-9223372036854775808") == cbfi.int(cbson.int("-9223372036854775808")))
+        luaunit.assertTrue(cbfi.int("1e3") == 1000)
+        luaunit.assertError(cbfi.int, "abc")
+        luaunit.assertError(cbfi.int, "")
+        luaunit.assertError(cbfi.int, "1.5")
+        luaunit.assertError(cbfi.int, "99999999999999999999")
+        luaunit.assertTrue(cbfi.get(bson, "t"))
+        luaunit.assertNil(cbfi.get(bson, "a.x"))
+        luaunit.assertEquals(cbson.to_json((cbfi.get(bson, "a"))), '{ "b" : { "c" : "deep" } }')
+
+        local oid = cbfi.oid("5a1b2c3d4e5f60718293a4b5")
+        luaunit.assertTrue(oid == cbfi.get(bson, "id"))
+        luaunit.assertEquals(tostring(oid), "5a1b2c3d4e5f60718293a4b5")
+        luaunit.assertEquals(oid:timestamp(), cbson.oid("5a1b2c3d4e5f60718293a4b5"):timestamp())
+        luaunit.assertError(cbfi.oid, "xyz")
+
+        local encoded = cbson.encode({x = cbfi.to_cbson(cbfi.int("-9007199254740993")), o = cbfi.to_cbson(oid)})
+        luaunit.assertEquals(tostring(cbson.decode(encoded).x), "-9007199254740993")
+        luaunit.assertEquals(tostring(cbson.decode(encoded).o), "5a1b2c3d4e5f60718293a4b5")
+
+        local second = cbson.encode({b = 2})
+        local docs = {}
+        for doc, offset in cbfi.documents(bson .. second) do
+            docs[#docs + 1] = {doc, offset}
+        end
+        luaunit.assertEquals(docs, {{bson, 0}, {second, #bson}})
+        luaunit.assertError(function() for _ in cbfi.documents(bson .. second:sub(1, -2)) do end end)
+    end
+
+    function TestBSON:test35_Decoder()
+        local cbson = self.cbson
+        local raw = readAll("input.bson")
+        local expected = cbson.to_json(cbson.encode(cbson.decode(raw)))
+        local dec = cbson.decoder()
+        luaunit.assertEquals(tostring(dec), "decoder (key cache 1024, value cache 0)")
+        for _ = 1, 3 do
+            luaunit.assertEquals(cbson.to_json(cbson.encode(dec:decode(raw))), expected)
+        end
+        dec:clear()
+        luaunit.assertEquals(cbson.to_json(cbson.encode(dec:decode(raw))), expected)
+
+        -- tiny cache keeps evicting, results must not change
+        local tiny = cbson.decoder({key_cache = 3})
+        luaunit.assertEquals(tostring(tiny), "decoder (key cache 4, value cache 0)")
+        for n = 1, 50 do
+            local doc = tiny:decode(cbson.encode({["key" .. n] = n, ["key" .. (n + 1)] = "x", nested = {["key" .. n] = true}}))
+            luaunit.assertEquals(doc["key" .. n], n)
+            luaunit.assertEquals(doc["key" .. (n + 1)], "x")
+            luaunit.assertTrue(doc.nested["key" .. n])
+        end
+
+        luaunit.assertEquals(cbson.to_json(cbson.encode(cbson.decoder({key_cache = 0}):decode(raw))), expected)
+        luaunit.assertError(cbson.decoder, {key_cache = 100000})
+        luaunit.assertError(cbson.decoder, {key_cache = 1.5})
+        luaunit.assertError(dec.decode, dec, "broken")
+    end
+
+    function TestBSON:test36_Decoder_values()
+        local cbson = self.cbson
+        local raw = readAll("input.bson")
+        local expected = cbson.to_json(cbson.encode(cbson.decode(raw)))
+        local dec = cbson.decoder({value_cache = 16, max_value_len = 8})
+        luaunit.assertEquals(tostring(dec), "decoder (key cache 1024, value cache 16)")
+        luaunit.assertEquals(cbson.to_json(cbson.encode(dec:decode(raw))), expected)
+
+        dec:clear()
+        local bson = cbson.encode({status = "active", country = "NL", note = "longer than eight bytes"})
+        for _ = 1, 10 do
+            local doc = dec:decode(bson)
+            luaunit.assertEquals(doc.status, "active")
+            luaunit.assertEquals(doc.country, "NL")
+            luaunit.assertEquals(doc.note, "longer than eight bytes")
+        end
+        local stats = dec:stats()
+        luaunit.assertEquals(stats.values, {hits = 18, misses = 2, size = 16})
+        luaunit.assertEquals(stats.keys, {hits = 27, misses = 3, size = 1024})
+        if math.type then
+            luaunit.assertEquals(math.type(stats.keys.hits), "integer")
+            luaunit.assertEquals(math.type(stats.values.misses), "integer")
+        end
+
+        -- invalid utf8 still stops decoding and is never cached
+        local bad = cbson.encode({s = "\255\254"})
+        luaunit.assertNil(dec:decode(bad).s)
+        luaunit.assertNil(dec:decode(bad).s)
+        luaunit.assertEquals(cbson.decoder():stats().values, {hits = 0, misses = 0, size = 0})
+        luaunit.assertError(cbson.decoder, {max_value_len = -1})
+        luaunit.assertError(cbson.decoder, {max_value_len = 2.5})
+    end
+
+    function TestBSON:test37_Decode_into()
+        local cbson = self.cbson
+        local raw = readAll("input.bson")
+        local target = {}
+        luaunit.assertIs(cbson.decode_into(raw, target), target)
+        luaunit.assertEquals(cbson.to_json(cbson.encode(target)), cbson.to_json(cbson.encode(cbson.decode(raw))))
+
+        local bson = cbson.encode({user = {name = "bob", tags = {"a", "b"}}, n = 1.5})
+        local doc = {stale = true, user = {old = 1}}
+        local user = doc.user
+        cbson.decode_into(bson, doc)
+        luaunit.assertIs(doc.user, user)
+        luaunit.assertNil(doc.stale)
+        luaunit.assertNil(doc.user.old)
+        luaunit.assertEquals(doc.user.tags, {"a", "b"})
+        local tags = doc.user.tags
+
+        cbson.decode_into(cbson.encode({user = {name = "eve", tags = {"c"}}}), doc)
+        luaunit.assertIs(doc.user.tags, tags)
+        luaunit.assertEquals(doc, {user = {name = "eve", tags = {"c"}}})
+
+        cbson.decode_into(cbson.encode({user = {1.5}}), doc)
+        luaunit.assertEquals(doc.user, {1.5})
+
+        cbson.decode_into(cbson.encode({x = 1.5}), doc, {clear = false})
+        luaunit.assertEquals(doc.x, 1.5)
+        luaunit.assertEquals(doc.user, {1.5})
+
+        -- same-shaped documents don't create new tables
+        local before = collectgarbage("count")
+        collectgarbage("stop")
+        for _ = 1, 100 do
+            cbson.decode_into(bson, doc)
+        end
+        local into = collectgarbage("count") - before
+        before = collectgarbage("count")
+        for _ = 1, 100 do
+            cbson.decode(bson)
+        end
+        local fresh = collectgarbage("count") - before
+        collectgarbage("restart")
+        luaunit.assertTrue(into * 4 < fresh)
+
+        luaunit.assertError(cbson.decode_into, "broken", {})
+        luaunit.assertError(cbson.decode_into, bson, nil)
+    end
+
+    function TestBSON:test38_Async()
+        local cbson = self.cbson
+        local raw = readAll("input.bson")
+        local doc = cbson.decode(raw)
+        local expected = cbson.to_json(cbson.encode(doc))
+        -- without yield option job runs without yielding
+        luaunit.assertEquals(cbson.encode_async(doc, {budget = 1}), cbson.encode(doc))
+        luaunit.assertEquals(cbson.to_json(cbson.encode(cbson.decode_async(raw, {budget = 1}))), expected)
+
+        -- even inside of iterator made by coroutine.wrap
+        local produced = {}
+        for result in coroutine.wrap(function()
+            coroutine.yield(cbson.to_json(cbson.encode(cbson.decode_async(raw, {budget = 1}))))
+            coroutine.yield(cbson.encode_async(doc, {budget = 1}))
+        end) do
+            produced[#produced + 1] = result
+        end
+        luaunit.assertEquals(produced, {expected, cbson.encode(doc)})
+
+        local yields = 0
+        local co = coroutine.wrap(function() return cbson.decode_async(raw, {budget = 3, yield = true}) end)
+        local decoded = co()
+        while decoded == nil do
+            yields = yields + 1
+            decoded = co()
+        end
+        luaunit.assertTrue(yields > 0)
+        luaunit.assertEquals(cbson.to_json(cbson.encode(decoded)), expected)
+
+        local calls = 0
+        local encoded = cbson.encode_async(doc, {budget = 2, yield = function() calls = calls + 1 end})
+        luaunit.assertTrue(calls > 0)
+        luaunit.assertEquals(encoded, cbson.encode(doc))
+
+        local job = cbson.decode_job(raw)
+        luaunit.assertEquals(tostring(job), "decode job (pending)")
+        luaunit.assertFalse(job:step(1))
+        local done, result
+        repeat
+            done, result = job:step()
+        until done
+        luaunit.assertTrue(job:done())
+        luaunit.assertEquals(cbson.to_json(cbson.encode(result)), expected)
+        luaunit.assertError(job.step, job)
+
+        cbson.encode_job(doc):step(1) -- unfinished job is just collected
+
+        -- failed job stays failed, instead of returning partial document
+        local deep = {}
+        for _ = 1, 200 do
+            deep = {d = deep}
+        end
+        for _, bad in ipairs({{a = 1, deep = deep}, {a = 1, x = cbson.placeholder(1)}}) do
+            local failed = cbson.encode_job(bad)
+            luaunit.assertError(failed.step, failed, 1000)
+            luaunit.assertTrue(failed:done())
+            luaunit.assertEquals(tostring(failed), "encode job (failed)")
+            luaunit.assertErrorMsgContains("Job has failed", failed.step, failed, 1000)
+        end
+        collectgarbage()
+        luaunit.assertError(cbson.decode_async, "broken")
+        luaunit.assertError(job.step, cbson.decode_job(raw), 0)
+    end
+
+    function TestBSON:test39_Offload()
+        local cbson = self.cbson
+        local raw = readAll("input.bson")
+        local expected = cbson.encode(cbson.decode(raw))
+        local function same(decoded) -- tables are presized, so pairs() order may differ from decode
+            return cbson.equal(cbson.encode(decoded), expected, {ordered = false})
+        end
+
+        local handle = cbson.decode_offload(raw)
+        local decoded = handle:wait()
+        luaunit.assertTrue(handle:ready())
+        luaunit.assertEquals(tostring(handle), "offload (decoded)")
+        luaunit.assertTrue(same(decoded))
+        luaunit.assertIs(handle:wait(), decoded)
+
+        local handles = {}
+        for n = 1, 10 do
+            handles[n] = cbson.decode_offload(raw)
+        end
+        for n = 1, 10 do
+            luaunit.assertTrue(same(handles[n]:wait()))
+        end
+
+        -- child of fork has no workers, it builds jobs left pending by parent itself
+        if jit then
+            local ffi = require("ffi")
+            pcall(ffi.cdef, "int fork(void); void _exit(int); int waitpid(int pid, int* status, int options);")
+            local list = {}
+            for n = 1, 100000 do
+                list[n] = n
+            end
+            local big = cbson.encode({list = list})
+            for n = 1, 20 do
+                handles[n] = cbson.decode_offload(big)
+            end
+            local pid = ffi.C.fork()
+            if pid == 0 then
+                local ok = true
+                for n = 1, 20 do
+                    ok = ok and #handles[n]:wait().list == 100000
+                end
+                ffi.C._exit(ok and 0 or 1)
+            end
+            local status = ffi.new("int[1]")
+            luaunit.assertEquals(ffi.C.waitpid(pid, status, 0), pid)
+            luaunit.assertEquals(status[0], 0)
+            for n = 1, 20 do
+                luaunit.assertEquals(#handles[n]:wait().list, 100000)
+            end
+        end
+
+        cbson.decode_offload(raw) -- unfinished handle is just collected
+        collectgarbage()
+        luaunit.assertError(cbson.decode_offload, "broken")
+        luaunit.assertError(cbson.set_offload_threads, 0)
+        luaunit.assertError(cbson.set_offload_threads, 65)
+    end
+
+    function TestBSON:test40_Parallel_scan()
+        local cbson = self.cbson
+        local dump, script = os.tmpname(), os.tmpname()
+        local docs, expected = {}, {}
+        for n = 1, 300 do
+            docs[n] = cbson.encode({n = n, name = "doc" .. n})
+            expected[n] = cbson.to_json(docs[n]) .. "\n"
+        end
+        local f = io.open(dump, "wb")
+        f:write(table.concat(docs))
+        f:close()
+        f = io.open(script, "w")
+        f:write('local cbson = require("cbson")\n' ..
+                'return function(doc, offset)\n' ..
+                '  if math.type and math.type(offset) ~= "integer" then error("offset is not integer") end\n' ..
+                '  if cbson.decode(doc).n == 0 then error("bad") end return cbson.to_json(doc) .. "\\n"\n' ..
+                'end')
+        f:close()
+
+        local chunks = {}
+        local collect = function(s) chunks[#chunks + 1] = s end
+        luaunit.assertEquals(cbson.parallel_scan(dump, script, {threads = 4, batch_size = 100, output = collect}), 300)
+        luaunit.assertEquals(table.concat(chunks), table.concat(expected))
+        if math.type then
+            luaunit.assertEquals(math.type(cbson.parallel_scan(dump, script, {output = function() end})), "integer")
+        end
+
+        chunks = {}
+        cbson.parallel_scan(dump, script, {threads = 3, batch_size = 100, ordered = false, output = collect})
+        local lines = {}
+        for line in table.concat(chunks):gmatch("[^\n]+\n") do
+            lines[#lines + 1] = line
+        end
+        table.sort(lines)
+        table.sort(expected)
+        luaunit.assertEquals(lines, expected)
+
+        f = io.open(dump, "ab")
+        f:write(cbson.encode({n = 0}))
+        f:close()
+        luaunit.assertErrorMsgContains("bad", cbson.parallel_scan, dump, script, {output = collect})
+        luaunit.assertError(cbson.parallel_scan, dump, script, {threads = 0})
+        os.remove(dump)
+        os.remove(script)
+    end
+
+    function TestBSON:test41_Columns()
+        local cbson = self.cbson
+        local docs = {
+            cbson.encode({ts = 1.5, user = {id = "a"}, amount = cbson.int(10)}),
+            cbson.encode({ts = 2.5, user = {id = "b"}}),
+            cbson.encode({ts = 3.5, user = {id = "c"}, amount = cbson.null()}),
+        }
+        local columns, rows = cbson.columns(docs, {"ts", "user.id", "amount", "missing"})
+        luaunit.assertEquals(rows, 3)
+        luaunit.assertEquals(columns.ts.type, "double")
+        luaunit.assertEquals(#columns.ts.data, 24)
+        luaunit.assertEquals(columns.ts.null_count, 0)
+        luaunit.assertEquals(columns["user.id"].type, "value")
+        luaunit.assertEquals(columns["user.id"].values, {"a", "b", "c"})
+        luaunit.assertEquals(columns.amount.type, "int64")
+        luaunit.assertEquals(columns.amount.nulls, string.char(6))
+        luaunit.assertEquals(columns.amount.null_count, 2)
+        luaunit.assertEquals(columns.missing.nulls, string.char(7))
+        if math.type then
+            luaunit.assertEquals(math.type(rows), "integer")
+            luaunit.assertEquals(math.type(columns.amount.null_count), "integer")
+        end
+
+        -- concatenated stream and iterator give the same columns
+        local stream = cbson.columns(table.concat(docs), {"ts"})
+        luaunit.assertEquals(stream.ts.data, columns.ts.data)
+        local n = 0
+        local iterated = cbson.columns(function() n = n + 1 return docs[n] end, {"ts"})
+        luaunit.assertEquals(iterated.ts.data, columns.ts.data)
+
+        -- non-numeric value turns column into lua array
+        local mixed = cbson.columns({docs[1], cbson.encode({ts = "now"})}, {"ts"})
+        luaunit.assertEquals(mixed.ts.values, {1.5, "now"})
+
+        luaunit.assertError(cbson.columns, docs, {})
+        luaunit.assertError(cbson.columns, docs, {"a", "a"})
+        luaunit.assertError(cbson.columns, {"broken"}, {"a"})
+    end
+
+    function TestBSON:test42_Compile_encoder()
+        local cbson = self.cbson
+        local encoder = cbson.compile_encoder({
+            {"name", "string"},
+            {"age", "int32"},
+            {"score", "double", optional = true},
+            {"user", {{"id", "int64"}, {"tags", "array", items = "string"}}},
+            {"extra", "any", optional = true},
+        })
+        local doc = {age = 42, name = "bob", user = {tags = {"a", "b"}, id = 2^32}, extra = {1, 2}}
+        local data = encoder:encode(doc)
+
+        -- fields follow schema order
+        local ordered = cbson.ordered_map_mt
+        luaunit.assertEquals(data, cbson.encode(setmetatable({{name = "bob"}, {age = cbson.int(42)},
+            {user = setmetatable({{id = cbson.int("4294967296")}, {tags = {"a", "b"}}}, ordered)}, {extra = {1, 2}}}, ordered)))
+        luaunit.assertEquals(encoder:encode(doc), data)
+
+        luaunit.assertErrorMsgContains("Field 'age' expects int32, got number", encoder.encode, encoder,
+            {name = "bob", age = 1.5, user = {id = 1, tags = {}}})
+        luaunit.assertErrorMsgContains("Field 'user.tags[]' expects string", encoder.encode, encoder,
+            {name = "bob", age = 1, user = {id = 1, tags = {1}}})
+        luaunit.assertErrorMsgContains("Field 'name' is missing", encoder.encode, encoder, {age = 1})
+        -- encoder is usable after error
+        luaunit.assertEquals(cbson.decode(encoder:encode({name = "a", age = 1, user = {id = 1, tags = {}}})).name, "a")
+
+        luaunit.assertError(cbson.compile_encoder, {{"a", "unknown"}})
+        luaunit.assertError(cbson.compile_encoder, {{"a", "int32"}, {"a", "bool"}})
+        luaunit.assertError(cbson.compile_encoder, {{"a", "int32", items = "int32"}})
+    end
+
+    function TestBSON:test43_Template()
+        local cbson = self.cbson
+        local ordered = cbson.ordered_map_mt
+        local function command(id, tag)
+            return setmetatable({{find = "users"}, {filter = setmetatable({{_id = id}, {tags = {"a", tag}}}, ordered)},
+                {limit = 1}, {comment = id}}, ordered)
+        end
+        local tpl = cbson.template(command(cbson.placeholder(1), cbson.placeholder(2)))
+        luaunit.assertEquals(tostring(tpl), "template (3 placeholders)")
+
+        luaunit.assertEquals(tpl:render("x", "b"), cbson.encode(command("x", "b")))
+        luaunit.assertEquals(tpl:render(cbson.oid("5f1e2d3c4b5a697887766554"), {deep = {value = string.rep("v", 300)}}),
+            cbson.encode(command(cbson.oid("5f1e2d3c4b5a697887766554"), {deep = {value = string.rep("v", 300)}})))
+        -- missing values are null
+        luaunit.assertEquals(tpl:render(), cbson.encode(command(cbson.null(), cbson.null())))
+
+        luaunit.assertEquals(cbson.template({a = 1}):render(), cbson.encode({a = 1}))
+        luaunit.assertError(cbson.placeholder, 0)
+
+        -- placeholders outside of template are errors
+        local P = cbson.placeholder
+        luaunit.assertError(cbson.encode, {x = P(1)})
+        luaunit.assertError(cbson.encode, {x = P(1)}, {presize = true})
+        luaunit.assertError(cbson.encode_first, "x", {x = P(1)})
+        luaunit.assertError(cbson.size, {x = {P(1)}})
+        luaunit.assertError(function() cbson.encode_job({x = P(1)}):step(100) end)
+        luaunit.assertError(tpl.render, tpl, P(1))
+
+        -- failed render keeps nothing and template stays usable
+        local cyclic = {}
+        cyclic.self = cyclic
+        for _ = 1, 100 do
+            luaunit.assertError(tpl.render, tpl, cyclic)
+        end
+        luaunit.assertEquals(tpl:render("x", "b"), cbson.encode(command("x", "b")))
+    end
+
+    function TestBSON:test44_Size()
+        local cbson = self.cbson
+        local docs = {
+            {},
+            {a = 1.5, b = "str", c = true, d = {1, 2, 3}, e = {x = {y = "deep"}}, f = cbson.null()},
+            {o = cbson.oid("5f1e2d3c4b5a697887766554"), bin = cbson.binary("AAAA"), i = cbson.int("99999999999"),
+             d = cbson.date(5), dec = cbson.decimal("1.5"), re = cbson.regex("a.*b", "i"), raw = cbson.encode({q = 1})},
+            setmetatable({{a = 1}, {b = {c = 2}}}, cbson.ordered_map_mt),
+        }
+        for _, doc in ipairs(docs) do
+            local data = cbson.encode(doc)
+            luaunit.assertEquals(cbson.size(doc), #data)
+            luaunit.assertEquals(cbson.encode(doc, {presize = true}), data)
+        end
+        if math.type then
+            luaunit.assertEquals(math.type(cbson.size({a = 1})), "integer")
+        end
+    end
+
+    function TestBSON:test45_Ordered()
+        local cbson = self.cbson
+        local ordered = cbson.ordered_map_mt
+        local flat = cbson.ordered({"find", "users", "sort", cbson.ordered({"b", 1, "a", -1}), "limit", 1})
+        local pairs_form = setmetatable({{find = "users"}, {sort = setmetatable({{b = 1}, {a = -1}}, ordered)}, {limit = 1}}, ordered)
+        local data = cbson.encode(flat)
+
+        luaunit.assertEquals(getmetatable(flat), cbson.ordered_mt)
+        luaunit.assertEquals(data, cbson.encode(pairs_form))
+        luaunit.assertEquals(cbson.encode({cmd = flat}), cbson.encode({cmd = pairs_form}))
+        luaunit.assertEquals(cbson.size(flat), #data)
+        local job = cbson.encode_job(flat)
+        local done, result
+        repeat done, result = job:step(1) until done
+        luaunit.assertEquals(result, data)
+
+        -- nil value is null, pairs end at first missing key
+        luaunit.assertEquals(cbson.encode(cbson.ordered({"a", nil, "b", 2})),
+            cbson.encode(setmetatable({{a = cbson.null()}, {b = 2}}, ordered)))
+        luaunit.assertError(cbson.encode, cbson.ordered({{}, 1}))
+        -- empty entries of ordered map are skipped
+        luaunit.assertEquals(cbson.encode(setmetatable({{a = 1}, {}, {b = 2}}, ordered)),
+            cbson.encode(cbson.ordered({"a", 1, "b", 2})))
+    end
+
+    function TestBSON:test46_Decode_ordered()
+        local cbson = self.cbson
+        local data = cbson.encode(cbson.ordered({"z", 1.5, "a", cbson.ordered({"y", "s", "b", {1.5, 2.5}}), "n", cbson.null()}))
+        local decoded = cbson.decode(data, {ordered = true})
+
+        luaunit.assertEquals(getmetatable(decoded), cbson.ordered_mt)
+        luaunit.assertEquals(decoded[1], "z")
+        luaunit.assertEquals(decoded[3], "a")
+        luaunit.assertEquals(decoded[4][1], "y")
+        luaunit.assertEquals(decoded[4][4], {1.5, 2.5})
+        luaunit.assertEquals(cbson.encode(decoded), data)
+        -- whole sample document keeps its bytes
+        local sample = readAll("input.bson")
+        luaunit.assertEquals(cbson.encode(cbson.decode(sample, {ordered = true})), sample)
+    end
+
+    function TestBSON:test47_Encode_ordered()
+        local cbson = self.cbson
+        local command = {["$db"] = "test", find = "users", filter = {status = "active", age = 21}, sort = {b = 1, a = -1}}
+        local data = cbson.encode_ordered({"find", "filter", "sort", "limit", "find", sort = {"a", "b"}}, command)
+        local decoded = cbson.decode(data, {ordered = true})
+
+        luaunit.assertEquals(decoded[1], "find")
+        luaunit.assertEquals(decoded[3], "filter")
+        luaunit.assertEquals(decoded[5], "sort")
+        luaunit.assertEquals(decoded[6][1], "a")
+        luaunit.assertEquals(decoded[6][3], "b")
+        luaunit.assertEquals(decoded[7], "$db")
+        luaunit.assertEquals(#decoded, 8)
+        luaunit.assertEquals(cbson.decode(data), cbson.decode(cbson.encode(command)))
+        luaunit.assertError(cbson.encode_ordered, {1}, {})
+
+        -- nested key list needs plain subdocument
+        luaunit.assertError(cbson.encode_ordered, {"list", list = {"a"}}, {list = {1, 2}})
+        luaunit.assertError(cbson.encode_ordered, {"pairs", pairs = {"a"}}, {pairs = cbson.ordered({"a", 1})})
+        luaunit.assertEquals(cbson.encode_ordered({"empty", empty = {"a"}}, {empty = {}}), cbson.encode({empty = {}}))
+
+        -- large key list is released when value fails to encode
+        local keys, data = {}, {bad = cbson.placeholder(1)}
+        for i = 1, 100 do
+            keys[i] = "k" .. i
+            data[keys[i]] = i
+        end
+        keys[101] = "bad"
+        for _ = 1, 100 do
+            luaunit.assertError(cbson.encode_ordered, keys, data)
+        end
+    end
+
+    function TestBSON:test48_Encode_cycle()
+        local cbson = self.cbson
+        local function nest(depth, leaf)
+            local t = leaf
+            for _ = 1, depth do t = {a = t} end
+            return t
+        end
+
+        local loop = {x = 1}
+        loop.self = loop
+        local ok, err = pcall(cbson.encode, {doc = loop})
+        luaunit.assertFalse(ok)
+        luaunit.assertStrContains(err, "cycle")
+        luaunit.assertError(cbson.encode, cbson.ordered({"list", {loop}}))
+        luaunit.assertError(cbson.size, loop)
+        -- partly encoded buffer is released, module keeps working
+        for _ = 1, 10 do
+            luaunit.assertError(cbson.encode_first, "x", {x = 1, doc = loop})
+            luaunit.assertError(cbson.encode_ordered, {"doc"}, {doc = loop})
+            luaunit.assertError(cbson.hash, {doc = loop})
+        end
+        luaunit.assertEquals(cbson.decode(cbson.encode({doc = {x = 1}})).doc.x, 1)
+        -- encode called from metamethod while outer encode runs gets its own buffer
+        local nested
+        local proxy = setmetatable({y = 2}, {__index = function() nested = cbson.encode({z = 3}) return 1 end})
+        luaunit.assertEquals(cbson.decode(cbson.encode_first("x", proxy)), {x = 1, y = 2})
+        luaunit.assertEquals(cbson.decode(nested), {z = 3})
+
+        -- shared table isn't a cycle, depth is limited by BSON_MAX_RECURSION
+        local shared = {x = 1}
+        local data = cbson.encode(nest(40, {a = shared, b = shared}))
+        luaunit.assertEquals(cbson.size(nest(40, {a = shared, b = shared})), #data)
+        cbson.encode(nest(101, 1))
+        ok, err = pcall(cbson.encode, nest(102, 1))
+        luaunit.assertFalse(ok)
+        luaunit.assertStrContains(err, "too deep")
+    end
+
 
 TestBSONEncode = {}
 